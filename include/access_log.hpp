@@ -0,0 +1,195 @@
+﻿//
+// Copyright (C) 2013 Jack.
+//
+// Author: jack
+// Email:  jack.wgm@gmail.com
+//
+
+#pragma once
+
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "internal.hpp"
+
+#ifndef HTTP_ACCESS_LOG_ENTRIES
+#	define HTTP_ACCESS_LOG_ENTRIES (1 << 20)	// 每个文件的记录数, 64MB.
+#endif
+
+#ifndef HTTP_ACCESS_LOG_FILES
+#	define HTTP_ACCESS_LOG_FILES 8				// 每个 io_service 保留的文件数.
+#endif
+
+namespace http {
+
+	/// Binary access log file layout, shared by the server and the decoder.
+	///
+	/// A file is an access_log_header followed by header.capacity fixed-size
+	/// access_log_entry records, of which the first header.count are valid.
+	/// All fields are in the byte order of the machine that wrote the file.
+	struct access_log_header
+	{
+		char magic[8];					// "HTTPALOG"
+		boost::uint32_t version;
+		boost::uint32_t entry_size;		// sizeof(access_log_entry)
+		boost::uint64_t capacity;		// 文件能容纳的记录数.
+		boost::uint64_t count;			// 已写入的记录数.
+		boost::uint32_t shard;			// 写入这个文件的 io_service.
+		char reserved[28];
+	};
+
+	struct access_log_entry
+	{
+		boost::uint64_t timestamp;		// 收到请求的时间, UNIX 时间的微秒数.
+		boost::uint32_t latency;		// 从派发请求到回复写出的微秒数.
+		boost::uint32_t bytes;			// 写出的字节数, 含协议头.
+		boost::uint16_t status;			// 0 表示没有回复.
+		boost::uint16_t route;			// http_router 的路由编号, 0 表示没有匹配.
+		boost::uint8_t method;			// access_log_method
+		boost::uint8_t family;			// 4 或 6, 0 表示未知.
+		boost::uint16_t port;			// 对端端口.
+		boost::uint8_t address[16];		// 对端地址, IPv4 只用前 4 字节.
+		char reserved[24];
+	};
+
+	BOOST_STATIC_ASSERT(sizeof(access_log_header) == 64);
+	BOOST_STATIC_ASSERT(sizeof(access_log_entry) == 64);
+
+	const char access_log_magic[8] = { 'H', 'T', 'T', 'P', 'A', 'L', 'O', 'G' };
+	const boost::uint32_t access_log_version = 1;
+
+	enum access_log_method
+	{
+		access_log_other,
+		access_log_get,
+		access_log_head,
+		access_log_post,
+		access_log_put,
+		access_log_delete,
+		access_log_options,
+		access_log_patch,
+		access_log_connect,
+		access_log_trace
+	};
+
+	inline const char* access_log_method_name(boost::uint8_t method)
+	{
+		static const char* const names[] =
+		{ "OTHER", "GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS", "PATCH", "CONNECT", "TRACE" };
+		return method < sizeof(names) / sizeof(names[0]) ? names[method] : names[0];
+	}
+
+	/// Method code of a lower case method name, as request::normalise leaves it.
+	inline boost::uint8_t access_log_method_code(boost::string_ref method)
+	{
+		switch (method.size())
+		{
+		case 3:
+			if (method == "get") return access_log_get;
+			if (method == "put") return access_log_put;
+			break;
+		case 4:
+			if (method == "post") return access_log_post;
+			if (method == "head") return access_log_head;
+			break;
+		case 5:
+			if (method == "patch") return access_log_patch;
+			if (method == "trace") return access_log_trace;
+			break;
+		case 6:
+			if (method == "delete") return access_log_delete;
+			break;
+		case 7:
+			if (method == "options") return access_log_options;
+			if (method == "connect") return access_log_connect;
+			break;
+		}
+		return access_log_other;
+	}
+
+	/// Writes access_log_entry records into memory mapped files.
+	///
+	/// Every io_service has its own set of files and only its own thread may
+	/// record into them, so recording is a 64 byte copy into the mapping with
+	/// no lock and no system call. A background thread creates and maps the
+	/// next file of every shard ahead of time and removes old ones, so when a
+	/// file is full the io thread only swaps in the prepared mapping. Files
+	/// are named
+	/// "access-<start time>-<shard>-<sequence>.bin" in the log directory; the
+	/// oldest are removed once a shard has more than the configured number.
+	class access_log
+		: public boost::noncopyable
+	{
+	public:
+		/// Open one writer for each of shards io_services. Throws
+		/// std::runtime_error if the directory can not be created.
+		access_log(const std::string& directory, std::size_t shards,
+			std::size_t entries_per_file = HTTP_ACCESS_LOG_ENTRIES,
+			std::size_t max_files = HTTP_ACCESS_LOG_FILES);
+		~access_log();
+
+		/// Append an entry. Must be called on the thread of the given shard.
+		/// The entry is dropped if the next file is not ready yet.
+		void record(std::size_t shard, const access_log_entry& entry)
+		{
+			writer& w = *m_writers[shard];
+			if (w.next == w.end && !open_next(w))
+				return;
+			*w.next++ = entry;
+			w.header->count = w.next - w.begin;
+		}
+
+	private:
+		typedef boost::shared_ptr<boost::interprocess::mapped_region> region_ptr;
+
+		struct writer
+		{
+			char padding_front[HTTP_CACHELINE_SIZE];
+			std::size_t shard;
+			boost::interprocess::mapped_region region;
+			access_log_header* header;
+			access_log_entry* begin;
+			access_log_entry* next;
+			access_log_entry* end;
+			// 以下由 m_mutex 保护.
+			region_ptr spare;				// 准备好的下一个文件.
+			std::string spare_path;
+			region_ptr retired;				// 写满的文件, 由后台线程解除映射.
+			// 以下只在后台线程使用.
+			boost::uint64_t sequence;
+			std::deque<std::string> files;
+			char padding_back[HTTP_CACHELINE_SIZE];
+		};
+
+		bool open_next(writer& w);
+		void start_file(writer& w, boost::interprocess::mapped_region& region);
+		region_ptr create_file(writer& w, std::string& path);
+		void run();
+
+	private:
+		std::string m_directory;
+		std::string m_prefix;
+		std::size_t m_entries_per_file;
+		std::size_t m_max_files;
+		std::vector<boost::shared_ptr<writer> > m_writers;
+
+		boost::mutex m_mutex;
+		boost::condition_variable m_wakeup;
+		std::deque<std::size_t> m_pending;	// 等待准备下一个文件的分片.
+		bool m_stopping;
+		boost::thread m_thread;
+	};
+
+}
@@ -0,0 +1,217 @@
+﻿//
+// Copyright (C) 2013 Jack.
+//
+// Author: jack
+// Email:  jack.wgm@gmail.com
+//
+
+#pragma once
+
+#include <new>
+#include <limits>
+#include <vector>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+
+// arena 中每次分配的对齐.
+#ifndef HTTP_ARENA_ALIGNMENT
+#	define HTTP_ARENA_ALIGNMENT 16
+#endif
+
+// arena 不够用时每次向系统申请的最小块大小.
+#ifndef HTTP_ARENA_BLOCK_SIZE
+#	define HTTP_ARENA_BLOCK_SIZE 4096
+#endif
+
+namespace http {
+
+	/// A monotonic arena: allocation bumps a pointer, deallocation does nothing
+	/// (except giving back the most recent allocation, so a growing string can
+	/// reuse its own space), and reset() releases everything at once.
+	///
+	/// The first block is supplied by the owner, usually as a member array.
+	/// Extra blocks are taken from the heap when it runs out and are kept
+	/// across reset(), so after warming up an arena stops allocating. Not
+	/// thread safe.
+	class monotonic_arena
+		: public boost::noncopyable
+	{
+	public:
+		monotonic_arena(char* initial, std::size_t size)
+			: m_initial(initial)
+			, m_initial_size(size)
+			, m_next_block(0)
+		{
+			reset();
+		}
+
+		~monotonic_arena()
+		{
+			for (std::size_t i = 0; i < m_blocks.size(); ++i)
+				::operator delete(m_blocks[i].data);
+		}
+
+		void* allocate(std::size_t n)
+		{
+			n = (n + HTTP_ARENA_ALIGNMENT - 1) & ~std::size_t(HTTP_ARENA_ALIGNMENT - 1);
+			while (static_cast<std::size_t>(m_end - m_current) < n)
+				next_block(n);
+			void* p = m_current;
+			m_current += n;
+			return p;
+		}
+
+		void deallocate(void* p, std::size_t n)
+		{
+			n = (n + HTTP_ARENA_ALIGNMENT - 1) & ~std::size_t(HTTP_ARENA_ALIGNMENT - 1);
+			if (static_cast<char*>(p) + n == m_current)
+				m_current = static_cast<char*>(p);
+		}
+
+		/// Release everything allocated so far. Any object still using the
+		/// arena must have been destroyed or emptied before this call.
+		void reset()
+		{
+			m_current = align(m_initial);
+			m_end = m_initial + m_initial_size;
+			if (m_current > m_end)
+				m_current = m_end;
+			m_next_block = 0;
+		}
+
+	private:
+		static char* align(char* p)
+		{
+			std::size_t offset = reinterpret_cast<std::size_t>(p) & (HTTP_ARENA_ALIGNMENT - 1);
+			return offset ? p + HTTP_ARENA_ALIGNMENT - offset : p;
+		}
+
+		void next_block(std::size_t n)
+		{
+			// 先使用之前申请过的块, 太小的跳过.
+			while (m_next_block < m_blocks.size())
+			{
+				block& b = m_blocks[m_next_block++];
+				if (b.size >= n)
+				{
+					m_current = b.data;
+					m_end = b.data + b.size;
+					return;
+				}
+			}
+
+			block b;
+			b.size = n > HTTP_ARENA_BLOCK_SIZE ? n : HTTP_ARENA_BLOCK_SIZE;
+			b.data = static_cast<char*>(::operator new(b.size));
+			m_blocks.push_back(b);
+			m_next_block = m_blocks.size();
+			m_current = b.data;
+			m_end = b.data + b.size;
+		}
+
+		struct block
+		{
+			char* data;
+			std::size_t size;
+		};
+
+		char* m_initial;
+		std::size_t m_initial_size;
+		char* m_current;
+		char* m_end;
+		std::vector<block> m_blocks;	// ::operator new 返回的内存已经满足对齐.
+		std::size_t m_next_block;
+	};
+
+	/// Standard allocator over a monotonic_arena. A default constructed
+	/// allocator has no arena and uses the heap.
+	///
+	/// Copying a container does not copy its arena: the copy gets a heap
+	/// allocator, so it stays valid after the arena is reset.
+	template <class T>
+	class arena_allocator
+	{
+	public:
+		typedef T value_type;
+		typedef T* pointer;
+		typedef const T* const_pointer;
+		typedef T& reference;
+		typedef const T& const_reference;
+		typedef std::size_t size_type;
+		typedef std::ptrdiff_t difference_type;
+
+		template <class U>
+		struct rebind
+		{
+			typedef arena_allocator<U> other;
+		};
+
+		arena_allocator()
+			: m_arena(0)
+		{}
+
+		explicit arena_allocator(monotonic_arena* arena)
+			: m_arena(arena)
+		{}
+
+		template <class U>
+		arena_allocator(const arena_allocator<U>& other)
+			: m_arena(other.arena())
+		{}
+
+		pointer allocate(size_type n, const void* = 0)
+		{
+			if (m_arena)
+				return static_cast<pointer>(m_arena->allocate(n * sizeof(T)));
+			return static_cast<pointer>(::operator new(n * sizeof(T)));
+		}
+
+		void deallocate(pointer p, size_type n)
+		{
+			if (m_arena)
+				m_arena->deallocate(p, n * sizeof(T));
+			else
+				::operator delete(p);
+		}
+
+		arena_allocator select_on_container_copy_construction() const
+		{
+			return arena_allocator();
+		}
+
+		pointer address(reference x) const { return &x; }
+		const_pointer address(const_reference x) const { return &x; }
+		size_type max_size() const { return (std::numeric_limits<size_type>::max)() / sizeof(T); }
+		void construct(pointer p, const T& value) { new (p) T(value); }
+		void destroy(pointer p) { p->~T(); }
+
+		template <class U, class... Args>
+		void construct(U* p, Args&&... args) { new (p) U(std::forward<Args>(args)...); }
+		template <class U>
+		void destroy(U* p) { p->~U(); }
+
+		monotonic_arena* arena() const
+		{
+			return m_arena;
+		}
+
+	private:
+		monotonic_arena* m_arena;
+	};
+
+	template <class T, class U>
+	inline bool operator==(const arena_allocator<T>& a, const arena_allocator<U>& b)
+	{
+		return a.arena() == b.arena();
+	}
+
+	template <class T, class U>
+	inline bool operator!=(const arena_allocator<T>& a, const arena_allocator<U>& b)
+	{
+		return a.arena() != b.arena();
+	}
+
+	typedef std::basic_string<char, std::char_traits<char>, arena_allocator<char> > arena_string;
+
+}
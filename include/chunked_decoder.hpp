@@ -0,0 +1,185 @@
+﻿//
+// Copyright (C) 2013 Jack.
+//
+// Author: jack
+// Email:  jack.wgm@gmail.com
+//
+
+#pragma once
+
+#include <cstddef>
+
+#include <boost/cstdint.hpp>
+#include <boost/logic/tribool.hpp>
+
+#include "http_parser.hpp"
+
+namespace http {
+
+	/// Incremental decoder for a "Transfer-Encoding: chunked" request body.
+	///
+	/// Input may be split anywhere, even inside a chunk-size line; the state
+	/// is carried between calls and every byte given to decode() is consumed
+	/// exactly once. Chunk data is returned as ranges of the input, never
+	/// copied. Chunk extensions and trailers are skipped, limited together
+	/// to HTTP_MAX_HEADER_SIZE bytes.
+	class chunked_decoder
+	{
+	public:
+		chunked_decoder()
+		{
+			reset();
+		}
+
+		void reset()
+		{
+			m_state = state_size;
+			m_size = 0;
+			m_digits = 0;
+			m_skipped = 0;
+		}
+
+		/// Decode from [p, end), advancing p. Returns:
+		/// - indeterminate with size > 0: [data, data + size) is body data,
+		///   call again to continue;
+		/// - indeterminate with size == 0: all input was consumed, more is needed;
+		/// - true: the body is complete, p is just past it;
+		/// - false: the body is malformed.
+		boost::tribool decode(const char*& p, const char* end, const char*& data, std::size_t& size)
+		{
+			size = 0;
+			while (p != end)
+			{
+				switch (m_state)
+				{
+				case state_size:
+				{
+					int v = hex_value(*p);
+					if (v < 0)
+					{
+						if (m_digits == 0)
+							return false;
+						m_state = state_extension;
+						continue;
+					}
+					// 16 位十六进制之后会溢出.
+					if (++m_digits > 16)
+						return false;
+					m_size = m_size * 16 + v;
+					++p;
+					break;
+				}
+				case state_extension:
+					// chunk-ext 直接跳过, 只找行尾.
+					if (*p == '\r')
+						m_state = state_size_lf;
+					else if (!skip())
+						return false;
+					++p;
+					break;
+				case state_size_lf:
+					if (*p++ != '\n')
+						return false;
+					m_state = m_size ? state_data : state_trailer;
+					break;
+				case state_data:
+				{
+					std::size_t n = static_cast<std::size_t>(end - p);
+					if (n > m_size)
+						n = static_cast<std::size_t>(m_size);
+					data = p;
+					size = n;
+					p += n;
+					m_size -= n;
+					if (m_size == 0)
+						m_state = state_data_cr;
+					return boost::indeterminate;
+				}
+				case state_data_cr:
+					if (*p++ != '\r')
+						return false;
+					m_state = state_data_lf;
+					break;
+				case state_data_lf:
+					if (*p++ != '\n')
+						return false;
+					m_state = state_size;
+					m_digits = 0;
+					break;
+				case state_trailer:
+					// 空行结束 body, 否则是一个 trailer 头部, 跳过.
+					if (*p == '\r')
+					{
+						m_state = state_end_lf;
+						++p;
+					}
+					else
+					{
+						m_state = state_trailer_line;
+					}
+					break;
+				case state_trailer_line:
+					if (*p == '\r')
+						m_state = state_trailer_lf;
+					else if (!skip())
+						return false;
+					++p;
+					break;
+				case state_trailer_lf:
+					if (*p++ != '\n')
+						return false;
+					m_state = state_trailer;
+					break;
+				case state_end_lf:
+					if (*p++ != '\n')
+						return false;
+					m_state = state_done;
+					return true;
+				case state_done:
+					return true;
+				}
+			}
+			return m_state == state_done ? boost::tribool(true) : boost::tribool(boost::indeterminate);
+		}
+
+		bool done() const
+		{
+			return m_state == state_done;
+		}
+
+	private:
+		static int hex_value(char c)
+		{
+			if (c >= '0' && c <= '9') return c - '0';
+			if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+			if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+			return -1;
+		}
+
+		bool skip()
+		{
+			return ++m_skipped <= HTTP_MAX_HEADER_SIZE;
+		}
+
+		enum state
+		{
+			state_size,
+			state_extension,
+			state_size_lf,
+			state_data,
+			state_data_cr,
+			state_data_lf,
+			state_trailer,
+			state_trailer_line,
+			state_trailer_lf,
+			state_end_lf,
+			state_done
+		};
+
+		state m_state;
+		boost::uint64_t m_size;			// 当前 chunk 还没有交出的字节数.
+		std::size_t m_digits;
+		std::size_t m_skipped;			// 已经跳过的 chunk-ext 和 trailer 字节数.
+	};
+
+}
@@ -0,0 +1,70 @@
+﻿//
+// Copyright (C) 2013 Jack.
+//
+// Author: jack
+// Email:  jack.wgm@gmail.com
+//
+
+#pragma once
+
+#include <cstddef>
+#include <ctime>
+
+#include <boost/cstdint.hpp>
+
+namespace http {
+
+	/// A clock for the hot path, read without a system call.
+	///
+	/// Every thread keeps its own copy of the time together with the time
+	/// already formatted as an HTTP date and as a log timestamp. update()
+	/// refreshes the calling thread's copy; the server calls it on every
+	/// io_service thread once a tick (see http_connection_manager::tick),
+	/// so there the time is at most about a second old. A thread that never
+	/// calls update() keeps the time of its first read.
+	class coarse_clock
+	{
+	public:
+		/// Length of "Sun, 06 Nov 1994 08:49:37 GMT".
+		static const std::size_t http_date_size = 29;
+		/// Length of "2014-01-01 12:00:00.000".
+		static const std::size_t log_time_size = 23;
+
+		/// Read the clocks and refresh the calling thread's copy. The
+		/// strings are only formatted again when the second has changed.
+		static void update();
+
+		/// Milliseconds of a monotonic clock with an unspecified start.
+		static boost::uint64_t monotonic_ms();
+
+		/// UNIX time in seconds.
+		static std::time_t unix_time();
+
+		/// The current time as an RFC 7231 IMF-fixdate, http_date_size
+		/// characters and a NUL.
+		static const char* http_date();
+
+		/// The current local time as a log timestamp, log_time_size
+		/// characters and a NUL.
+		static const char* log_timestamp();
+
+		/// UNIX time in microseconds, read from the system clock now. On
+		/// Linux this goes through the vDSO, without entering the kernel.
+		static boost::uint64_t precise_unix_microseconds();
+
+		/// Microseconds of a monotonic clock with an unspecified start, read
+		/// now. Use it for elapsed times, which must not jump with the
+		/// system clock.
+		static boost::uint64_t precise_monotonic_microseconds();
+
+		/// Format t as an IMF-fixdate into out, which must hold
+		/// http_date_size + 1 characters.
+		static void format_http_date(std::time_t t, char* out);
+
+		/// Format UNIX microseconds as a local log timestamp into out, which
+		/// must hold log_time_size + 1 characters. The date and time of day
+		/// are cached per thread, so localtime is only called once a second.
+		static void format_log_time(boost::uint64_t unix_microseconds, char* out);
+	};
+
+}
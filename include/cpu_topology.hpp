@@ -0,0 +1,55 @@
+﻿//
+// Copyright (C) 2013 Jack.
+//
+// Author: jack
+// Email:  jack.wgm@gmail.com
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace http {
+
+	/// The processors of the machine and how they are grouped into physical
+	/// cores, packages and NUMA nodes.
+	///
+	/// On Linux the layout is read from sysfs and limited to the CPUs the
+	/// process may run on. Elsewhere every logical processor is treated as its
+	/// own core on node 0.
+	class cpu_topology
+	{
+	public:
+		struct cpu
+		{
+			int id;			// 逻辑 CPU 编号.
+			int core;		// 物理核心, 在 package 内编号.
+			int package;
+			int node;		// NUMA 节点.
+		};
+
+		/// Read the topology of the running machine.
+		static cpu_topology detect();
+
+		/// Parse a CPU list such as "0-3,8,10-11" or a hex mask such as
+		/// "0xff00". Returns false on malformed input, on a reversed range
+		/// and on CPU numbers that cannot be pinned to: CPU_SETSIZE and up,
+		/// or 64 and up on Windows.
+		static bool parse_cpu_list(const std::string& text, std::vector<int>& cpus);
+
+		/// The order in which to pin threads: one CPU of every physical core
+		/// first, alternating between NUMA nodes, then the SMT siblings.
+		/// Limited to the given CPUs when the list is not empty.
+		std::vector<int> layout(const std::vector<int>& allowed = std::vector<int>()) const;
+
+		const std::vector<cpu>& cpus() const
+		{
+			return m_cpus;
+		}
+
+	private:
+		std::vector<cpu> m_cpus;
+	};
+
+}
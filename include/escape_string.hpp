@@ -18,6 +18,7 @@
 #include <boost/archive/iterators/ostream_iterator.hpp>
 
 #include "utf8.hpp"
+#include "url_decode.hpp"
 
 namespace http {
 namespace detail {
@@ -97,60 +98,13 @@ inline std::string escape_path(const std::string& s)
 	return ret;
 }
 
-inline bool unescape_path(const std::string& in, std::string& out)
+// plus_as_space 为 false 时 '+' 保持原样, 用于 URI 的路径部分.
+// 只有不完整的 %XX 会返回 false, 其它字节原样保留.
+template <class InString, class OutString>
+inline bool unescape_path(const InString& in, OutString& out, bool plus_as_space = true)
 {
 	out.clear();
-	out.reserve(in.size());
-	for (std::size_t i = 0; i < in.size(); ++i)
-	{
-		switch (in[i])
-		{
-		case '%':
-			if (i + 3 <= in.size())
-			{
-				unsigned int value = 0;
-				for (std::size_t j = i + 1; j < i + 3; ++j)
-				{
-					switch (in[j])
-					{
-					case '0': case '1': case '2': case '3': case '4':
-					case '5': case '6': case '7': case '8': case '9':
-						value += in[j] - '0';
-						break;
-					case 'a': case 'b': case 'c': case 'd': case 'e': case 'f':
-						value += in[j] - 'a' + 10;
-						break;
-					case 'A': case 'B': case 'C': case 'D': case 'E': case 'F':
-						value += in[j] - 'A' + 10;
-						break;
-					default:
-						return false;
-					}
-					if (j == i + 1)
-						value <<= 4;
-				}
-				out += static_cast<char>(value);
-				i += 2;
-			}
-			else
-				return false;
-			break;
-		case '+':
-			out += ' ';
-			break;
-		case '-': case '_': case '.': case '!': case '~': case '*':
-		case '\'': case '(': case ')': case ':': case '@': case '&':
-		case '=': case '$': case ',': case '/': case ';':
-			out += in[i];
-			break;
-		default:
-			if (!std::isalnum((unsigned char)in[i]))
-				return false;
-			out += in[i];
-			break;
-		}
-	}
-	return true;
+	return url_decode(boost::string_ref(in.data(), in.size()), out, plus_as_space);
 }
 
 // template <typename Source>
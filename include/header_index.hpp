@@ -0,0 +1,258 @@
+﻿//
+// Copyright (C) 2013 Jack.
+//
+// Author: jack
+// Email:  jack.wgm@gmail.com
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+
+#include <boost/cstdint.hpp>
+#include <boost/utility/string_ref.hpp>
+
+// 非常用头部的哈希表槽数, 必须是 2 的幂. 头部更多时退化为线性查找.
+#ifndef HTTP_HEADER_HASH_SLOTS
+#	define HTTP_HEADER_HASH_SLOTS 32
+#endif
+
+namespace http {
+
+	/// Headers interned by the request parser. A request can look these
+	/// up by slot without comparing names.
+	enum header_id
+	{
+		header_accept,
+		header_accept_encoding,
+		header_accept_language,
+		header_authorization,
+		header_cache_control,
+		header_connection,
+		header_content_length,
+		header_content_type,
+		header_cookie,
+		header_expect,
+		header_host,
+		header_if_match,
+		header_if_modified_since,
+		header_if_none_match,
+		header_if_range,
+		header_if_unmodified_since,
+		header_origin,
+		header_range,
+		header_referer,
+		header_transfer_encoding,
+		header_upgrade,
+		header_user_agent,
+		header_x_forwarded_for,
+		header_x_real_ip,
+
+		header_known_count,
+		header_other = header_known_count	// 不在上面的头部.
+	};
+
+	/// Lower case name of an interned header.
+	inline boost::string_ref header_name(header_id id)
+	{
+		static const char* const names[header_known_count] =
+		{
+			"accept", "accept-encoding", "accept-language", "authorization",
+			"cache-control", "connection", "content-length", "content-type",
+			"cookie", "expect", "host", "if-match", "if-modified-since",
+			"if-none-match", "if-range", "if-unmodified-since", "origin",
+			"range", "referer", "transfer-encoding", "upgrade", "user-agent",
+			"x-forwarded-for", "x-real-ip"
+		};
+		return id < header_known_count ? boost::string_ref(names[id]) : boost::string_ref();
+	}
+
+namespace detail {
+
+	inline char ascii_lower(char c)
+	{
+		return (c >= 'A' && c <= 'Z') ? static_cast<char>(c + ('a' - 'A')) : c;
+	}
+
+	/// ASCII case-insensitive comparison, for header names.
+	inline bool iequals(boost::string_ref a, boost::string_ref b)
+	{
+		if (a.size() != b.size())
+			return false;
+		for (std::size_t i = 0; i < a.size(); ++i)
+		{
+			if (ascii_lower(a[i]) != ascii_lower(b[i]))
+				return false;
+		}
+		return true;
+	}
+
+	/// Case-insensitive FNV-1a.
+	inline boost::uint32_t header_hash(boost::string_ref name)
+	{
+		boost::uint32_t h = 2166136261u;
+		for (std::size_t i = 0; i < name.size(); ++i)
+			h = (h ^ static_cast<unsigned char>(ascii_lower(name[i]))) * 16777619u;
+		return h;
+	}
+
+} // namespace detail
+
+	/// Intern a header name, in any case. Returns header_other if it is not
+	/// one of the known headers. The length and one or two characters pick
+	/// the only candidate, so at most one comparison is made.
+	inline header_id find_header_id(boost::string_ref name)
+	{
+		if (name.size() < 4)
+			return header_other;
+		char c = detail::ascii_lower(name[0]);
+		header_id id = header_other;
+		switch (name.size())
+		{
+		case 4: id = header_host; break;
+		case 5: id = header_range; break;
+		case 6:
+			id = c == 'a' ? header_accept : c == 'c' ? header_cookie
+				: c == 'e' ? header_expect : c == 'o' ? header_origin : header_other;
+			break;
+		case 7: id = c == 'r' ? header_referer : c == 'u' ? header_upgrade : header_other; break;
+		case 8: id = detail::ascii_lower(name[3]) == 'm' ? header_if_match : header_if_range; break;
+		case 9: id = header_x_real_ip; break;
+		case 10: id = c == 'c' ? header_connection : c == 'u' ? header_user_agent : header_other; break;
+		case 12: id = header_content_type; break;
+		case 13:
+			id = c == 'a' ? header_authorization : c == 'c' ? header_cache_control
+				: c == 'i' ? header_if_none_match : header_other;
+			break;
+		case 14: id = header_content_length; break;
+		case 15:
+			id = c == 'x' ? header_x_forwarded_for
+				: detail::ascii_lower(name[7]) == 'e' ? header_accept_encoding : header_accept_language;
+			break;
+		case 17: id = c == 'i' ? header_if_modified_since : header_transfer_encoding; break;
+		case 19: id = header_if_unmodified_since; break;
+		}
+		if (id != header_other && !detail::iequals(name, header_name(id)))
+			return header_other;
+		return id;
+	}
+
+	/// Index of the headers of a request, by position in its header list.
+	///
+	/// Known headers have a slot each. The others go into a small
+	/// open-addressed table keyed by their hash, probed linearly; if it
+	/// fills up, the headers that did not fit are found by a linear scan.
+	/// When a header appears more than once the first one is indexed.
+	class header_index
+	{
+	public:
+		static const boost::uint16_t npos = 0xffff;
+
+		header_index()
+		{
+			clear();
+		}
+
+		void clear()
+		{
+			std::memset(m_known, 0xff, sizeof(m_known));
+			std::memset(m_other, 0xff, sizeof(m_other));
+			m_count = 0;
+			m_overflow = false;
+		}
+
+		/// Number of headers indexed so far.
+		std::size_t size() const { return m_count; }
+
+		/// Index the next header of the list, at position size(). headers is
+		/// the list, anything whose elements have a name convertible to
+		/// boost::string_ref.
+		template <class Headers>
+		void add(header_id id, const Headers& headers)
+		{
+			boost::string_ref name(headers[m_count].name.data(), headers[m_count].name.size());
+			std::size_t position = m_count++;
+			if (position >= npos)
+			{
+				m_overflow = true;
+				return;
+			}
+			if (id != header_other)
+			{
+				if (m_known[id] == npos)
+					m_known[id] = static_cast<boost::uint16_t>(position);
+				return;
+			}
+
+			boost::uint32_t hash = detail::header_hash(name);
+			for (std::size_t i = 0; i < HTTP_HEADER_HASH_SLOTS; ++i)
+			{
+				slot& s = m_other[(hash + i) & (HTTP_HEADER_HASH_SLOTS - 1)];
+				if (s.position == npos)
+				{
+					s.hash = hash;
+					s.position = static_cast<boost::uint16_t>(position);
+					return;
+				}
+				// 同名的头部已经在表里.
+				if (s.hash == hash && detail::iequals(name, name_at(headers, s.position)))
+					return;
+			}
+			m_overflow = true;
+		}
+
+		/// Position of a known header, or npos.
+		std::size_t find(header_id id) const
+		{
+			return id < header_known_count ? m_known[id] : npos;
+		}
+
+		/// Position of a header in headers by name, in any case, or npos.
+		template <class Headers>
+		std::size_t find(boost::string_ref name, const Headers& headers) const
+		{
+			header_id id = find_header_id(name);
+			if (id != header_other)
+				return m_known[id];
+
+			boost::uint32_t hash = detail::header_hash(name);
+			for (std::size_t i = 0; i < HTTP_HEADER_HASH_SLOTS; ++i)
+			{
+				const slot& s = m_other[(hash + i) & (HTTP_HEADER_HASH_SLOTS - 1)];
+				if (s.position == npos)
+					break;
+				if (s.hash == hash && detail::iequals(name, name_at(headers, s.position)))
+					return s.position;
+			}
+			if (m_overflow)
+			{
+				for (std::size_t i = 0; i < m_count; ++i)
+				{
+					if (detail::iequals(name, name_at(headers, i)))
+						return i;
+				}
+			}
+			return npos;
+		}
+
+	private:
+		template <class Headers>
+		static boost::string_ref name_at(const Headers& headers, std::size_t position)
+		{
+			return boost::string_ref(headers[position].name.data(), headers[position].name.size());
+		}
+
+		struct slot
+		{
+			boost::uint32_t hash;
+			boost::uint16_t position;
+		};
+
+		boost::uint16_t m_known[header_known_count];
+		slot m_other[HTTP_HEADER_HASH_SLOTS];
+		std::size_t m_count;
+		bool m_overflow;
+	};
+
+}
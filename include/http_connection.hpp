@@ -7,12 +7,23 @@
 
 #pragma once
 
-#include <set>
+#include <list>
+#include <deque>
 
+#include <boost/array.hpp>
+#include <boost/atomic.hpp>
+#include <boost/lockfree/stack.hpp>
+#include <boost/static_assert.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/logic/tribool.hpp>
 #include <boost/tuple/tuple.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/progress.hpp>
@@ -24,20 +35,157 @@ using boost::asio::ip::tcp;
 using namespace boost::posix_time;
 
 #include "internal.hpp"
+#include "coarse_clock.hpp"
+#include "io_service_pool.hpp"
 #include "http_helper.hpp"
+#include "http_parser.hpp"
+#include "chunked_decoder.hpp"
+#include "static_file.hpp"
+#include "http_metrics.hpp"
 #include "logging.hpp"
+#include "timing_wheel.hpp"
+#include "tls_socket.hpp"
+
+// 每个连接的接收缓冲区大小, 必须大于 HTTP_MAX_HEADER_SIZE.
+#ifndef HTTP_RECEIVE_BUFFER_SIZE
+#	define HTTP_RECEIVE_BUFFER_SIZE 16384
+#endif
+BOOST_STATIC_ASSERT(HTTP_RECEIVE_BUFFER_SIZE > HTTP_MAX_HEADER_SIZE);
+
+// 一个连接上最多允许多少个 pipelining 请求在等待回复.
+#ifndef HTTP_MAX_PIPELINE_DEPTH
+#	define HTTP_MAX_PIPELINE_DEPTH 16
+#endif
+
+// 一次 gather write 最多合并多少个回复.
+#ifndef HTTP_MAX_WRITE_BATCH
+#	define HTTP_MAX_WRITE_BATCH 64
+#endif
+
+// 每个连接内置的 arena 大小, 用于存放解析出来的请求, 不够时再向系统申请.
+#ifndef HTTP_ARENA_INLINE_SIZE
+#	define HTTP_ARENA_INLINE_SIZE 4096
+#endif
+
+// 每个 io_service 最多缓存多少个空闲的连接对象, 不能超过 65535.
+#ifndef HTTP_CONNECTION_FREE_LIST
+#	define HTTP_CONNECTION_FREE_LIST 256
+#endif
+
+// 启动时为每个 io_service 预先分配的连接对象数.
+#ifndef HTTP_CONNECTION_PREALLOCATE
+#	define HTTP_CONNECTION_PREALLOCATE 16
+#endif
+
+// TLS 连接上小于这个值的写缓冲区先复制到一起再加密, 见 http_connection::coalesce_buffers.
+#ifndef HTTP_TLS_COALESCE_SIZE
+#	define HTTP_TLS_COALESCE_SIZE 16384
+#endif
+
+// chunked 回复排队等待写出的字节数超过这个值时, chunked_response::write 返回 false.
+#ifndef HTTP_CHUNKED_HIGH_WATER
+#	define HTTP_CHUNKED_HIGH_WATER 262144
+#endif
 
 namespace http {
 
+	/// 连接的各种超时, 单位为秒, 0 表示不限制.
+	struct http_timeouts
+	{
+		http_timeouts()
+			: header_read(30)
+			, body_read(60)
+			, keep_alive(60)
+			, write(60)
+			, response(60)
+		{}
+
+		std::size_t header_read;	// 从收到请求的第一个字节起, 读完整个头部的时间.
+		std::size_t body_read;		// 读完 body 的时间.
+		std::size_t keep_alive;		// 两个请求之间允许空闲的时间.
+		std::size_t write;			// 写出一批回复的时间.
+		std::size_t response;		// 处理函数返回后, 等待它从其它线程回复的时间.
+	};
+
 	class http_server;
+	struct http_route;
 	class http_connection_manager;
+	class http_connection;
+	typedef boost::shared_ptr<http_connection> http_connection_ptr;
+	class chunked_response;
+	typedef boost::shared_ptr<chunked_response> chunked_response_ptr;
+
+	/// A response whose body is written in pieces with
+	/// "Transfer-Encoding: chunked", created by http_connection::write_chunked.
+	///
+	/// write() and finish() may be called from any thread; pieces go out in
+	/// the order they were written, each as one chunk, without being copied.
+	/// write() returns false once more than HTTP_CHUNKED_HIGH_WATER bytes
+	/// are queued but not yet written to the socket. A producer should then
+	/// stop and continue from the handler of a write, which is called on the
+	/// connection's thread after that piece has been written, so a slow
+	/// client holds at most about that much memory.
+	///
+	/// To an HTTP/1.0 client the pieces are written unframed and the
+	/// connection is closed after the last one.
+	class chunked_response
+		: public boost::enable_shared_from_this<chunked_response>
+		, public boost::noncopyable
+	{
+		friend class http_connection;
+	public:
+		typedef boost::function<void()> written_handler;
+
+		explicit chunked_response(http_connection_ptr connection);
+
+		/// Queue a piece of the body. handler, if given, is called once the
+		/// piece has been written; it is dropped without being called if the
+		/// connection closes first. An empty piece writes nothing and only
+		/// waits for the pieces before it. Returns false if the producer should
+		/// wait for a handler before writing more, or if the connection is gone.
+		bool write(std::string data, written_handler handler = written_handler());
+		/// End the response. Nothing may be written after this.
+		void finish();
+		/// The connection was closed; pieces written now are dropped.
+		bool closed() const;
+		/// Bytes written but not yet sent to the socket.
+		std::size_t queued() const;
+
+	private:
+		struct piece
+		{
+			boost::array<char, 20> size_line;		// 十六进制的 chunk 长度和 "\r\n".
+			std::size_t size_line_length;
+			std::string data;
+			written_handler handler;
+		};
+		typedef boost::shared_ptr<piece> piece_ptr;
+
+		// 以下只在连接的线程上调用.
+		// 释放已经写出的分段并调用它们的 handler.
+		void written();
+		// 断开与连接的相互引用, 之后的 write 都被丢弃.
+		void close();
+
+		http_connection_ptr m_connection;		// 用 boost::atomic_load / atomic_store 访问.
+		boost::atomic<std::size_t> m_queued;
+		boost::atomic<bool> m_closed;
+		// 以下只在连接的线程上访问.
+		std::deque<piece_ptr> m_pieces;			// 还没有写出的分段.
+		std::size_t m_sending;					// m_pieces 头部正在写出的分段数.
+		std::size_t m_bytes;					// 已经交给 socket 的字节数, 含协议头和分段格式.
+		bool m_head_sent;
+		bool m_finished;
+	};
 
 	class http_connection
 		: public boost::enable_shared_from_this<http_connection>
 		, public boost::noncopyable
 	{
+		friend class http_connection_manager;
+		friend class chunked_response;
 	public:
-		explicit http_connection(boost::asio::io_service& io, http_server&, http_connection_manager*);
+		explicit http_connection(boost::asio::io_service& io, std::size_t shard, http_server&, http_connection_manager*);
 		~http_connection();
 
 	public:
@@ -45,68 +193,579 @@ namespace http {
 		void stop();
 
 		tcp::socket& socket();
+		boost::asio::io_service& get_io_service();
+		// 当前线程是否是连接所属 io_service 的线程.
+		bool running_in_this_thread() const;
+		// 连接所属 io_service 在 io_service_pool 中的序号.
+		std::size_t shard() const;
 
 	public:
+		// 以下 write_response 可以在任意线程调用, 回复按请求的顺序写出.
 		// 为了简化实现, 只返回 HTTP 200
-		void write_response(const std::string&);
+		// body 以 move 的方式交给连接, 不会被复制; 传左值时会有一次复制.
+		void write_response(std::string body);
+		// 同上, 但 body 由调用者共享持有, 适合反复发送的同一份数据. 空指针表示空的 body.
+		void write_response(boost::shared_ptr<const std::string> body);
 		// 如果需要。请自行设置HTTP协议头
-		void write_response(const std::string& head, const std::string& body);
+		void write_response(std::string head, std::string body);
+		// 开始一个 chunked 回复, 见 chunked_response. head 是以空行结束的协议头,
+		// 其中不要有 Content-Length, 这里会加上 Transfer-Encoding; 为空时使用
+		// HTTP 200 和 application/json.
+		chunked_response_ptr write_chunked(std::string head = std::string());
+		// 协议头之后写出文件中 [offset, offset + length) 的内容, 用 sendfile 或者文件的映射,
+		// 不经过用户态的缓冲区. head 中的 Content-Length 必须是 length.
+		void write_file(std::string head, static_file_ptr file, boost::uint64_t offset, boost::uint64_t length);
+
+	public:
+		// 流式接收 body 时 (见 http_route_options::on_body) 暂停读取后续的 body.
+		// 只能在 on_body 中调用.
+		void pause_body();
+		// 继续读取 body, 可以在任意线程调用.
+		void resume_body();
 	private:
+		// TLS 握手, 见 http_server::enable_tls. 有握手线程时在这里等待对端的数据,
+		// 握手的计算在握手线程上执行.
+		void start_handshake();
+		void wait_handshake();
+		void handle_handshake_readable(const boost::system::error_code& error);
+		void run_handshake();
+		void handle_handshake(const boost::system::error_code& error);
+		void handle_handshake_flushed(const boost::system::error_code& result, const boost::system::error_code& error);
+
+		// 读写经过 TLS 或者直接使用 socket.
+		template <class MutableBuffers, class Handler>
+		void stream_read_some(const MutableBuffers& buffers, const Handler& handler)
+		{
+			if (m_ssl)
+				m_ssl->async_read_some(buffers, handler);
+			else
+				m_socket.async_read_some(buffers, handler);
+		}
+		template <class MutableBuffers, class Handler>
+		void stream_read(const MutableBuffers& buffers, const Handler& handler)
+		{
+			if (m_ssl)
+				boost::asio::async_read(*m_ssl, buffers, handler);
+			else
+				boost::asio::async_read(m_socket, buffers, handler);
+		}
+		template <class ConstBuffers, class Handler>
+		void stream_write(const ConstBuffers& buffers, const Handler& handler)
+		{
+			if (m_ssl)
+				boost::asio::async_write(*m_ssl, buffers, handler);
+			else
+				boost::asio::async_write(m_socket, buffers, handler);
+		}
+		// ssl::stream 每次只加密写出第一个缓冲区, 把 m_write_buffers 中相邻的小缓冲区复制到一起.
+		void coalesce_buffers();
+
+		void read_headers();
 		void handle_read_headers(const boost::system::error_code& error, std::size_t bytes_transferred);
+		bool handle_headers();
 		void handle_read_body(const boost::system::error_code& error, std::size_t bytes_transferred);
+		// 把接收缓冲区中属于 body 的部分交给 on_body 或解码 chunked 的 body, 不够时继续读.
+		bool receive_body();
+		void handle_receive_body(const boost::system::error_code& error, std::size_t bytes_transferred);
+		void handle_resume_body();
+		bool dispatch_request();
+		void consume(std::size_t bytes);
 		void handle_write_http(const boost::system::error_code& error, std::size_t bytes_transferred);
+		// 一批回复的最后一个带有文件时, 协议头写出后用 sendfile 写出文件内容.
+		void send_file();
+		void handle_send_file(const boost::system::error_code& error);
+
+		// 一个等待写出的回复, 以 gather write 的方式写出:
+		// 状态行 + Content-Length 值 + body, 或 调用者的协议头 + body.
+		// 派发请求时就按顺序占好位置, 回复内容可以稍后从任意线程填入.
+		// 同一时刻最多只有一个位置在等待其它线程的回复.
+		struct pending_response
+		{
+			pending_response();
+			void take_content(pending_response& other);
+			// 追加回复的全部内容, 同时在协议头中填入 Date. map_file 为 true 时
+			// 文件内容也以映射的方式追加, 否则由 sendfile 另外写出.
+			void append_buffers(std::vector<boost::asio::const_buffer>& buffers, bool map_file);
+			// 追加 chunked 回复中还没有写出的部分, 回复全部写完时返回 true.
+			bool append_chunked_buffers(std::vector<boost::asio::const_buffer>& buffers);
+			std::size_t size() const;
+			boost::uint16_t status_code() const;
+
+			bool ready;									// 回复内容已经填入.
+			bool http10;								// 对应的请求是 HTTP/1.0.
+			bool close;									// 写完后断开连接.
+			bool status;								// 使用预先生成的 200 状态行.
+			bool interim;								// "100 Continue", 不是请求的最终回复.
+			boost::array<char, 48> content_length;		// Content-Length 头部和结束头部的 "\r\n\r\n".
+			std::size_t content_length_size;
+			boost::array<char, 6 + coarse_clock::http_date_size + 2> date;	// "Date: ...\r\n", 写出时填入.
+			bool dated;									// 写出了 date.
+			std::size_t date_offset;					// date 插在 head 中的位置, 0 表示不在 head 中.
+			std::string head;							// 调用者自己设置的协议头.
+			std::string body;
+			boost::shared_ptr<const std::string> shared_body;
+			chunked_response_ptr chunked;				// 分段写出的回复, 写完之前一直在队列头部.
+			static_file_ptr file;						// 跟在协议头之后的文件内容.
+			boost::uint64_t file_offset;
+			boost::uint64_t file_length;
+			boost::uint64_t file_sent;					// sendfile 已经写出的字节数.
+			boost::uint64_t started;					// 派发请求时单调时钟的微秒数, 只在记录访问日志或统计时设置.
+			boost::uint64_t timestamp;					// 派发请求时的 UNIX 微秒数, 只在记录访问日志时设置.
+			boost::uint16_t route;
+			boost::uint8_t method;
+		};
+		void deliver_response(pending_response& response);
+		void fill_shared_response(boost::shared_ptr<pending_response> response);
+		void reserve_response();
+		void fill_response(pending_response& response);
+		void write_pending();
+		// chunked_response 的分段和结束, 在连接的线程上执行.
+		void append_chunk(chunked_response_ptr response, chunked_response::piece_ptr piece);
+		void finish_chunked(chunked_response_ptr response);
+		void release_empty_chunks(chunked_response_ptr response);
+		// 回复 "100 Continue", 让客户端开始发送 body.
+		void send_continue();
+		void log_access(const pending_response& response);
+
+		enum timeout_kind
+		{
+			timeout_none,
+			timeout_header,
+			timeout_body,
+			timeout_keep_alive,
+			timeout_response
+		};
+		void arm_read_timer(timeout_kind kind);
+		void handle_read_timeout();
+		void handle_timeout();
+		// 等待处理函数回复时不读 socket, 只等 socket 可读, 以便发现对端断开.
+		void watch_peer();
+		void handle_peer_readable(const boost::system::error_code& error);
+		// 断开连接并按原因计数.
+		void disconnect(http_metrics::disconnect_reason reason);
+
+		// 回收到空闲列表前清理上一个连接的状态, 保留已分配的内存.
+		void reset();
+		// 丢弃所有等待写出的回复, 同时更新 io_service 的负载计数.
+		void clear_write_queue();
+		// 关闭队列中所有的 chunked 回复.
+		void clear_chunked();
+
 	private:
 		boost::asio::io_service& m_io_service;
+		std::size_t m_shard;				// 所属 io_service 在 io_service_pool 中的序号.
+		io_service_pool::load_counters& m_load;
+		std::list<http_connection_ptr>::iterator m_registry_pos;
+		bool m_registered;
+		bool m_counted;					// 已经计入 io_service 的连接数.
+		timing_wheel::timer m_read_timer;
+		timing_wheel::timer m_write_timer;
+		timeout_kind m_read_timeout;
 		http_server& m_server;
 		tcp::socket m_socket;
+		boost::scoped_ptr<ssl_stream> m_ssl;	// TLS 连接的加密层, 每个连接新建.
+		bool m_handshaking;					// 握手线程正在使用 m_ssl 和 socket.
+		tcp::endpoint m_peer;				// 只在记录访问日志时设置.
+		bool m_peer_known;					// m_peer 取到了对端地址.
 		http_connection_manager* m_connection_manager;
-		boost::asio::streambuf m_request;
-		boost::asio::streambuf m_response;
-		request_parser m_request_parser;
+		boost::array<char, HTTP_RECEIVE_BUFFER_SIZE> m_recv_buffer;
+		std::size_t m_recv_begin;		// 未解析数据的起始位置.
+		std::size_t m_recv_end;			// 已接收数据的结束位置.
+		std::deque<pending_response> m_write_queue;
+		std::size_t m_responses_ready;		// 队列头部已经填好内容的回复数.
+		std::size_t m_responses_writing;	// 正在写出的完整回复数.
+		bool m_chunk_writing;				// 正在写出的还有一个 chunked 回复的一部分.
+		bool m_file_writing;				// 这一批的最后一个回复还要用 sendfile 写出文件.
+		bool m_writing;
+		std::vector<boost::asio::const_buffer> m_write_buffers;
+		std::vector<boost::asio::const_buffer> m_coalesced_buffers;
+		std::vector<char> m_coalesce_buffer;	// TLS 连接上合并的小缓冲区.
+		boost::thread::id m_thread_id;		// 连接所属 io_service 的线程.
+		bool m_read_paused;
+		bool m_awaiting_response;			// 在等待其它线程填入回复, 暂停解析.
+		bool m_watching_peer;				// 有一个 watch_peer 的操作还没有完成.
+		fast_request_parser m_request_parser;
+		request_view m_request_view;
+		boost::array<char, HTTP_ARENA_INLINE_SIZE> m_arena_buffer;
+		monotonic_arena m_arena;			// 当前请求的 method, uri, headers 等, 每个请求开始时整体释放.
 		request m_http_request;
+		const http_route* m_route;			// 当前请求匹配的路由, 在收到头部时查找.
+		boost::uint64_t m_body_remaining;	// 有 Content-Length 的流式 body 还没有交出的字节数.
+		chunked_decoder m_chunked_decoder;
+		bool m_body_paused;
 		bool m_abort;
 	};
 
 
-	typedef boost::shared_ptr<http_connection> http_connection_ptr;
+	/// Keeps track of live connections, one shard per io_service in the pool.
+	///
+	/// A connection is only ever added to and removed from the shard of the
+	/// io_service it runs on, and only from that io_service's thread, so the
+	/// hot path takes no lock. Calls made from other threads are posted to the
+	/// owning io_service.
+	///
+	/// Connection objects are recycled: when the last reference to one is
+	/// dropped it is reset on its own io_service and pushed onto a lock-free
+	/// free list of its shard, and create() hands it out again instead of
+	/// allocating.
+	///
+	/// The shards live in a state shared with the deleters of all connections
+	/// and with the tasks posted to the io_services, so a connection released
+	/// after the manager is gone finds them still there; it is then deleted
+	/// instead of recycled. The destructor first stops every shard on its own
+	/// io_service, and must not run on one of the pool's threads while they
+	/// are running.
 	class http_connection_manager
 		: private boost::noncopyable
 	{
+		struct shared_state;
+		typedef boost::shared_ptr<shared_state> state_ptr;
+
 	public:
+		explicit http_connection_manager(io_service_pool& pool)
+			: m_io_service_pool(pool)
+			, m_state(boost::make_shared<shared_state>(boost::ref(pool)))
+		{
+			for (std::size_t i = 0; i < pool.size(); ++i)
+				m_state->shards.push_back(boost::make_shared<shard>());
+		}
+
+		~http_connection_manager()
+		{
+			// 先在各自的线程上停止所有连接; 停止时释放的连接还会回收, 之后释放的直接删除.
+			drain_latch latch(m_state->shards.size());
+			for (std::size_t i = 0; i < m_state->shards.size(); ++i)
+			{
+				boost::asio::io_service& io = m_io_service_pool.get_io_service(i);
+				boost::shared_ptr<drain_guard> guard = boost::make_shared<drain_guard>(boost::ref(latch));
+				// 没有在运行的 io_service 不会再执行投递的任务, 直接在这里停止.
+				if (io.stopped())
+					stop_shard(m_state, i);
+				else
+					io.post(boost::bind(&http_connection_manager::drain_shard, m_state, i, guard));
+			}
+			latch.wait();
+
+			m_state->alive = false;
+			for (std::size_t i = 0; i < m_state->shards.size(); ++i)
+				delete_free_list(*m_state->shards[i]);
+		}
+
+		/// Take a connection for the given io_service from the free list, or
+		/// allocate one if the list is empty. Safe to call from any thread.
+		/// The connection does not count towards the io_service's load until
+		/// it is started with an accepted socket.
+		http_connection_ptr create(std::size_t shard_index, http_server& server)
+		{
+			http_connection* c = 0;
+			shard& s = *m_state->shards[shard_index];
+			if (!s.free_list.pop(c))
+			{
+				// 空闲列表用完时这一个只能在调用者的线程上分配, 同时让目标线程补充一批,
+				// 之后的连接又在它自己的节点上分配.
+				c = new http_connection(m_io_service_pool.get_io_service(shard_index), shard_index, server, this);
+				if (!s.refilling.exchange(true))
+					m_io_service_pool.get_io_service(shard_index).post(
+						boost::bind(&http_connection_manager::refill_shard, m_state, this, shard_index, boost::ref(server)));
+			}
+			return http_connection_ptr(c, recycler(m_state));
+		}
+
+		/// Allocate count connections up front for every io_service. The
+		/// allocation runs on each io_service's own thread once the pool is
+		/// running, so the memory is first touched, and placed, on the NUMA
+		/// node of the thread that will use it.
+		void preallocate(std::size_t count, http_server& server)
+		{
+			for (std::size_t i = 0; i < m_state->shards.size(); ++i)
+				m_io_service_pool.get_io_service(i).post(
+					boost::bind(&http_connection_manager::preallocate_shard, m_state, this, i, count, boost::ref(server)));
+		}
+
 		/// Add the specified connection to the manager and start it.
+		/// Must be called on the connection's io_service. The connection
+		/// counts towards the io_service's load from here until it is
+		/// released.
 		void start(http_connection_ptr c)
 		{
-			boost::mutex::scoped_lock l(m_mutex);
-			m_connections.insert(c);
-			c->start();
+			count(c);
+			start_connection(m_state, c);
+		}
+
+		/// Start the connection on its own io_service, from any thread. It is
+		/// counted right away, so placement decisions made during an accept
+		/// burst already see the connections placed before them.
+		void post_start(http_connection_ptr c)
+		{
+			count(c);
+			c->get_io_service().post(boost::bind(&http_connection_manager::start_connection, m_state, c));
 		}
 
 		/// Stop the specified connection.
 		void stop(http_connection_ptr c)
 		{
-			boost::mutex::scoped_lock l(m_mutex);
-			if (m_connections.find(c) != m_connections.end())
-				m_connections.erase(c);
-			c->stop();
+			stop_connection(m_state, c);
 		}
 
-		/// Stop all connections.
+		/// Stop all connections. Each shard is stopped on its own io_service.
 		void stop_all()
 		{
-			boost::mutex::scoped_lock l(m_mutex);
-			std::for_each(m_connections.begin(), m_connections.end(),
-				boost::bind(&http_connection::stop, _1));
-			m_connections.clear();
+			for (std::size_t i = 0; i < m_state->shards.size(); ++i)
+				m_io_service_pool.get_io_service(i).post(boost::bind(&http_connection_manager::stop_shard, m_state, i));
 		}
 
+		/// Advance the timeout wheel of every shard by one second, and refresh
+		/// the coarse_clock of its thread.
 		void tick()
 		{
-			boost::mutex m_mutex;
+			for (std::size_t i = 0; i < m_state->shards.size(); ++i)
+				m_io_service_pool.get_io_service(i).post(boost::bind(&http_connection_manager::tick_shard, m_state, i));
+		}
+
+		/// The timeout wheel of one shard, only usable on that shard's thread.
+		timing_wheel& wheel(std::size_t shard_index)
+		{
+			return m_state->shards[shard_index]->wheel;
+		}
+
+		/// Number of started connections not yet released, over all shards.
+		std::size_t size() const
+		{
+			std::size_t total = 0;
+			for (std::size_t i = 0; i < m_state->shards.size(); ++i)
+				total += size(i);
+			return total;
+		}
+
+		/// Number of started connections not yet released on one io_service.
+		std::size_t size(std::size_t shard_index) const
+		{
+			return m_io_service_pool.load(shard_index).connections.load(boost::memory_order_relaxed);
+		}
+
+		/// Load counters of one io_service, see io_service_pool::load.
+		io_service_pool::load_counters& load(std::size_t shard_index)
+		{
+			return m_io_service_pool.load(shard_index);
 		}
 
 	private:
-		boost::mutex m_mutex;
-		std::set<http_connection_ptr> m_connections;
+		// 连接拿到 socket 后才计入负载, 预先创建等待 accept 的连接不算.
+		void count(const http_connection_ptr& c)
+		{
+			c->m_counted = true;
+			m_io_service_pool.load(c->m_shard).connections.fetch_add(1, boost::memory_order_relaxed);
+		}
+
+		// shared_ptr 的删除器, 把连接放回空闲列表.
+		struct recycler
+		{
+			explicit recycler(const state_ptr& state)
+				: m_state(state)
+			{}
+
+			void operator()(http_connection* c) const
+			{
+				// 管理器已经析构, 不再回收.
+				if (!m_state->alive)
+				{
+					delete c;
+					return;
+				}
+				if (c->m_counted)
+				{
+					c->m_counted = false;
+					m_state->pool.load(c->m_shard).connections.fetch_sub(1, boost::memory_order_relaxed);
+				}
+				// reset 会把定时器从时间轮上摘下, 时间轮只能在连接自己的线程上使用.
+				if (c->running_in_this_thread())
+				{
+					recycle(m_state, c);
+					return;
+				}
+				boost::shared_ptr<orphan> o = boost::make_shared<orphan>(c);
+				c->get_io_service().post(boost::bind(&http_connection_manager::recycle_orphan, m_state, o));
+			}
+
+			state_ptr m_state;
+		};
+
+		// 投递回收任务时持有连接, 任务没有执行就被 io_service 丢弃时删除连接.
+		struct orphan
+		{
+			explicit orphan(http_connection* c) : connection(c) {}
+			~orphan() { delete connection; }
+			http_connection* connection;
+		};
+
+		static void recycle_orphan(state_ptr state, boost::shared_ptr<orphan> o)
+		{
+			http_connection* c = o->connection;
+			o->connection = 0;
+			if (state->alive)
+				recycle(state, c);
+			else
+				delete c;
+		}
+
+		// 在连接的线程上调用, 此时已经没有其它地方引用这个连接.
+		static void recycle(const state_ptr& state, http_connection* c)
+		{
+			c->reset();
+			shard& s = *state->shards[c->m_shard];
+			if (!s.free_list.push(c))
+			{
+				delete c;
+				return;
+			}
+			// 管理器在 push 之前析构, 可能已经清空过空闲列表.
+			if (!state->alive)
+				delete_free_list(s);
+		}
+
+		static void start_connection(state_ptr state, http_connection_ptr c)
+		{
+			// 管理器析构后才轮到的连接不再启动, 释放时直接删除.
+			if (!state->alive)
+				return;
+			shard& s = *state->shards[c->m_shard];
+			c->m_registry_pos = s.connections.insert(s.connections.end(), c);
+			c->m_registered = true;
+			c->start();
+		}
+
+		static void stop_connection(state_ptr state, http_connection_ptr c)
+		{
+			if (!c->running_in_this_thread())
+			{
+				c->get_io_service().post(boost::bind(&http_connection_manager::stop_connection, state, c));
+				return;
+			}
+
+			if (c->m_registered)
+			{
+				shard& s = *state->shards[c->m_shard];
+				c->m_registered = false;
+				s.connections.erase(c->m_registry_pos);
+			}
+			c->stop();
+		}
+
+		static void preallocate_shard(state_ptr state, http_connection_manager* manager,
+			std::size_t shard_index, std::size_t count, http_server& server)
+		{
+			if (!state->alive)
+				return;
+			for (std::size_t n = 0; n < count; ++n)
+			{
+				http_connection* c = new http_connection(state->pool.get_io_service(shard_index), shard_index, server, manager);
+				// 接收缓冲区和 arena 没有被构造函数写过, 这里先写一遍, 让它们的页分配在本线程的节点上.
+				c->m_recv_buffer.fill(0);
+				c->m_arena_buffer.fill(0);
+				if (!state->shards[shard_index]->free_list.push(c))
+				{
+					delete c;
+					break;
+				}
+			}
+		}
+
+		static void refill_shard(state_ptr state, http_connection_manager* manager,
+			std::size_t shard_index, http_server& server)
+		{
+			preallocate_shard(state, manager, shard_index, HTTP_CONNECTION_PREALLOCATE, server);
+			state->shards[shard_index]->refilling = false;
+		}
+
+		static void tick_shard(state_ptr state, std::size_t shard_index)
+		{
+			coarse_clock::update();
+			state->shards[shard_index]->wheel.advance();
+		}
+
+		static void stop_shard(state_ptr state, std::size_t shard_index)
+		{
+			shard& s = *state->shards[shard_index];
+			std::list<http_connection_ptr> connections;
+			connections.swap(s.connections);
+			for (std::list<http_connection_ptr>::iterator i = connections.begin(); i != connections.end(); ++i)
+			{
+				(*i)->m_registered = false;
+				(*i)->stop();
+			}
+		}
+
+		// 析构时等待所有分片在各自的线程上停止.
+		struct drain_latch
+		{
+			explicit drain_latch(std::size_t count) : remaining(count) {}
+
+			void count_down()
+			{
+				boost::lock_guard<boost::mutex> lock(mutex);
+				if (--remaining == 0)
+					done.notify_all();
+			}
+
+			void wait()
+			{
+				boost::unique_lock<boost::mutex> lock(mutex);
+				while (remaining)
+					done.wait(lock);
+			}
+
+			boost::mutex mutex;
+			boost::condition_variable done;
+			std::size_t remaining;
+		};
+
+		// 任务执行完或者被 io_service 丢弃时都会计数, 析构不会一直等下去.
+		struct drain_guard
+		{
+			explicit drain_guard(drain_latch& latch) : m_latch(latch) {}
+			~drain_guard() { m_latch.count_down(); }
+			drain_latch& m_latch;
+		};
+
+		static void drain_shard(state_ptr state, std::size_t shard_index, boost::shared_ptr<drain_guard>)
+		{
+			stop_shard(state, shard_index);
+		}
+
+		// 每个分片单独分配, 并与相邻的分配隔开一个缓存行. 连接数记在
+		// io_service_pool::load_counters 里, 供选择 io_service 时使用.
+		struct shard
+		{
+			shard() : refilling(false) {}
+			char padding_front[HTTP_CACHELINE_SIZE];
+			std::list<http_connection_ptr> connections;
+			timing_wheel wheel;
+			boost::lockfree::stack<http_connection*,
+				boost::lockfree::capacity<HTTP_CONNECTION_FREE_LIST> > free_list;
+			boost::atomic<bool> refilling;	// 已经投递了补充空闲列表的任务.
+		};
+
+		static void delete_free_list(shard& s)
+		{
+			http_connection* c = 0;
+			while (s.free_list.pop(c))
+				delete c;
+		}
+
+		struct shared_state
+		{
+			explicit shared_state(io_service_pool& p)
+				: pool(p)
+				, alive(true)
+			{}
+
+			io_service_pool& pool;
+			std::vector<boost::shared_ptr<shard> > shards;
+			boost::atomic<bool> alive;		// 管理器还没有析构.
+		};
+
+		io_service_pool& m_io_service_pool;
+		state_ptr m_state;
 	};
 
 }
@@ -7,10 +7,11 @@
 
 #pragma once
 
-#include <boost/regex.hpp>
-
 #include "internal.hpp"
+#include "arena.hpp"
 #include "escape_string.hpp"
+#include "header_index.hpp"
+#include "multipart.hpp"
 #include <boost/algorithm/string.hpp>
 
 #ifndef atoi64
@@ -294,169 +295,257 @@ namespace http
 	/// struct header.
 	struct header
 	{
-		std::string name;
-		std::string value;
+		explicit header(const arena_allocator<char>& alloc = arena_allocator<char>())
+			: name(alloc)
+			, value(alloc)
+		{}
+
+		arena_string name;
+		arena_string value;
 	};
 
+	typedef std::pair<arena_string, arena_string> param_type;
+	typedef std::vector<param_type, arena_allocator<param_type> > param_list;
+
 
 	/// A request received from a client.
+	///
+	/// The strings and lists of a request live in the connection's arena and
+	/// are only valid inside the handler. A handler that keeps the request
+	/// for later must copy it; the copy is allocated on the heap.
 	struct request
 	{
-		std::string method;
-		std::string uri;
-		std::vector<std::pair<std::string, std::string>> uri_params;		// 不关是get还是post，都有可能在uri中带参数。
+		explicit request(monotonic_arena* arena = 0)
+			: method(arena_allocator<char>(arena))
+			, uri(arena_allocator<char>(arena))
+			, uri_params(arena_allocator<param_type>(arena))
+			, path_params(arena_allocator<param_type>(arena))
+			, http_version_major(0)
+			, http_version_minor(0)
+			, headers(arena_allocator<header>(arena))
+			, content_length(0)
+			, keep_alive(false)
+			, expect_continue(false)
+			, chunked(false)
+		{}
+
+		arena_string method;
+		arena_string uri;
+		param_list uri_params;		// 不关是get还是post，都有可能在uri中带参数。
+		param_list path_params;		// 路由中 ":name" 和 "*name" 匹配到的值.
 
 		int http_version_major;
 		int http_version_minor;
-		std::vector<header> headers;
+		std::vector<header, arena_allocator<header> > headers;
 
 		// 只有在调用了 normalise 后才能访问的成员
 		boost::uint64_t content_length;
 		bool keep_alive;
+		bool expect_continue;		// 客户端要等到 "100 Continue" 才发送 body.
+		bool chunked;				// body 使用 chunked 编码, 此时 content_length 为 0.
 
+		// body 可能很大, 不放在 arena 里.
 		std::string body;
 
-		std::string operator[](const std::string& name) const
+		/// Value of a header, matched by its whole name in any case. Empty
+		/// when absent. The view is only valid while the request is.
+		boost::string_ref operator[](boost::string_ref name) const
+		{
+			return header_value(m_index.find(name, headers));
+		}
+
+		/// Value of an interned header, without comparing names.
+		boost::string_ref operator[](header_id id) const
+		{
+			return header_value(m_index.find(id));
+		}
+
+		/// Append a header. id is find_header_id(name), when the caller
+		/// already knows it.
+		void add_header(boost::string_ref name, boost::string_ref value, header_id id)
+		{
+			index_headers();
+			headers.emplace_back(get_allocator());
+			headers.back().name.assign(name.data(), name.size());
+			headers.back().value.assign(value.data(), value.size());
+			m_index.add(id, headers);
+		}
+
+		/// Index headers pushed onto headers directly. normalise calls it.
+		void index_headers()
+		{
+			while (m_index.size() < headers.size())
+				m_index.add(find_header_id(headers[m_index.size()].name), headers);
+		}
+
+		arena_allocator<char> get_allocator() const
+		{
+			return method.get_allocator();
+		}
+
+		/// 放弃 arena 中的所有内容, 在重置 arena 之前调用.
+		void release()
+		{
+			arena_allocator<char> alloc = get_allocator();
+			arena_string(alloc).swap(method);
+			arena_string(alloc).swap(uri);
+			param_list(alloc).swap(uri_params);
+			param_list(alloc).swap(path_params);
+			std::vector<header, arena_allocator<header> >(alloc).swap(headers);
+			m_index.clear();
+		}
+
+		// 将一些标准头部从 headers 提取出来
+		// 只把 method 小写化, 头部名字按索引查找, 不区分大小写.
+		// Content-Length 不合法, 或者多个 Content-Length 不一致时返回 false,
+		// 这时 body 的长度无法确定, 请求必须拒绝.
+		bool normalise()
 		{
-			for (const header& hdr : headers)
+			boost::to_lower(method);
+			index_headers();
+
+			content_length = 0;
+			std::size_t position = m_index.find(header_content_length);
+			if (position < headers.size())
 			{
-				if (strncasecmp(name.c_str(), hdr.name.c_str(), name.length()) == 0)
+				if (!parse_content_length(header_value(position), content_length))
+					return false;
+				// 和前面的代理对 body 长度的理解不同会让后面的请求错位.
+				for (std::size_t i = position + 1; i < headers.size(); ++i)
 				{
-					return hdr.value;
+					boost::uint64_t other;
+					if (find_header_id(headers[i].name) == header_content_length
+						&& (!parse_content_length(header_value(i), other) || other != content_length))
+						return false;
 				}
 			}
-			return "";
+
+			// HTTP/1.1 默认是持久连接, 除非指定了 Connection: close;
+			// HTTP/1.0 则必须明确指定 Connection: keep-alive.
+			boost::string_ref connection = (*this)[header_connection];
+			if (!boost::ifind_first(connection, "close").empty())
+				keep_alive = false;
+			else if (!boost::ifind_first(connection, "keep-alive").empty())
+				keep_alive = true;
+			else
+				keep_alive = http_version_major > 1 || (http_version_major == 1 && http_version_minor >= 1);
+
+			// Transfer-Encoding 优先于 Content-Length.
+			boost::string_ref transfer_encoding = (*this)[header_transfer_encoding];
+			chunked = !boost::ifind_first(transfer_encoding, "chunked").empty();
+			if (chunked)
+				content_length = 0;
+
+			boost::string_ref expect = (*this)[header_expect];
+			expect_continue = (http_version_major > 1 || (http_version_major == 1 && http_version_minor >= 1))
+				&& !boost::ifind_first(expect, "100-continue").empty();
+			return true;
 		}
 
-		// 将一些标准头部从 headers 提取出来
-		// 必要的小写化
-		void normalise()
+	private:
+		// 只接受十进制数字, 前后可以有空白, 空值和溢出都算错.
+		static bool parse_content_length(boost::string_ref value, boost::uint64_t& length)
 		{
-			boost::to_lower(method);
-			boost::to_lower(uri);
-			for (header& hdr : headers) boost::to_lower(hdr.name);
-			auto contentlength = (*this)["content-length"];
-			if (!contentlength.empty())
+			while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+				value.remove_prefix(1);
+			while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+				value.remove_suffix(1);
+			if (value.empty())
+				return false;
+
+			length = 0;
+			for (std::size_t i = 0; i < value.size(); ++i)
 			{
-				std::istringstream contentlength_string;
-				contentlength_string.str(contentlength);
-				contentlength_string.imbue(std::locale("C"));
-				contentlength_string >> content_length;
+				char c = value[i];
+				if (c < '0' || c > '9')
+					return false;
+				unsigned digit = c - '0';
+				if (length > (~boost::uint64_t(0) - digit) / 10)
+					return false;
+				length = length * 10 + digit;
 			}
+			return true;
+		}
 
-			keep_alive = boost::to_lower_copy((*this)["connection"]) == "keep-alive";
+		boost::string_ref header_value(std::size_t position) const
+		{
+			if (position >= headers.size())
+				return boost::string_ref();
+			return boost::string_ref(headers[position].value.data(), headers[position].value.size());
 		}
+
+		header_index m_index;
 	};
 
 	// HTTP 表单
 	// application/x-www-form-urlencoded
 	// multipart/form-data; boundary=xxxx
+	// 传入 request::get_allocator() 时表单内容也放在连接的 arena 里.
 	struct http_form
 	{
-		http_form(const std::string& formdata, const std::string& content_type)
+		http_form(const std::string& formdata, boost::string_ref content_type,
+			const arena_allocator<char>& alloc = arena_allocator<char>())
+			: headers(alloc)
 		{
-			boost::smatch w;
-			if(boost::regex_search(content_type, w, boost::regex("boundary=([^ ]+)")))
-			{
-				std::string boundary = w[1];
-				boundary.insert(0, "--");
+			boost::string_ref boundary;
+			if (multipart_boundary(content_type, boundary))
 				parse_multipart(formdata, boundary);
-			}
 			else
-			{
 				parse_form_string(formdata);
-			}
 		}
 
 		std::string operator[](const std::string& key) const
 		{
 			for (const auto& hdr : headers)
 			{
-				if (hdr.first == key)
+				if (hdr.first.size() == key.size() && hdr.first.compare(0, key.size(), key.c_str()) == 0)
 				{
-					return hdr.second;
+					return std::string(hdr.second.data(), hdr.second.size());
 				}
 			}
 			return "";
 		}
 	private:
-		void parse_multipart(const std::string& formdata, const std::string& boundary)
+		void add(boost::string_ref key, boost::string_ref value)
 		{
-			std::vector<std::string> parts;
+			arena_allocator<char> alloc = headers.get_allocator();
+			headers.emplace_back(arena_string(key.data(), key.size(), alloc),
+				arena_string(value.data(), value.size(), alloc));
+		}
 
-			std::size_t boundary_start_post, search_pos = boundary.length() + 2;
+		void parse_multipart(const std::string& formdata, boost::string_ref boundary)
+		{
+			// part 是 formdata 上的视图, 每个值只复制一次, 直接放进 headers.
+			std::vector<multipart_part> parts;
+			split_multipart(formdata, boundary, parts);
 
-			while(std::string::npos != (boundary_start_post = formdata.find(boundary, search_pos)))
+			std::string name;
+			for (std::size_t i = 0; i < parts.size(); ++i)
 			{
-				parts.push_back(formdata.substr(search_pos, boundary_start_post - search_pos - 2));
-				search_pos = boundary_start_post + boundary.length() + 2;
-			}
-
-			// 从parts里提取
-			for (auto p : parts)
-			{
-				auto pos = p.find("\r\n\r\n");
-				auto h = p.substr(0, pos);
-				auto v = p.substr(pos + 4);
-
-				boost::smatch w;
-				if(boost::regex_search(h, w, boost::regex("Content-Disposition: form-data; name=\"([^\"]+)\"")))
-				{
-					std::string key = w[1];
-					detail::unescape_path(key, h);
-					headers.push_back(std::make_pair(h,v));
-				}
+				const multipart_part& part = parts[i];
+				if (part.name.empty())
+					continue;
+				// 浏览器把 name 中的引号和换行编码成 %22, %0D, %0A.
+				if (part.name.find('%') == boost::string_ref::npos || !detail::unescape_path(part.name, name, false))
+					add(part.name, part.data);
+				else
+					add(name, part.data);
 			}
 		}
 
 		void parse_form_string(const std::string& formdata)
 		{
-			std::string key, value;
-			bool parse_key = true;
-			for ( auto C : formdata)
-			{
-				if (parse_key)
-				{
-					if (C != '=')
-					{
-						key+=C;
-					}
-					else
-					{
-						parse_key = false;
-					}
-				}
-				else
-				{
-					if (C != '&')
-					{
-						value+=C;
-					}
-					else
-					{
-						parse_key = true;
-
-						std::string k,v;
-
-						detail::unescape_path(key, k);
-						detail::unescape_path(value, v);
-
-						headers.push_back(std::make_pair(k,v));
-						key = value = "";
-					}
-				}
-			}
-			if (!parse_key)
+			// 键值直接解码进 headers 里的字符串, 没有转义的部分整段复制.
+			arena_allocator<char> alloc = headers.get_allocator();
+			param_list& params = headers;
+			split_form(formdata, [&params, &alloc](boost::string_ref key, boost::string_ref value)
 			{
-				std::string k,v;
-
-				detail::unescape_path(key, k);
-				detail::unescape_path(value, v);
-
-				headers.push_back(std::make_pair(k,v));
-			}
+				params.emplace_back(arena_string(alloc), arena_string(alloc));
+				url_decode(key, params.back().first);
+				url_decode(value, params.back().second);
+			});
 		}
-		std::vector<std::pair<std::string, std::string>> headers;
+		param_list headers;
 	};
 
 	/// Parser for incoming requests.
@@ -548,7 +637,7 @@ namespace http
 				else if (input == '?')
 				{
 					state_ = uri_params_key;
-					req.uri_params.push_back(std::pair<std::string, std::string>());
+					req.uri_params.emplace_back(arena_string(req.get_allocator()), arena_string(req.get_allocator()));
 					return boost::indeterminate;
 				}
 				else
@@ -560,6 +649,7 @@ namespace http
 				{
 					if (input == ' ')
 					{
+						decode_uri_params(req);
 						state_ = http_version_h;
 						return boost::indeterminate;
 					}
@@ -583,6 +673,7 @@ namespace http
 				{
 					if (input == ' ')
 					{
+						decode_uri_params(req);
 						state_ = http_version_h;
 						return boost::indeterminate;
 					}
@@ -594,7 +685,7 @@ namespace http
 					{
 						// 标准的HTTP协议中，如果参数名字存在 & 。应该转成URLencode
 						state_ = uri_params_key;
-						req.uri_params.push_back(std::pair<std::string, std::string>());
+						req.uri_params.emplace_back(arena_string(req.get_allocator()), arena_string(req.get_allocator()));
 						return boost::indeterminate;
 					}
 					else
@@ -734,7 +825,7 @@ namespace http
 				}
 				else
 				{
-					req.headers.push_back(header());
+					req.headers.emplace_back(req.get_allocator());
 					req.headers.back().name.push_back(input);
 					state_ = header_name;
 					return boost::indeterminate;
@@ -816,6 +907,16 @@ namespace http
 			}
 		}
 
+		/// Percent-decode the query parameters once the URI is complete.
+		static void decode_uri_params(request& req)
+		{
+			for (auto& param : req.uri_params)
+			{
+				param.first.resize(url_decode_in_place(&param.first[0], param.first.size()));
+				param.second.resize(url_decode_in_place(&param.second[0], param.second.size()));
+			}
+		}
+
 		/// Check if a byte is an HTTP character.
 		static bool is_char(int c)
 		{
@@ -0,0 +1,180 @@
+﻿//
+// Copyright (C) 2013 Jack.
+//
+// Author: jack
+// Email:  jack.wgm@gmail.com
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+#ifdef _MSC_VER
+#	include <intrin.h>
+#endif
+
+#include "internal.hpp"
+
+// 记录延迟直方图的路由数, 编号更大的路由计入编号 0.
+#ifndef HTTP_METRICS_MAX_ROUTES
+#	define HTTP_METRICS_MAX_ROUTES 64
+#endif
+
+namespace http {
+
+	/// A latency histogram in the style of HdrHistogram: every power of two
+	/// is split into sub_buckets linear buckets, so a recorded value is off
+	/// by at most 1/sub_buckets of itself. Values are microseconds.
+	///
+	/// Only one thread may record; any thread may read while it does.
+	class latency_histogram
+		: public boost::noncopyable
+	{
+	public:
+		enum
+		{
+			sub_bucket_bits = 3,
+			sub_buckets = 1 << sub_bucket_bits,
+			bucket_count = (32 - sub_bucket_bits + 1) * sub_buckets
+		};
+
+		latency_histogram();
+
+		void record(boost::uint32_t value)
+		{
+			increment(m_buckets[bucket_of(value)], 1);
+			increment(m_sum, value);
+		}
+
+		/// Add the counts of this histogram to counts, which must hold
+		/// bucket_count entries. Returns the sum of the recorded values.
+		boost::uint64_t merge_into(std::vector<boost::uint64_t>& counts) const;
+
+		static std::size_t bucket_of(boost::uint32_t value)
+		{
+			if (value < sub_buckets)
+				return value;
+			unsigned shift = highest_bit(value) - sub_bucket_bits;
+			return (shift + 1) * sub_buckets + ((value >> shift) & (sub_buckets - 1));
+		}
+
+		/// The smallest value that falls into the bucket.
+		static boost::uint64_t bucket_low(std::size_t bucket)
+		{
+			if (bucket < sub_buckets)
+				return bucket;
+			unsigned shift = static_cast<unsigned>(bucket / sub_buckets - 1);
+			return static_cast<boost::uint64_t>(sub_buckets + bucket % sub_buckets) << shift;
+		}
+
+		/// The smallest value that falls into the next bucket.
+		static boost::uint64_t bucket_high(std::size_t bucket)
+		{
+			return bucket < sub_buckets ? bucket + 1 : bucket_low(bucket) + (1ull << (bucket / sub_buckets - 1));
+		}
+
+		// 只有一个线程写, 不需要带 lock 前缀的原子加.
+		static void increment(boost::atomic<boost::uint64_t>& counter, boost::uint64_t n)
+		{
+			counter.store(counter.load(boost::memory_order_relaxed) + n, boost::memory_order_relaxed);
+		}
+
+	private:
+		static unsigned highest_bit(boost::uint32_t value)
+		{
+#ifdef _MSC_VER
+			unsigned long index;
+			_BitScanReverse(&index, value);
+			return index;
+#else
+			return 31 - __builtin_clz(value);
+#endif
+		}
+
+		boost::atomic<boost::uint64_t> m_buckets[bucket_count];
+		boost::atomic<boost::uint64_t> m_sum;
+	};
+
+	/// Server counters kept per io_service and merged when read.
+	///
+	/// Every io_service thread writes only its own cache line padded block,
+	/// so recording takes no lock and no locked instruction. Histograms of a
+	/// route are allocated by the io_service thread the first time the route
+	/// is seen there. render() may run on any thread.
+	class http_metrics
+		: public boost::noncopyable
+	{
+	public:
+		enum disconnect_reason
+		{
+			disconnect_peer,			// 对端关闭或者读写出错.
+			disconnect_timeout,
+			disconnect_bad_request,		// 请求解析失败或者头部太大.
+			disconnect_rejected,		// 没有匹配的路由, 或者不接受的 body.
+			disconnect_done,			// 非 keep-alive 的请求回复完毕.
+			disconnect_handshake,		// TLS 握手失败.
+			disconnect_reason_count
+		};
+
+		explicit http_metrics(std::size_t shards);
+		~http_metrics();
+
+		// 以下函数只能在 shard 对应的 io_service 线程上调用.
+		void request(std::size_t shard)
+		{
+			latency_histogram::increment(m_shards[shard]->requests, 1);
+		}
+
+		void received(std::size_t shard, std::size_t bytes)
+		{
+			latency_histogram::increment(m_shards[shard]->bytes_in, bytes);
+		}
+
+		void sent(std::size_t shard, std::size_t bytes)
+		{
+			latency_histogram::increment(m_shards[shard]->bytes_out, bytes);
+		}
+
+		void parse_error(std::size_t shard)
+		{
+			latency_histogram::increment(m_shards[shard]->parse_errors, 1);
+		}
+
+		void disconnect(std::size_t shard, disconnect_reason reason)
+		{
+			latency_histogram::increment(m_shards[shard]->disconnects[reason], 1);
+		}
+
+		void latency(std::size_t shard, std::size_t route, boost::uint32_t microseconds);
+
+		/// Render all counters in the Prometheus text format. routes holds the
+		/// (method, pattern) of route i + 1, used as labels.
+		void render(std::string& out, const std::vector<std::pair<std::string, std::string> >& routes,
+			std::size_t connections) const;
+
+	private:
+		struct shard
+		{
+			shard();
+			~shard();
+
+			char padding_front[HTTP_CACHELINE_SIZE];
+			boost::atomic<boost::uint64_t> requests;
+			boost::atomic<boost::uint64_t> bytes_in;
+			boost::atomic<boost::uint64_t> bytes_out;
+			boost::atomic<boost::uint64_t> parse_errors;
+			boost::atomic<boost::uint64_t> disconnects[disconnect_reason_count];
+			boost::atomic<latency_histogram*> routes[HTTP_METRICS_MAX_ROUTES + 1];
+			char padding_back[HTTP_CACHELINE_SIZE];
+		};
+
+		std::vector<boost::shared_ptr<shard> > m_shards;
+	};
+
+}
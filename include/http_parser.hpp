@@ -0,0 +1,311 @@
+﻿//
+// Copyright (C) 2013 Jack.
+//
+// Author: jack
+// Email:  jack.wgm@gmail.com
+//
+
+#pragma once
+
+#include <cstring>
+#include <vector>
+
+#include <boost/logic/tribool.hpp>
+#include <boost/tuple/tuple.hpp>
+#include <boost/utility/string_ref.hpp>
+
+#include "http_helper.hpp"
+#include "simd_scan.hpp"
+
+// 单个请求头部(请求行 + 所有头部行)允许的最大长度.
+#ifndef HTTP_MAX_HEADER_SIZE
+#	define HTTP_MAX_HEADER_SIZE 8192
+#endif
+
+namespace http {
+namespace detail {
+
+	/// Check if a byte may appear in an HTTP token (method, header name).
+	inline bool is_token(char c)
+	{
+		static const bool table[128] = {
+			// 0x00 - 0x1f: CTL
+			0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+			0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+			//  !  "  #  $  %  &  '  (  )  *  +  ,  -  .  /
+			0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0,
+			// 0 - 9  :  ;  <  =  >  ?
+			1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+			// @ A - O
+			0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+			// P - Z  [  \  ]  ^  _
+			1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1,
+			// ` a - o
+			1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+			// p - z  {  |  }  ~  DEL
+			1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0,
+		};
+		unsigned char u = static_cast<unsigned char>(c);
+		return u < 128 && table[u];
+	}
+
+	inline bool is_token(boost::string_ref s)
+	{
+		if (s.empty())
+			return false;
+		for (std::size_t i = 0; i < s.size(); ++i)
+			if (!is_token(s[i]))
+				return false;
+		return true;
+	}
+
+} // namespace detail
+
+	/// A header as a pair of slices into the receive buffer.
+	struct header_view
+	{
+		boost::string_ref name;
+		boost::string_ref value;
+		header_id id;			// 解析时查出的名字编号.
+	};
+
+	/// A request parsed in place. All slices point into the buffer handed to
+	/// fast_request_parser::parse and are only valid while that buffer is.
+	struct request_view
+	{
+		boost::string_ref method;
+		boost::string_ref uri;			// 不含 '?' 之后的部分.
+		boost::string_ref query;		// '?' 之后的原始参数串, 未解码.
+		int http_version_major;
+		int http_version_minor;
+		std::vector<header_view> headers;
+
+		request_view()
+			: http_version_major(0)
+			, http_version_minor(0)
+		{}
+
+		void clear()
+		{
+			method.clear();
+			uri.clear();
+			query.clear();
+			http_version_major = 0;
+			http_version_minor = 0;
+			headers.clear();
+		}
+
+		/// Case-insensitive exact header lookup. Returns an empty slice when absent.
+		boost::string_ref operator[](boost::string_ref name) const
+		{
+			header_id id = find_header_id(name);
+			for (const header_view& hdr : headers)
+			{
+				if (id != header_other ? hdr.id == id : detail::iequals(name, hdr.name))
+					return hdr.value;
+			}
+			return boost::string_ref();
+		}
+
+		/// Copy the slices into a request. The request must be empty; its
+		/// strings are allocated with the request's own allocator, normally
+		/// the connection's arena.
+		void materialize(request& req) const
+		{
+			arena_allocator<char> alloc = req.get_allocator();
+			req.method.assign(method.data(), method.size());
+			req.uri.assign(uri.data(), uri.size());
+			req.http_version_major = http_version_major;
+			req.http_version_minor = http_version_minor;
+
+			// 查询参数解码后放进 arena, 没有转义的部分整段复制.
+			param_list& params = req.uri_params;
+			split_form(query, [&params, &alloc](boost::string_ref key, boost::string_ref value)
+			{
+				params.emplace_back(arena_string(alloc), arena_string(alloc));
+				url_decode(key, params.back().first);
+				url_decode(value, params.back().second);
+			});
+
+			req.headers.reserve(headers.size());
+			for (std::size_t i = 0; i < headers.size(); ++i)
+				req.add_header(headers[i].name, headers[i].value, headers[i].id);
+
+			req.content_length = 0;
+			req.keep_alive = false;
+			req.body.clear();
+		}
+	};
+
+	/// Parser for incoming requests that scans for delimiters a vector at a time
+	/// instead of running a state machine per byte.
+	///
+	/// The parser first locates the end of the header block, remembering how far
+	/// it got so that a buffer which grows between calls is never rescanned from
+	/// the start. Once the block is complete it is split into slices in one pass.
+	/// Folded (obs-fold) header lines are rejected, as RFC 7230 allows.
+	class fast_request_parser
+	{
+	public:
+		fast_request_parser()
+			: scanned_(0)
+		{}
+
+		/// Reset to initial parser state.
+		void reset()
+		{
+			scanned_ = 0;
+		}
+
+		/// Parse a request starting at begin. The tribool return value is true when
+		/// a complete request has been parsed, false if the data is invalid,
+		/// indeterminate when more data is required. On success the returned
+		/// pointer is one past the blank line that ends the header block.
+		///
+		/// Between indeterminate calls begin must stay the same and [begin, end)
+		/// may only grow.
+		boost::tuple<boost::tribool, const char*> parse(request_view& req,
+			const char* begin, const char* end)
+		{
+			// 容忍请求之前多余的空行 (RFC 7230 3.5).
+			const char* start = begin;
+			while (end - start >= 2 && start[0] == '\r' && start[1] == '\n')
+				start += 2;
+
+			const char* block_end = find_header_end(start, end);
+			if ((block_end ? block_end : end) - begin > HTTP_MAX_HEADER_SIZE)
+			{
+				boost::tribool result = false;
+				return boost::make_tuple(result, end);
+			}
+			if (!block_end)
+			{
+				boost::tribool result = boost::indeterminate;
+				return boost::make_tuple(result, end);
+			}
+			scanned_ = 0;
+
+			req.clear();
+			boost::tribool result = parse_block(req, start, block_end) ? true : false;
+			return boost::make_tuple(result, block_end);
+		}
+
+	private:
+		const char* find_header_end(const char* begin, const char* end)
+		{
+			// 上次扫描的最后 3 个字节可能是 "\r\n\r" 的一部分.
+			std::size_t resume = scanned_ > 3 ? scanned_ - 3 : 0;
+			const char* p = begin + (std::min)(resume, static_cast<std::size_t>(end - begin));
+			while (p != end)
+			{
+				p = detail::scan<false>(p, end, "\n");
+				if (p == end)
+					break;
+				if (p - begin >= 3 && p[-1] == '\r' && p[-2] == '\n' && p[-3] == '\r')
+					return p + 1;
+				++p;
+			}
+			scanned_ = end - begin;
+			return 0;
+		}
+
+		static bool expect_crlf(const char*& p, const char* end)
+		{
+			if (end - p < 2 || p[0] != '\r' || p[1] != '\n')
+				return false;
+			p += 2;
+			return true;
+		}
+
+		static bool parse_version_number(const char*& p, const char* end, int& value)
+		{
+			const char* start = p;
+			value = 0;
+			while (p != end && *p >= '0' && *p <= '9' && p - start < 3)
+				value = value * 10 + (*p++ - '0');
+			return p != start;
+		}
+
+		static bool parse_block(request_view& req, const char* p, const char* end)
+		{
+			// 请求行: method SP uri[?query] SP HTTP/x.y CRLF
+			const char* q = detail::scan<true>(p, end, " ");
+			if (q == end || *q != ' ')
+				return false;
+			req.method = boost::string_ref(p, q - p);
+			if (!detail::is_token(req.method))
+				return false;
+
+			p = q + 1;
+			q = detail::scan<true>(p, end, " ?");
+			if (q == end || q == p)
+				return false;
+			req.uri = boost::string_ref(p, q - p);
+			if (*q == '?')
+			{
+				p = q + 1;
+				q = detail::scan<true>(p, end, " ");
+				if (q == end)
+					return false;
+				req.query = boost::string_ref(p, q - p);
+			}
+			if (*q != ' ')
+				return false;
+
+			p = q + 1;
+			if (end - p < 5 || std::memcmp(p, "HTTP/", 5) != 0)
+				return false;
+			p += 5;
+			if (!parse_version_number(p, end, req.http_version_major))
+				return false;
+			if (p == end || *p++ != '.')
+				return false;
+			if (!parse_version_number(p, end, req.http_version_minor))
+				return false;
+			if (!expect_crlf(p, end))
+				return false;
+
+			// 头部行: name ":" OWS value OWS CRLF, 直到空行.
+			while (!expect_crlf(p, end))
+			{
+				q = detail::scan<true>(p, end, ":");
+				if (q == end || *q != ':')
+					return false;
+				header_view hdr;
+				hdr.name = boost::string_ref(p, q - p);
+				if (!detail::is_token(hdr.name))
+					return false;
+				hdr.id = find_header_id(hdr.name);
+
+				p = q + 1;
+				while (p != end && (*p == ' ' || *p == '\t'))
+					++p;
+				q = p;
+				for (;;)
+				{
+					q = detail::scan<true>(q, end, "");
+					if (q == end || *q != '\t')
+						break;
+					++q;
+				}
+				const char* value_end = q;
+				if (!expect_crlf(q, end))
+					return false;
+				while (value_end != p && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+					--value_end;
+				hdr.value = boost::string_ref(p, value_end - p);
+				req.headers.push_back(hdr);
+
+				p = q;
+				// 不支持 obs-fold 折行.
+				if (p != end && (*p == ' ' || *p == '\t'))
+					return false;
+			}
+			return true;
+		}
+
+	private:
+		std::size_t scanned_;
+	};
+
+}
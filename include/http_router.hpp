@@ -0,0 +1,125 @@
+﻿//
+// Copyright (C) 2013 Jack.
+//
+// Author: jack
+// Email:  jack.wgm@gmail.com
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/utility/string_ref.hpp>
+
+#include "http_connection.hpp"
+
+// 没有指定 http_route_options::max_body_size 时, request::body 允许的最大长度.
+#ifndef HTTP_MAX_BODY_SIZE
+#	define HTTP_MAX_BODY_SIZE 65536
+#endif
+
+namespace http {
+
+	class task_executor;
+
+	typedef boost::function<void(const request&, http_connection_ptr, http_connection_manager&)> http_request_callback;
+
+	// 流式接收 body 时每收到一段调用一次, data 只在调用期间有效.
+	typedef boost::function<void(const request&, const char* data, std::size_t size, http_connection_ptr)> http_body_callback;
+
+	/// 单个路由的选项.
+	struct http_route_options
+	{
+		http_route_options()
+			: executor(0)
+			, max_body_size(HTTP_MAX_BODY_SIZE)
+		{}
+
+		// 非空时处理函数在这个线程池上运行, 而不是在连接的 io_service 线程上.
+		// 处理函数拿到的是请求的副本, 回复照常调用 write_response, 会被送回连接的线程.
+		// executor 必须比 http_server 活得久.
+		task_executor* executor;
+
+		// body 整个放进 request::body 时允许的最大长度, 超过时断开连接.
+		std::size_t max_body_size;
+
+		// 非空时 body 不放进 request::body, 而是直接从接收缓冲区一段一段交给 on_body,
+		// 长度不受 max_body_size 限制; body 收完之后才调用处理函数.
+		// on_body 在连接的 io_service 线程上调用, 返回之后才会读下一段. 来不及处理时
+		// 在 on_body 里调用 http_connection::pause_body, 处理完再调用 resume_body.
+		http_body_callback on_body;
+	};
+
+	/// A registered route.
+	struct http_route
+	{
+		std::string method;				// 小写, 空表示任意 method.
+		std::string pattern;
+		http_request_callback callback;
+		http_route_options options;
+		std::size_t id;					// 按注册顺序从 1 开始编号.
+	};
+
+	/// Routes a request path to a handler through a compressed radix tree.
+	///
+	/// Patterns are made of static text, ":name" segments that match one
+	/// non-empty path segment, and a trailing "*name" that matches the rest of
+	/// the path. ':' and '*' only start a parameter or a wildcard right after
+	/// a '/'; inside a segment they are static text. Matched values are
+	/// returned as (name, value) pairs. Static text wins over a parameter,
+	/// which wins over a wildcard.
+	///
+	/// Lookups take no lock. add() copies the nodes on the path it changes and
+	/// publishes the new root atomically; trees replaced this way are kept
+	/// until the router is destroyed, because a lookup may still be walking
+	/// them. Routes are expected to be registered at startup.
+	class http_router
+		: public boost::noncopyable
+	{
+	public:
+		typedef param_list params_type;
+
+		http_router();
+		~http_router();
+
+		/// Register a handler. An empty method matches any method; methods are
+		/// compared in lower case, as request::normalise leaves them. Returns
+		/// false if the pattern is malformed or the route already exists.
+		bool add(const std::string& method, const std::string& pattern, const http_request_callback& cb,
+			const http_route_options& options = http_route_options());
+
+		/// Find the route for a path. Returns null when nothing matches.
+		/// Matched parameters are appended to params with params' allocator.
+		/// The route stays valid until the router is destroyed.
+		const http_route* find(boost::string_ref method, boost::string_ref path, params_type& params) const;
+
+		/// The (method, pattern) of every route, route i + 1 at index i.
+		/// Takes the registration lock; meant for reports, not for lookups.
+		std::vector<std::pair<std::string, std::string> > routes() const;
+
+	private:
+		struct node;
+		typedef boost::shared_ptr<node> node_ptr;
+		typedef boost::shared_ptr<const http_route> route_ptr;
+
+		bool insert(node_ptr& slot, const char* pattern, const char* end, const route_ptr& route);
+		static node* clone(node_ptr& slot);
+		static const http_route* match(const node* n, const char* p, const char* end,
+			boost::string_ref method, params_type& params);
+		static const http_route* find_handler(const node* n, boost::string_ref method);
+
+	private:
+		boost::atomic<const node*> m_root;
+		mutable boost::mutex m_mutex;			// 只在注册和 routes() 时使用.
+		node_ptr m_current;
+		std::vector<node_ptr> m_retired;
+		std::vector<route_ptr> m_routes;		// 按编号排列的所有路由.
+	};
+
+}
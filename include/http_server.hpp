@@ -12,13 +12,21 @@
 #include "internal.hpp"
 #include "io_service_pool.hpp"
 #include "http_connection.hpp"
+#include "http_router.hpp"
+#include "access_log.hpp"
+#include "http_metrics.hpp"
+#include "static_file.hpp"
+#include "task_executor.hpp"
+#include "tls_socket.hpp"
 #include <boost/asio/ssl.hpp>
 #include <boost/noncopyable.hpp>
 
-namespace http {
+// 一次 accept 完成后最多再取走多少个排队的连接.
+#ifndef HTTP_ACCEPT_BATCH
+#	define HTTP_ACCEPT_BATCH 32
+#endif
 
-	typedef boost::function<void(const request&, http_connection_ptr, http_connection_manager&)> http_request_callback;
-	typedef std::map<std::string, http_request_callback> http_request_callback_table;
+namespace http {
 
 	class http_connection;
 	class http_server
@@ -26,33 +34,91 @@ namespace http {
 	{
 		friend class http_connection;
 	public:
-		explicit http_server(io_service_pool& ios, unsigned short port = 80, std::string address = "127.0.0.1");
+		// reuse_port 为 true 时每个 io_service 各有一个 SO_REUSEPORT 的 acceptor, 由内核分配
+		// 连接, 连接从 accept 到关闭都在同一个线程上; 不支持 SO_REUSEPORT 的平台退回单个 acceptor.
+		explicit http_server(io_service_pool& ios, unsigned short port = 80,
+			std::string address = "127.0.0.1", bool reuse_port = false);
 		~http_server();
 
 	public:
 		void start();
 		void stop();
 
+		// uri 可以包含 ":name" 参数段和结尾的 "*name" 通配, 匹配到的值放在 request::path_params.
+		// 处理函数必须为每个请求回复一次, 可以在返回后从其它线程回复; 超过 http_timeouts::response
+		// 还没有回复时断开连接.
 		bool add_uri_handler(const std::string& uri, http_request_callback);
+		// 只处理指定 method 的请求, method 不区分大小写.
+		bool add_uri_handler(const std::string& method, const std::string& uri, http_request_callback);
+		bool add_uri_handler(const std::string& method, const std::string& uri, http_request_callback, const http_route_options& options);
+
+		// 设置连接的超时, 对之后的读写生效.
+		void set_timeouts(const http_timeouts& timeouts);
+
+		// 每个请求在回复写出后记录到 log, 为 0 时不记录. 在 start 之前设置, log 必须比 http_server 活得久.
+		void set_access_log(access_log* log);
+
+		// 开始统计请求数, 流量, 断开原因和每个路由的延迟, 并在 uri 上以 Prometheus 文本格式输出.
+		// 在 start 之前调用.
+		bool add_metrics_handler(const std::string& uri = "/metrics");
+
+		// 在 uri 下提供 root 目录中的文件, 如 uri 为 "/static" 时 "/static/a/b.css" 对应 root/a/b.css.
+		// 只处理 GET 和 HEAD. root 不是目录时抛出 std::runtime_error.
+		bool add_static_handler(const std::string& uri, const std::string& root,
+			const static_file_options& options = static_file_options());
+
+		// 之后接受的连接都使用 TLS, 在 start 之前调用. 证书或私钥无法加载时返回 false.
+		// 会话缓存和 session ticket 的密钥由所有连接共用. 同时提供 HTTP 和 HTTPS 时使用两个 http_server.
+		bool enable_tls(const http_tls_options& options);
 
 	private:
-		void handle_accept(const boost::system::error_code& error);
+		struct listener
+		{
+			explicit listener(boost::asio::io_service& io, std::size_t index)
+				: acceptor(io)
+				, io_service_index(index)
+			{}
+
+			boost::asio::ip::tcp::acceptor acceptor;
+			std::size_t io_service_index;	// acceptor 所在的 io_service.
+			http_connection_ptr connection;	// 正在等待 accept 的连接.
+		};
+		typedef boost::shared_ptr<listener> listener_ptr;
+
+		bool open_listener(listener& l, const boost::asio::ip::tcp::endpoint& endpoint, bool reuse_port);
+		void start_accept(listener_ptr l);
+		void close_listener(listener_ptr l);
+		http_connection_ptr new_connection(const listener& l);
+		void start_connection(http_connection_ptr conn);
+		void handle_accept(listener_ptr l, const boost::system::error_code& error);
 		void on_tick(const boost::system::error_code& error);
 
-		// 收到一个 http request 的时候调用
-		bool handle_request(const request&, http_connection_ptr);
+		// 收到一个 http request 的头部时查找路由, 填入 path_params.
+		const http_route* find_route(request&) const;
+		// 请求 (包括 body) 收完的时候调用
+		void handle_request(const http_route& route, request&, http_connection_ptr);
+		// 把请求复制一份, 交给 executor 执行处理函数.
+		static void post_request(task_executor* executor, const http_request_callback& cb,
+			const request& req, http_connection_ptr conn, http_connection_manager& manager);
+		static void run_request(const http_request_callback& cb, boost::shared_ptr<const request> req,
+			http_connection_ptr conn, http_connection_manager& manager);
+		void handle_metrics(const request& req, http_connection_ptr conn);
 
 	private:
 		io_service_pool& m_io_service_pool;
 		boost::asio::io_service& m_io_service;
-		boost::asio::ip::tcp::acceptor m_acceptor;
-		bool m_listening;
-		http_connection_ptr m_connection;
 		http_connection_manager m_connection_manager;
+		std::vector<listener_ptr> m_listeners;		// 析构时先于 m_connection_manager 释放连接.
+		bool m_reuse_port;
+		bool m_listening;
 		boost::asio::deadline_timer m_timer;
-		boost::shared_mutex m_request_callback_mtx;
-		http_request_callback_table m_http_request_callbacks;
+		http_router m_router;
+		http_timeouts m_timeouts;
+		access_log* m_access_log;
+		boost::scoped_ptr<http_metrics> m_metrics;
 		boost::asio::ssl::context m_ssl_context;
+		bool m_tls;
+		boost::scoped_ptr<task_executor> m_handshake_executor;	// 最先析构, 排队的握手先释放连接.
 	};
 
 }
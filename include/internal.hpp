@@ -19,6 +19,8 @@
 #include <boost/cstdint.hpp>
 #include <boost/noncopyable.hpp>
 
+#include "coarse_clock.hpp"
+
 #if defined (_WIN32) || defined (WIN32)
 // # define WIN32_LEAN_AND_MEAN
 // # include <windows.h>
@@ -26,6 +28,11 @@
 # pragma comment(lib, "Winmm.lib")
 #endif // _WIN32
 
+// 避免 false sharing 时按这个大小填充.
+#ifndef HTTP_CACHELINE_SIZE
+#	define HTTP_CACHELINE_SIZE 64
+#endif
+
 namespace http {
 
 	using boost::int8_t;
@@ -65,44 +72,17 @@ namespace http {
 
 #endif // WIN32
 
+	// UNIX 时间的毫秒数, 每次都读系统时钟; 热路径上用 coarse_clock.
 	inline int64_t gettime()
 	{
-#if defined (WIN32) || defined (_WIN32)
-		static int64_t system_start_time = 0;
-		if (system_start_time == 0)
-		{
-			FLT_FT nt_time;
-			GetSystemTimeAsFileTime(&(nt_time.ft_struct));
-			int64_t tim = (__int64)((nt_time.ft_scalar - epoch) / 10000i64);
-			system_start_time = tim - timeGetTime();
-#if 0
-			struct timeval tv;
-			gettimeofday(&tv, NULL);
-			int64_t millsec = ((int64_t)tv.tv_sec * 1000000 + tv.tv_usec) / 1000;
-			system_start_time = millsec - timeGetTime();
-#endif
-		}
-		return system_start_time + timeGetTime();
-#elif defined (__linux__)
-		struct timeval tv;
-		gettimeofday(&tv, NULL);
-		return ((int64_t)tv.tv_sec * 1000000 + tv.tv_usec) / 1000;
-#endif
+		return static_cast<int64_t>(coarse_clock::precise_unix_microseconds() / 1000);
 	}
 
 	inline std::string time_to_string(int64_t time)
 	{
-		std::string ret;
-		std::time_t rawtime = time / 1000;
-		struct tm * ptm = std::localtime(&rawtime);
-		if (!ptm)
-			return ret;
-		char buffer[1024];
-		sprintf(buffer, "%04d-%02d-%02d %02d:%02d:%02d.%03d",
-			ptm->tm_year + 1900, ptm->tm_mon, ptm->tm_mday,
-			ptm->tm_hour, ptm->tm_min, ptm->tm_sec, (int)(time % 1000));
-		ret = buffer;
-		return ret;
+		char buffer[coarse_clock::log_time_size + 1];
+		coarse_clock::format_log_time(static_cast<boost::uint64_t>(time) * 1000, buffer);
+		return buffer;
 	}
 
 	inline std::string to_string(int v, int width)
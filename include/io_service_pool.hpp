@@ -7,12 +7,16 @@
 
 #pragma once
 
+#include <string>
 #include <vector>
 
 #include <boost/asio.hpp>
+#include <boost/atomic.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
 
+#include "internal.hpp"
+
 namespace http {
 
 	/// A pool of io_service objects.
@@ -20,8 +24,42 @@ namespace http {
 		: private boost::noncopyable
 	{
 	public:
+		/// How pick_io_service chooses the io_service for a new connection.
+		enum placement_strategy
+		{
+			/// Each io_service in turn.
+			round_robin,
+			/// The io_service with the fewest live connections.
+			least_connections,
+			/// The less loaded of two io_services picked at random, where load
+			/// is live connections plus requests waiting for a response.
+			power_of_two_choices
+		};
+
+		/// Parse "round-robin", "least-connections" or "p2c".
+		static bool parse_placement(const std::string& name, placement_strategy& strategy);
+
+		/// Load counters of one io_service, kept up to date by the connections
+		/// it serves and readable from any thread for monitoring.
+		struct load_counters
+		{
+			load_counters() : connections(0), requests(0) {}
+			char padding_front[HTTP_CACHELINE_SIZE];
+			boost::atomic<std::size_t> connections;	// 在这个 io_service 上启动了还没有释放的连接数.
+			boost::atomic<std::size_t> requests;	// 已派发但回复还没有写完的请求数.
+			char padding_back[HTTP_CACHELINE_SIZE];
+		};
+
 		/// Construct the io_service pool.
-		explicit io_service_pool(std::size_t pool_size);
+		explicit io_service_pool(std::size_t pool_size, placement_strategy strategy = round_robin);
+
+		/// Pin the threads to these CPUs, thread i to cpus[i], in the order
+		/// given; threads beyond the list are not pinned. By default the order
+		/// is cpu_topology::layout() of all CPUs: physical cores spread over
+		/// the NUMA nodes before SMT siblings. A pool of one io_service runs
+		/// on the calling thread and is never pinned. Must be called before
+		/// run().
+		void set_cpus(const std::vector<int>& cpus);
 
 		/// Run all io_service objects in the pool.
 		void run();
@@ -32,7 +70,26 @@ namespace http {
 		/// Get an io_service to use.
 		boost::asio::io_service& get_io_service();
 
+		/// Get the index of the next io_service to use, according to the
+		/// placement strategy. Safe to call from any thread.
+		std::size_t pick_io_service();
+
+		/// Get the io_service at the given index.
+		boost::asio::io_service& get_io_service(std::size_t index);
+
+		/// Number of io_services in the pool.
+		std::size_t size() const;
+
+		/// The placement strategy used by pick_io_service.
+		placement_strategy placement() const;
+
+		/// Load counters of the io_service at the given index.
+		load_counters& load(std::size_t index);
+		const load_counters& load(std::size_t index) const;
+
 	private:
+		void run_thread(std::size_t index, int cpu);
+
 		typedef boost::shared_ptr<boost::asio::io_service> io_service_ptr;
 		typedef boost::shared_ptr<boost::asio::io_service::work> work_ptr;
 
@@ -42,7 +99,16 @@ namespace http {
 		/// The work that keeps the io_services running.
 		std::vector<work_ptr> work_;
 
-		/// The next io_service to use for a connection.
-		std::size_t next_io_service_;
+		/// Load counters, one per io_service.
+		std::vector<boost::shared_ptr<load_counters> > loads_;
+
+		placement_strategy placement_;
+
+		/// CPUs to pin the threads to.
+		std::vector<int> cpus_;
+
+		/// The next io_service to use for round_robin, or the seed for the
+		/// random picks of power_of_two_choices.
+		boost::atomic<std::size_t> next_io_service_;
 	};
 }
@@ -23,13 +23,24 @@
 #include <string>
 #include <fstream>
 
+#include <vector>
+#include <algorithm>
+
+#include <boost/atomic.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
+#include <boost/bind.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/make_shared.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 
+#include "coarse_clock.hpp"
+
 
 namespace http {
 
@@ -38,6 +49,7 @@ namespace http {
 	//	在程序入口(如:main)函数调用 INIT_LOGGER 宏, 它有两个参数, 第一个参数指定了日志文件保存
 	//	的路径, 第二个参数指定了日志文件保存的文件名, 详细见INIT_LOGGER.
 	//	然后就可以使用LOG_DBG/LOG_INFO/LOG_WARN/LOG_ERR这几个宏来输出日志信息.
+	//	日志默认由后台线程异步写出, 见 async_logger; 定义 DISABLE_LOGGER_ASYNC 则在调用线程同步写出.
 	// @begin example
 	//  #include "logging.hpp"
 	//  int main()
@@ -191,23 +203,21 @@ namespace http {
 			return writer_instance;
 		}
 
-		inline char const* time_now_string()
+		// 不是线程安全的, 只在持有日志锁或在异步日志的写线程中调用.
+		// 时间是 UNIX 微秒数, 日期和时分秒每秒只格式化一次.
+		inline char const* time_string(boost::uint64_t time)
 		{
-			static std::ostringstream oss;
-			if (oss.str().empty())
-			{
-				boost::posix_time::time_facet* _facet = new boost::posix_time::time_facet("%Y-%m-%d %H:%M:%S.%f");
-				oss.imbue(std::locale(std::locale::classic(), _facet));
-			}
-			oss.str("");
-			oss << boost::posix_time::microsec_clock::local_time();
-			std::string s = oss.str();
-			if (s.size() > 3)
-				s = std::string(s.substr(0, s.size() - 3));
-			static char str[200];
-			std::sprintf(str, "%s ", s.c_str());
+			static char str[coarse_clock::log_time_size + 2];
+			coarse_clock::format_log_time(time, str);
+			str[coarse_clock::log_time_size] = ' ';
+			str[coarse_clock::log_time_size + 1] = 0;
 			return str;
 		}
+
+		inline char const* time_now_string()
+		{
+			return time_string(coarse_clock::precise_unix_microseconds());
+		}
 	}
 
 #ifndef DISABLE_LOGGER_THREAD_SAFE
@@ -259,21 +269,283 @@ namespace http {
 		std::cout.flush();
 	}
 
-	inline void logger_writer(std::string& level, std::string& message, bool disable_cout = false)
+	inline void logger_write_line(std::string& level, boost::uint64_t time,
+		const std::string& message, bool disable_cout, std::string& file_buffer)
 	{
-		LOGGER_LOCKS_();
-		std::string prefix = aux::time_now_string() + std::string("[") + level + std::string("]: ");
-		std::string tmp = message + "\n";
-		std::string whole = prefix + tmp;
-		if (aux::writer_single<auto_logger_file>().is_open())
+		std::string prefix = aux::time_string(time) + std::string("[") + level + std::string("]: ");
+		file_buffer += prefix;
+		file_buffer += message;
+		file_buffer += '\n';
+		LOGGER_DBG_VIEW_((prefix + message + "\n"));
+#ifndef DISABLE_LOGGER_TO_CONSOLE
+		if (!disable_cout)
+			output_console(level, prefix, message + "\n");
+#endif
+	}
+
+	inline void logger_write_file(const std::string& buffer)
+	{
+		if (!buffer.empty() && aux::writer_single<auto_logger_file>().is_open())
 		{
-			aux::writer_single<auto_logger_file>().write(whole.c_str(), whole.size());
+			aux::writer_single<auto_logger_file>().write(buffer.c_str(), buffer.size());
 			aux::writer_single<auto_logger_file>().flush();
 		}
-		LOGGER_DBG_VIEW_(whole);
-#ifndef DISABLE_LOGGER_TO_CONSOLE
-		if (!disable_cout)
-			output_console(level, prefix, tmp);
+	}
+
+	// 同步写日志, 每一行都加锁并写入文件.
+	inline void logger_writer_sync(std::string& level, std::string& message, bool disable_cout = false)
+	{
+		LOGGER_LOCKS_();
+		std::string whole;
+		logger_write_line(level, coarse_clock::precise_unix_microseconds(), message, disable_cout, whole);
+		logger_write_file(whole);
+	}
+
+#ifndef LOGGER_ASYNC_QUEUE_SIZE
+#	define LOGGER_ASYNC_QUEUE_SIZE 4096		// 每个线程的日志队列长度.
+#endif
+
+#ifndef LOGGER_ASYNC_FLUSH_INTERVAL
+#	define LOGGER_ASYNC_FLUSH_INTERVAL 100	// 写线程最长多少毫秒写一次文件.
+#endif
+
+#ifndef LOGGER_ASYNC_BATCH_SIZE
+#	define LOGGER_ASYNC_BATCH_SIZE 65536	// 累积多少字节就写一次文件.
+#endif
+
+	/// Asynchronous logging backend.
+	///
+	/// Every thread that logs gets its own single-producer ring buffer, so
+	/// logging takes no lock and does no I/O on the calling thread; it only
+	/// records the time and hands over the message. One background thread
+	/// drains all rings, orders each batch of lines by time, formats them and writes
+	/// them to the log file in batches, flushing when LOGGER_ASYNC_BATCH_SIZE
+	/// bytes have accumulated or every LOGGER_ASYNC_FLUSH_INTERVAL ms.
+	///
+	/// When a ring is full the line is dropped (and counted, the count is
+	/// logged later) or the caller waits for room, see set_overflow_policy.
+	class async_logger : boost::noncopyable
+	{
+	public:
+		enum overflow_policy
+		{
+			overflow_drop,		// 队列满时丢弃, 调用线程从不等待.
+			overflow_block		// 队列满时睡眠等待写线程腾出空间.
+		};
+
+		async_logger()
+			: m_policy(overflow_drop)
+			, m_dropped(0)
+			, m_stopping(false)
+			, m_waiting(0)
+		{
+			// 先构造日志文件对象和时间格式化用的静态对象, 保证它们在本对象之后析构,
+			// 析构时写线程还要用它们写出剩余的日志.
+			aux::writer_single<auto_logger_file>();
+			aux::time_now_string();
+			m_thread = boost::thread(boost::bind(&async_logger::run, this));
+		}
+
+		~async_logger()
+		{
+			// 写线程看到 m_stopping 后还要取空队列, 之前写入的日志要对它可见.
+			m_stopping.store(true, boost::memory_order_release);
+			m_wakeup.notify_one();
+			{
+				boost::mutex::scoped_lock l(m_drained_mutex);
+				m_drained.notify_all();
+			}
+			if (m_thread.joinable())
+				m_thread.join();
+		}
+
+		static async_logger& instance()
+		{
+			return aux::writer_single<async_logger>();
+		}
+
+		/// Can be changed at any time, from any thread; lines being posted
+		/// at that moment may still follow the previous policy.
+		void set_overflow_policy(overflow_policy policy)
+		{
+			m_policy.store(policy, boost::memory_order_relaxed);
+		}
+
+		void post(std::string& level, std::string& message, bool disable_cout)
+		{
+			record r;
+			r.time = coarse_clock::precise_unix_microseconds();
+			r.level = &level;
+			r.message = new std::string;
+			r.message->swap(message);
+			r.disable_cout = disable_cout;
+
+			producer& p = local_producer();
+			while (!p.queue.push(r))
+			{
+				if (m_policy.load(boost::memory_order_relaxed) == overflow_drop
+					|| m_stopping.load(boost::memory_order_relaxed))
+				{
+					delete r.message;
+					m_dropped.fetch_add(1, boost::memory_order_relaxed);
+					return;
+				}
+				wait_for_room(p);
+			}
+			// 队列快满时提前叫醒写线程.
+			if (p.queue.read_available() > LOGGER_ASYNC_QUEUE_SIZE / 2)
+				m_wakeup.notify_one();
+		}
+
+	private:
+		struct record
+		{
+			boost::uint64_t time;			// UNIX 微秒数.
+			std::string* level;
+			std::string* message;
+			bool disable_cout;
+
+			bool operator<(const record& other) const
+			{
+				return time < other.time;
+			}
+		};
+
+		struct producer
+		{
+			producer() : closed(false) {}
+			boost::lockfree::spsc_queue<record, boost::lockfree::capacity<LOGGER_ASYNC_QUEUE_SIZE> > queue;
+			boost::atomic<bool> closed;		// 线程已经退出, 取空后可以释放.
+		};
+		typedef boost::shared_ptr<producer> producer_ptr;
+
+		// 线程退出时只做标记, 由写线程释放队列.
+		struct producer_holder
+		{
+			explicit producer_holder(producer_ptr p) : ptr(p) {}
+			~producer_holder() { ptr->closed = true; }
+			producer_ptr ptr;
+		};
+
+		producer& local_producer()
+		{
+			producer_holder* holder = m_local.get();
+			if (!holder)
+			{
+				producer_ptr p = boost::make_shared<producer>();
+				{
+					boost::mutex::scoped_lock l(m_producers_mutex);
+					m_producers.push_back(p);
+				}
+				holder = new producer_holder(p);
+				m_local.reset(holder);
+			}
+			return *holder->ptr;
+		}
+
+		// 睡在 m_drained 上等写线程取走日志, 不占用调用线程的 CPU.
+		void wait_for_room(producer& p)
+		{
+			m_waiting.fetch_add(1);
+			{
+				boost::mutex::scoped_lock l(m_drained_mutex);
+				m_wakeup.notify_one();
+				// 写线程取日志后持有 m_drained_mutex 才通知, 这里检查之后不会错过通知.
+				if (!p.queue.write_available() && !m_stopping.load(boost::memory_order_relaxed))
+					m_drained.timed_wait(l, boost::posix_time::milliseconds(LOGGER_ASYNC_FLUSH_INTERVAL));
+			}
+			m_waiting.fetch_sub(1);
+		}
+
+		void collect(std::vector<record>& batch)
+		{
+			boost::mutex::scoped_lock l(m_producers_mutex);
+			for (std::size_t i = 0; i < m_producers.size();)
+			{
+				producer& p = *m_producers[i];
+				bool closed = p.closed;
+				record r;
+				while (p.queue.pop(r))
+					batch.push_back(r);
+				if (closed)
+				{
+					m_producers[i] = m_producers.back();
+					m_producers.pop_back();
+				}
+				else
+				{
+					++i;
+				}
+			}
+		}
+
+		void run()
+		{
+			std::vector<record> batch;
+			std::string buffer;
+			for (;;)
+			{
+				bool stopping = m_stopping.load(boost::memory_order_acquire);
+				collect(batch);
+				if (m_waiting)
+				{
+					boost::mutex::scoped_lock l(m_drained_mutex);
+					m_drained.notify_all();
+				}
+				// 各线程的队列分别有序, 合并后按时间排序.
+				std::stable_sort(batch.begin(), batch.end());
+				for (std::size_t i = 0; i < batch.size(); ++i)
+				{
+					logger_write_line(*batch[i].level, batch[i].time, *batch[i].message, batch[i].disable_cout, buffer);
+					delete batch[i].message;
+					if (buffer.size() >= LOGGER_ASYNC_BATCH_SIZE)
+					{
+						logger_write_file(buffer);
+						buffer.clear();
+					}
+				}
+				batch.clear();
+
+				std::size_t dropped = m_dropped.exchange(0, boost::memory_order_relaxed);
+				if (dropped)
+				{
+					std::ostringstream oss;
+					oss << dropped << " log lines dropped, log queue full";
+					logger_write_line(LOGGER_WARN_STR, coarse_clock::precise_unix_microseconds(), oss.str(), false, buffer);
+				}
+
+				logger_write_file(buffer);
+				buffer.clear();
+
+				if (stopping)
+					break;
+
+				boost::mutex::scoped_lock l(m_wakeup_mutex);
+				m_wakeup.timed_wait(l, boost::posix_time::milliseconds(LOGGER_ASYNC_FLUSH_INTERVAL));
+			}
+		}
+
+	private:
+		boost::atomic<overflow_policy> m_policy;
+		boost::atomic<std::size_t> m_dropped;
+		boost::atomic<bool> m_stopping;
+		boost::thread_specific_ptr<producer_holder> m_local;
+		boost::mutex m_producers_mutex;		// 只在线程第一次写日志和写线程取日志时使用.
+		std::vector<producer_ptr> m_producers;
+		boost::mutex m_wakeup_mutex;
+		boost::condition_variable m_wakeup;
+		boost::atomic<std::size_t> m_waiting;	// 在等待队列空间的线程数.
+		boost::mutex m_drained_mutex;
+		boost::condition_variable m_drained;	// 写线程取走了一批日志.
+		boost::thread m_thread;
+	};
+
+	inline void logger_writer(std::string& level, std::string& message, bool disable_cout = false)
+	{
+#ifndef DISABLE_LOGGER_ASYNC
+		async_logger::instance().post(level, message, disable_cout);
+#else
+		logger_writer_sync(level, message, disable_cout);
 #endif
 	}
 
@@ -0,0 +1,438 @@
+﻿//
+// Copyright (C) 2013 Jack.
+//
+// Author: jack
+// Email:  jack.wgm@gmail.com
+//
+
+#pragma once
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/logic/tribool.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/utility/string_ref.hpp>
+
+// multipart 中一个 part 的头部最大字节数.
+#ifndef HTTP_MAX_PART_HEADER_SIZE
+#	define HTTP_MAX_PART_HEADER_SIZE 8192
+#endif
+
+namespace http {
+
+	/// Boyer-Moore-Horspool search for a fixed pattern, used to find
+	/// multipart boundaries. On a mismatch it skips ahead by up to the
+	/// pattern length, so a long boundary is found touching only a fraction
+	/// of the bytes before it.
+	class bmh_searcher
+	{
+	public:
+		explicit bmh_searcher(boost::string_ref pattern)
+			: m_pattern(pattern.data(), pattern.size())
+		{
+			std::size_t n = m_pattern.size();
+			for (std::size_t i = 0; i < 256; ++i)
+				m_skip[i] = n;
+			for (std::size_t i = 0; i + 1 < n; ++i)
+				m_skip[static_cast<unsigned char>(m_pattern[i])] = n - 1 - i;
+		}
+
+		/// The first occurrence of the pattern in [begin, end), or end.
+		const char* search(const char* begin, const char* end) const
+		{
+			std::size_t n = m_pattern.size();
+			if (n == 0 || static_cast<std::size_t>(end - begin) < n)
+				return end;
+			const char* pattern = m_pattern.data();
+			const char last = pattern[n - 1];
+			for (const char* p = begin; p <= end - n; p += m_skip[static_cast<unsigned char>(p[n - 1])])
+			{
+				if (p[n - 1] == last && std::memcmp(p, pattern, n - 1) == 0)
+					return p;
+			}
+			return end;
+		}
+
+		const std::string& pattern() const
+		{
+			return m_pattern;
+		}
+
+	private:
+		std::string m_pattern;
+		std::size_t m_skip[256];
+	};
+
+	/// One part of a multipart body. All members point into the parsed
+	/// input: the body for split_multipart, the parser's header buffer for
+	/// multipart_parser.
+	struct multipart_part
+	{
+		boost::string_ref name;				// Content-Disposition 的 name.
+		boost::string_ref filename;			// Content-Disposition 的 filename, 不是文件时为空.
+		boost::string_ref content_type;
+		boost::string_ref headers;			// 整个头部, 不含结尾的空行.
+		boost::string_ref data;				// 只有 split_multipart 设置.
+	};
+
+	namespace detail {
+
+		inline bool iequals_ascii(boost::string_ref a, boost::string_ref b)
+		{
+			if (a.size() != b.size())
+				return false;
+			for (std::size_t i = 0; i < a.size(); ++i)
+			{
+				char x = a[i], y = b[i];
+				if (x >= 'A' && x <= 'Z') x += 'a' - 'A';
+				if (y >= 'A' && y <= 'Z') y += 'a' - 'A';
+				if (x != y)
+					return false;
+			}
+			return true;
+		}
+
+		inline boost::string_ref trim_ascii(boost::string_ref s)
+		{
+			while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+				s.remove_prefix(1);
+			while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+				s.remove_suffix(1);
+			return s;
+		}
+
+		/// Find parameter name in a header value like
+		/// `form-data; name="a"; filename="b"`. Quoted values are returned
+		/// without the quotes.
+		inline bool header_parameter(boost::string_ref value, boost::string_ref name, boost::string_ref& result)
+		{
+			std::size_t i = value.find(';');
+			while (i != boost::string_ref::npos)
+			{
+				value.remove_prefix(i + 1);
+				std::size_t eq = value.find('=');
+				if (eq == boost::string_ref::npos)
+					return false;
+				boost::string_ref key = trim_ascii(value.substr(0, eq));
+				value.remove_prefix(eq + 1);
+				while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+					value.remove_prefix(1);
+
+				boost::string_ref v;
+				if (!value.empty() && value.front() == '"')
+				{
+					// 浏览器把值里的引号编码成 %22, 不会出现转义的引号.
+					value.remove_prefix(1);
+					std::size_t quote = value.find('"');
+					if (quote == boost::string_ref::npos)
+						return false;
+					v = value.substr(0, quote);
+					value.remove_prefix(quote + 1);
+				}
+				else
+				{
+					std::size_t semicolon = value.find(';');
+					v = trim_ascii(value.substr(0, semicolon));
+					value.remove_prefix(semicolon == boost::string_ref::npos ? value.size() : semicolon);
+				}
+				if (iequals_ascii(key, name))
+				{
+					result = v;
+					return true;
+				}
+				i = value.find(';');
+			}
+			return false;
+		}
+
+		/// Scan the header block of a part, the lines before the empty line.
+		inline void parse_part_headers(boost::string_ref block, multipart_part& part)
+		{
+			part.headers = block;
+			while (!block.empty())
+			{
+				std::size_t eol = block.find("\r\n");
+				boost::string_ref line = block.substr(0, eol);
+				block.remove_prefix(eol == boost::string_ref::npos ? block.size() : eol + 2);
+
+				std::size_t colon = line.find(':');
+				if (colon == boost::string_ref::npos)
+					continue;
+				boost::string_ref name = trim_ascii(line.substr(0, colon));
+				boost::string_ref value = trim_ascii(line.substr(colon + 1));
+				if (iequals_ascii(name, "content-disposition"))
+				{
+					header_parameter(value, "name", part.name);
+					header_parameter(value, "filename", part.filename);
+				}
+				else if (iequals_ascii(name, "content-type"))
+				{
+					part.content_type = value;
+				}
+			}
+		}
+	}
+
+	/// The boundary parameter of a multipart Content-Type, without quotes.
+	inline bool multipart_boundary(boost::string_ref content_type, boost::string_ref& boundary)
+	{
+		if (!detail::header_parameter(content_type, "boundary", boundary))
+			return false;
+		// RFC 2046: 1 到 70 个字符.
+		return !boundary.empty() && boundary.size() <= 70;
+	}
+
+	/// Split a complete multipart body into parts, without copying: every
+	/// member of the parts points into body. Returns false if the body is
+	/// malformed or ends before the closing boundary.
+	inline bool split_multipart(boost::string_ref body, boost::string_ref boundary, std::vector<multipart_part>& parts)
+	{
+		// 分隔符是 "\r\n--boundary", 第一个分隔符前面可以没有 "\r\n".
+		std::string delimiter = "\r\n--";
+		delimiter.append(boundary.data(), boundary.size());
+		bmh_searcher searcher(delimiter);
+
+		const char* begin = body.data();
+		const char* end = begin + body.size();
+		const char* p;
+		if (body.size() >= delimiter.size() - 2 && std::memcmp(begin, delimiter.data() + 2, delimiter.size() - 2) == 0)
+		{
+			p = begin + delimiter.size() - 2;
+		}
+		else
+		{
+			p = searcher.search(begin, end);
+			if (p == end)
+				return false;
+			p += delimiter.size();
+		}
+
+		for (;;)
+		{
+			// 分隔符之后是结束标记 "--", 或者可选的空白和 "\r\n".
+			if (end - p >= 2 && p[0] == '-' && p[1] == '-')
+				return true;
+			while (p != end && (*p == ' ' || *p == '\t'))
+				++p;
+			if (end - p < 2 || p[0] != '\r' || p[1] != '\n')
+				return false;
+			p += 2;
+
+			multipart_part part;
+			const char* data;
+			if (end - p >= 2 && p[0] == '\r' && p[1] == '\n')
+			{
+				// 没有头部的 part.
+				data = p + 2;
+			}
+			else
+			{
+				boost::string_ref rest(p, end - p);
+				std::size_t header_end = rest.find("\r\n\r\n");
+				if (header_end == boost::string_ref::npos)
+					return false;
+				detail::parse_part_headers(rest.substr(0, header_end), part);
+				data = p + header_end + 4;
+			}
+
+			const char* next = searcher.search(data, end);
+			if (next == end)
+				return false;
+			part.data = boost::string_ref(data, next - data);
+			parts.push_back(part);
+			p = next + delimiter.size();
+		}
+	}
+
+	/// Incremental multipart parser for bodies that are not kept in memory,
+	/// for example fed from http_route_options::on_body.
+	///
+	/// The input may be split anywhere. For every part, on_part is called
+	/// with its headers, then on_data with its contents in one or more
+	/// pieces, then on_part_end. Contents are passed straight from the
+	/// input; only the few bytes at the end of an input piece that could
+	/// begin a boundary are held back and copied.
+	class multipart_parser
+		: public boost::noncopyable
+	{
+	public:
+		typedef boost::function<void(const multipart_part&)> part_handler;
+		typedef boost::function<void(const char*, std::size_t)> data_handler;
+		typedef boost::function<void()> end_handler;
+
+		multipart_parser(boost::string_ref boundary, part_handler on_part, data_handler on_data,
+			end_handler on_part_end = end_handler())
+			: m_searcher("\r\n--" + std::string(boundary.data(), boundary.size()))
+			, m_on_part(on_part)
+			, m_on_data(on_data)
+			, m_on_part_end(on_part_end)
+		{
+			reset();
+		}
+
+		void reset()
+		{
+			// 开头补一个 "\r\n", 第一个分隔符就和其它的一样.
+			m_state = state_preamble;
+			m_tail = "\r\n";
+			m_header.clear();
+		}
+
+		/// Parse the next piece of the body. Returns true once the closing
+		/// boundary has been seen (anything after it is ignored), false if the
+		/// body is malformed, indeterminate if more input is needed.
+		boost::tribool parse(const char* data, std::size_t size)
+		{
+			const char* p = data;
+			const char* end = data + size;
+			while (p != end)
+			{
+				switch (m_state)
+				{
+				case state_preamble:
+				case state_data:
+					p = scan(p, end);
+					break;
+				case state_delimiter:
+					if (*p == '-')
+						m_state = state_final_dash;
+					else if (*p == '\r')
+						m_state = state_delimiter_lf;
+					else if (*p != ' ' && *p != '\t')
+						return false;
+					++p;
+					break;
+				case state_final_dash:
+					if (*p++ != '-')
+						return false;
+					m_state = state_epilogue;
+					return true;
+				case state_delimiter_lf:
+					if (*p++ != '\n')
+						return false;
+					m_state = state_headers;
+					m_header.clear();
+					break;
+				case state_headers:
+					if (!read_headers(p, end))
+						return false;
+					break;
+				case state_epilogue:
+					return true;
+				}
+			}
+			if (m_state == state_epilogue)
+				return true;
+			return boost::indeterminate;
+		}
+
+	private:
+		// 在 preamble 或 part 的内容中找分隔符, 返回处理到的位置.
+		const char* scan(const char* p, const char* end)
+		{
+			const std::string& delimiter = m_searcher.pattern();
+			if (!m_tail.empty())
+			{
+				// 上次留下的尾巴加上足够的新数据, 看分隔符是否跨在两次输入之间.
+				std::size_t old_size = m_tail.size();
+				std::size_t take = (std::min)(static_cast<std::size_t>(end - p), delimiter.size() - 1);
+				m_tail.append(p, take);
+				const char* tail_begin = m_tail.data();
+				const char* tail_end = tail_begin + m_tail.size();
+				const char* found = m_searcher.search(tail_begin, tail_end);
+				if (found != tail_end)
+				{
+					emit(tail_begin, found - tail_begin);
+					std::size_t used = found - tail_begin + delimiter.size() - old_size;
+					m_tail.clear();
+					found_delimiter();
+					return p + used;
+				}
+				if (take == static_cast<std::size_t>(end - p))
+				{
+					// 新数据全部进了尾巴, 只留下可能是分隔符开头的部分.
+					std::size_t safe = m_tail.size() >= delimiter.size() ? m_tail.size() - (delimiter.size() - 1) : 0;
+					emit(m_tail.data(), safe);
+					m_tail.erase(0, safe);
+					return end;
+				}
+				// 从旧尾巴开始的分隔符都已经排除, 旧尾巴是数据; 复制的新数据只用来判断.
+				emit(m_tail.data(), old_size);
+				m_tail.clear();
+			}
+
+			const char* found = m_searcher.search(p, end);
+			if (found != end)
+			{
+				emit(p, found - p);
+				found_delimiter();
+				return found + delimiter.size();
+			}
+
+			// 结尾可能是分隔符的开头, 留到下次.
+			std::size_t keep = (std::min)(static_cast<std::size_t>(end - p), delimiter.size() - 1);
+			emit(p, end - p - keep);
+			m_tail.assign(end - keep, keep);
+			return end;
+		}
+
+		void emit(const char* data, std::size_t size)
+		{
+			if (size && m_state == state_data && m_on_data)
+				m_on_data(data, size);
+		}
+
+		void found_delimiter()
+		{
+			if (m_state == state_data && m_on_part_end)
+				m_on_part_end();
+			m_state = state_delimiter;
+		}
+
+		bool read_headers(const char*& p, const char* end)
+		{
+			// 头部复制到 m_header, 直到空行. 没有头部时第一行就是空行.
+			while (p != end)
+			{
+				m_header += *p++;
+				std::size_t n = m_header.size();
+				bool empty = n == 2 && m_header[0] == '\r' && m_header[1] == '\n';
+				if (empty || (n >= 4 && m_header.compare(n - 4, 4, "\r\n\r\n") == 0))
+				{
+					multipart_part part;
+					detail::parse_part_headers(boost::string_ref(m_header.data(), empty ? 0 : n - 4), part);
+					m_state = state_data;
+					if (m_on_part)
+						m_on_part(part);
+					return true;
+				}
+				if (n > HTTP_MAX_PART_HEADER_SIZE)
+					return false;
+			}
+			return true;
+		}
+
+		enum state
+		{
+			state_preamble,
+			state_delimiter,		// 分隔符之后, 等 "--" 或 "\r\n".
+			state_final_dash,
+			state_delimiter_lf,
+			state_headers,
+			state_data,
+			state_epilogue
+		};
+
+		bmh_searcher m_searcher;
+		part_handler m_on_part;
+		data_handler m_on_data;
+		end_handler m_on_part_end;
+		state m_state;
+		std::string m_tail;			// 可能是分隔符开头的数据, 少于分隔符的长度.
+		std::string m_header;
+	};
+
+}
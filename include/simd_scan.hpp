@@ -0,0 +1,103 @@
+﻿//
+// Copyright (C) 2013 Jack.
+//
+// Author: jack
+// Email:  jack.wgm@gmail.com
+//
+
+#pragma once
+
+#include <cstddef>
+
+#if !defined(HTTP_DISABLE_SIMD)
+# if defined(__AVX2__)
+#  define HTTP_PARSER_AVX2
+# endif
+# if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define HTTP_PARSER_SSE2
+# endif
+#endif // HTTP_DISABLE_SIMD
+
+#if defined(HTTP_PARSER_AVX2)
+# include <immintrin.h>
+#elif defined(HTTP_PARSER_SSE2)
+# include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER) && (defined(HTTP_PARSER_AVX2) || defined(HTTP_PARSER_SSE2))
+# include <intrin.h>
+#endif
+
+namespace http {
+namespace detail {
+
+#if defined(HTTP_PARSER_AVX2) || defined(HTTP_PARSER_SSE2)
+	inline unsigned int first_bit(unsigned int mask)
+	{
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward(&index, mask);
+		return index;
+#else
+		return __builtin_ctz(mask);
+#endif
+	}
+#endif
+
+	/// Return the first position in [p, end) holding one of the N - 1 delimiter
+	/// characters (the trailing NUL of the literal is not a delimiter), or any
+	/// HTTP control character when StopOnCtl is set. Returns end if none found.
+	template <bool StopOnCtl, std::size_t N>
+	inline const char* scan(const char* p, const char* end, const char (&delims)[N])
+	{
+#if defined(HTTP_PARSER_AVX2)
+		while (end - p >= 32)
+		{
+			__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+			__m256i hit = _mm256_setzero_si256();
+			for (std::size_t i = 0; i < N - 1; ++i)
+				hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(delims[i])));
+			if (StopOnCtl)
+			{
+				// 无符号 v <= 0x1f 或 v == 0x7f.
+				hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x1f)), v));
+				hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7f)));
+			}
+			unsigned int mask = static_cast<unsigned int>(_mm256_movemask_epi8(hit));
+			if (mask)
+				return p + first_bit(mask);
+			p += 32;
+		}
+#endif
+#if defined(HTTP_PARSER_SSE2)
+		while (end - p >= 16)
+		{
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+			__m128i hit = _mm_setzero_si128();
+			for (std::size_t i = 0; i < N - 1; ++i)
+				hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8(delims[i])));
+			if (StopOnCtl)
+			{
+				hit = _mm_or_si128(hit, _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1f)), v));
+				hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f)));
+			}
+			unsigned int mask = static_cast<unsigned int>(_mm_movemask_epi8(hit));
+			if (mask)
+				return p + first_bit(mask);
+			p += 16;
+		}
+#endif
+		for (; p != end; ++p)
+		{
+			unsigned char c = static_cast<unsigned char>(*p);
+			if (StopOnCtl && (c <= 0x1f || c == 0x7f))
+				return p;
+			for (std::size_t i = 0; i < N - 1; ++i)
+				if (*p == delims[i])
+					return p;
+		}
+		return end;
+	}
+
+}
+}
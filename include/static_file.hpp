@@ -0,0 +1,194 @@
+﻿//
+// Copyright (C) 2013 Jack.
+//
+// Author: jack
+// Email:  jack.wgm@gmail.com
+//
+
+#pragma once
+
+#include <ctime>
+#include <list>
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include "internal.hpp"
+
+// Linux 上用 sendfile(2) 写出文件内容, 其它平台把文件映射到内存, 和协议头一起 gather write.
+#ifndef HTTP_USE_SENDFILE
+#	if defined(__linux__)
+#		define HTTP_USE_SENDFILE 1
+#	else
+#		define HTTP_USE_SENDFILE 0
+#	endif
+#endif
+
+// 一次 sendfile 最多发送的字节数, 发完一段先让同一线程上的其它连接运行.
+#ifndef HTTP_SENDFILE_CHUNK
+#	define HTTP_SENDFILE_CHUNK (1 << 20)
+#endif
+
+// 每个 io_service 缓存的打开文件数.
+#ifndef HTTP_STATIC_FILE_CACHE
+#	define HTTP_STATIC_FILE_CACHE 256
+#endif
+
+namespace http {
+
+	struct request;
+	class http_connection;
+	typedef boost::shared_ptr<http_connection> http_connection_ptr;
+
+	/// Result of stat() on a file to serve.
+	struct static_file_info
+	{
+		static_file_info()
+			: size(0)
+			, mtime(0)
+			, id(0)
+			, regular(false)
+			, directory(false)
+		{}
+
+		bool operator==(const static_file_info& other) const
+		{
+			return size == other.size && mtime == other.mtime && id == other.id;
+		}
+
+		boost::uint64_t size;
+		std::time_t mtime;
+		boost::uint64_t id;			// inode, 文件被替换时会变; 没有 inode 的平台为 0.
+		bool regular;
+		bool directory;
+	};
+
+	/// An open file, shared by the file cache and the responses being
+	/// written from it. The file stays open, and its contents unchanged to
+	/// the reader, until the last of them lets go.
+	class static_file
+		: public boost::noncopyable
+	{
+	public:
+		/// Open the file. Throws boost::interprocess::interprocess_exception
+		/// if it can not be opened.
+		static_file(const std::string& path, const static_file_info& info);
+
+		const std::string& path() const { return m_path; }
+		const static_file_info& info() const { return m_info; }
+		boost::uint64_t size() const { return m_info.size; }
+		const std::string& etag() const { return m_etag; }
+		const std::string& last_modified() const { return m_last_modified; }
+		const char* mime_type() const { return m_mime_type; }
+
+		/// The descriptor to give to sendfile.
+		boost::interprocess::file_handle_t handle() const
+		{
+			return m_mapping.get_mapping_handle().handle;
+		}
+
+		/// The whole file mapped into memory, mapped on the first call. 0 for
+		/// an empty file or if it can not be mapped. Must only be called on
+		/// the thread of the cache the file came from.
+		const char* data() const;
+
+	private:
+		std::string m_path;
+		static_file_info m_info;
+		std::string m_etag;
+		std::string m_last_modified;
+		const char* m_mime_type;
+		boost::interprocess::file_mapping m_mapping;
+		mutable boost::interprocess::mapped_region m_region;
+		mutable bool m_mapped;
+	};
+	typedef boost::shared_ptr<const static_file> static_file_ptr;
+
+	/// 静态文件的选项, 见 http_server::add_static_handler.
+	struct static_file_options
+	{
+		static_file_options()
+			: index("index.html")
+			, max_age(0)
+			, cache_entries(HTTP_STATIC_FILE_CACHE)
+			, revalidate(2)
+			, hidden(false)
+			, follow_symlinks(false)
+		{}
+
+		std::string index;			// 请求目录时返回的文件, 为空时目录返回 404.
+		std::size_t max_age;		// Cache-Control 的 max-age 秒数, 0 表示不发送.
+		std::size_t cache_entries;	// 每个 io_service 缓存的打开文件数.
+		std::size_t revalidate;		// 缓存的 stat 结果在这么多秒内直接使用, 之后重新 stat.
+		bool hidden;				// 允许访问以 '.' 开头的文件和目录.
+		bool follow_symlinks;		// 允许符号链接指向根目录以外的文件.
+	};
+
+	/// Serves the files under a directory.
+	///
+	/// Every io_service keeps an LRU cache of open files with their stat
+	/// result, ETag and Last-Modified, so a hit costs no system call until
+	/// revalidate seconds have passed. File contents are written straight
+	/// from the page cache with sendfile, or from a read-only mapping where
+	/// sendfile is not available; they are never copied into a buffer.
+	/// Conditional requests and single byte ranges are supported. Unless
+	/// follow_symlinks is set, a file is only served if the path with all
+	/// symbolic links resolved still lies under the root.
+	class static_file_handler
+		: public boost::noncopyable
+	{
+	public:
+		/// Throws std::runtime_error if root is not a directory.
+		static_file_handler(const std::string& root, std::size_t shards,
+			const static_file_options& options = static_file_options());
+
+		/// Serve the file named by the last path parameter of the route, a
+		/// "*name" wildcard. Must be called on the connection's thread.
+		void handle(const request& req, http_connection_ptr conn);
+
+		/// Open a file relative to the root, from the cache of the calling
+		/// io_service. Returns null if there is no such file.
+		static_file_ptr open(std::size_t shard, const std::string& relative);
+
+		/// Percent-decode a request path and turn it into a path relative to
+		/// the root. Returns false for a path that could leave the root, or
+		/// that names a hidden file when they are not allowed.
+		static bool resolve_path(boost::string_ref encoded, std::string& relative, bool hidden);
+
+		/// MIME type by file extension, "application/octet-stream" if unknown.
+		static const char* mime_type(boost::string_ref path);
+
+	private:
+		struct entry
+		{
+			std::string relative;
+			static_file_ptr file;
+			std::time_t checked;		// 上次 stat 的时间.
+		};
+		typedef std::list<entry> lru_list;
+
+		struct cache
+		{
+			char padding_front[HTTP_CACHELINE_SIZE];
+			lru_list lru;				// 最近使用的在前.
+			boost::unordered_map<std::string, lru_list::iterator> index;
+			char padding_back[HTTP_CACHELINE_SIZE];
+		};
+
+		bool stat_path(const std::string& relative, std::string& path, static_file_info& info) const;
+		bool resolve_inside_root(std::string& path) const;
+
+	private:
+		std::string m_root;
+		static_file_options m_options;
+		std::vector<boost::shared_ptr<cache> > m_caches;
+	};
+
+}
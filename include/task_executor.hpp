@@ -0,0 +1,77 @@
+﻿//
+// Copyright (C) 2013 Jack.
+//
+// Author: jack
+// Email:  jack.wgm@gmail.com
+//
+
+#pragma once
+
+#include <deque>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "internal.hpp"
+
+namespace http {
+
+	/// A work-stealing thread pool for CPU-bound or blocking work that must not
+	/// run on the io_service threads.
+	///
+	/// Every worker owns a task queue. post() spreads tasks over the queues
+	/// round-robin; a worker takes tasks from the front of its own queue and,
+	/// when that is empty, steals from the back of the others, so one slow task
+	/// never holds up the tasks queued behind it while other workers are idle.
+	class task_executor
+		: private boost::noncopyable
+	{
+	public:
+		typedef boost::function<void()> task;
+
+		/// Start the given number of worker threads.
+		explicit task_executor(std::size_t threads = boost::thread::hardware_concurrency());
+
+		/// Stops the pool and waits for the workers.
+		~task_executor();
+
+		/// Queue a task. Safe to call from any thread.
+		void post(const task& t);
+
+		/// Run the tasks already queued, then stop the workers. Tasks posted
+		/// after stop() are dropped.
+		void stop();
+
+		/// Number of worker threads.
+		std::size_t size() const;
+
+	private:
+		void run(std::size_t index);
+		bool pop(std::size_t index, task& t);
+
+		// 每个队列单独分配并填充, 避免不同 worker 的锁落在同一缓存行.
+		struct worker
+		{
+			char padding_front[HTTP_CACHELINE_SIZE];
+			boost::mutex mutex;
+			std::deque<task> tasks;
+			char padding_back[HTTP_CACHELINE_SIZE];
+		};
+
+		std::vector<boost::shared_ptr<worker> > m_workers;
+		boost::thread_group m_threads;
+		boost::atomic<std::size_t> m_next;		// post 轮流使用的队列.
+		boost::atomic<std::size_t> m_pending;	// 所有队列中的任务数.
+		boost::atomic<std::size_t> m_sleeping;	// 正在等待任务的 worker 数.
+		boost::atomic<bool> m_stopped;
+		boost::mutex m_idle_mutex;
+		boost::condition_variable m_idle;
+	};
+
+}
@@ -0,0 +1,127 @@
+﻿//
+// Copyright (C) 2013 Jack.
+//
+// Author: jack
+// Email:  jack.wgm@gmail.com
+//
+
+#pragma once
+
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/intrusive/list.hpp>
+
+namespace http {
+
+	/// A hashed timing wheel. Scheduling and cancelling a timer are O(1); each
+	/// advance() only visits the timers hashed to the current slot.
+	///
+	/// The wheel is not thread safe: it is meant to be owned by one io_service
+	/// and driven from that io_service's thread, as are all of its timers.
+	class timing_wheel
+		: public boost::noncopyable
+	{
+	public:
+		typedef boost::intrusive::list_base_hook<
+			boost::intrusive::link_mode<boost::intrusive::auto_unlink> > timer_hook;
+
+		/// A timer that can sit in at most one wheel slot. It unlinks itself
+		/// on destruction, so owners need not cancel it first.
+		class timer
+			: public timer_hook
+		{
+			friend class timing_wheel;
+		public:
+			explicit timer(const boost::function<void()>& handler)
+				: m_handler(handler)
+				, m_expires(0)
+			{}
+
+			bool is_scheduled() const
+			{
+				return is_linked();
+			}
+
+			void cancel()
+			{
+				unlink();
+			}
+
+		private:
+			boost::function<void()> m_handler;
+			boost::uint64_t m_expires;
+		};
+
+		/// slots is rounded up to a power of two.
+		explicit timing_wheel(std::size_t slots = 512)
+			: m_slots(round_up(slots))
+			, m_now(0)
+		{}
+
+		~timing_wheel()
+		{
+			for (std::size_t i = 0; i < m_slots.size(); ++i)
+				m_slots[i].clear();
+		}
+
+		/// (Re)schedule t to fire on the ticks-th advance() from now (at least one).
+		/// As the current tick is already partly over, the real delay is between
+		/// ticks - 1 and ticks tick periods.
+		void schedule(timer& t, std::size_t ticks)
+		{
+			t.unlink();
+			if (ticks == 0)
+				ticks = 1;
+			t.m_expires = m_now + ticks;
+			m_slots[t.m_expires & (m_slots.size() - 1)].push_back(t);
+		}
+
+		/// Move time forward by one tick and run the timers that expire.
+		void advance()
+		{
+			++m_now;
+			slot_type& slot = m_slots[m_now & (m_slots.size() - 1)];
+
+			// 先取出整个槽, 回调中新安排的定时器不会在这一轮被处理.
+			slot_type due;
+			due.splice(due.end(), slot);
+			while (!due.empty())
+			{
+				timer& t = due.front();
+				due.pop_front();
+				if (t.m_expires > m_now)
+				{
+					// 还要再转几圈.
+					slot.push_back(t);
+					continue;
+				}
+				t.m_handler();
+			}
+		}
+
+		boost::uint64_t now() const
+		{
+			return m_now;
+		}
+
+	private:
+		static std::size_t round_up(std::size_t slots)
+		{
+			std::size_t size = 1;
+			while (size < slots)
+				size <<= 1;
+			return size;
+		}
+
+		typedef boost::intrusive::list<timer,
+			boost::intrusive::base_hook<timer_hook>,
+			boost::intrusive::constant_time_size<false> > slot_type;
+
+		std::vector<slot_type> m_slots;
+		boost::uint64_t m_now;
+	};
+
+}
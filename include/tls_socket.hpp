@@ -0,0 +1,124 @@
+﻿//
+// Copyright (C) 2013 Jack.
+//
+// Author: jack
+// Email:  jack.wgm@gmail.com
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/version.hpp>
+
+namespace http {
+
+	/// TLS settings of an http_server, see http_server::enable_tls.
+	struct http_tls_options
+	{
+		http_tls_options()
+			: session_cache_size(20480)
+			, session_timeout(300)
+			, session_tickets(true)
+			, handshake_threads(2)
+		{}
+
+		std::string certificate_chain;	// PEM 格式的证书链文件, 服务器证书在最前面.
+		std::string private_key;		// PEM 格式的私钥文件.
+		std::string dh_params;			// PEM 格式的 DH 参数文件, 为空时不使用 DHE.
+		std::string ciphers;			// OpenSSL 格式的密码套件列表, 为空时使用 OpenSSL 的默认值.
+		std::size_t session_cache_size;	// 服务端会话缓存的条目数, 为 0 时不缓存会话.
+		std::size_t session_timeout;	// 会话 (包括 ticket) 的有效期, 秒.
+		bool session_tickets;			// 发放 session ticket (RFC 5077), 恢复会话时不用查服务端的缓存.
+		std::size_t handshake_threads;	// 执行握手计算的线程数, 为 0 时在连接的 io_service 线程上握手.
+	};
+
+	/// The transport under the ssl::stream of a connection.
+	///
+	/// Asynchronous operations go straight to the connection's socket. The
+	/// synchronous ones are for handshakes run on a handshake thread and
+	/// never wait for the peer: the socket must be in non-blocking mode, so
+	/// read_some fails with would_block when nothing has arrived and the
+	/// handshake returns to be resumed once the socket is readable again.
+	/// The engine cannot take back output it has handed over, so write_some
+	/// always reports everything written and keeps what the socket did not
+	/// accept as pending output, which the connection's own thread writes
+	/// out before it resumes the handshake or starts reading requests.
+	class tls_socket
+	{
+	public:
+		typedef boost::asio::ip::tcp::socket next_layer_type;
+		typedef next_layer_type::lowest_layer_type lowest_layer_type;
+
+		explicit tls_socket(next_layer_type& socket)
+			: m_socket(socket)
+		{}
+
+		lowest_layer_type& lowest_layer() { return m_socket.lowest_layer(); }
+		const lowest_layer_type& lowest_layer() const { return m_socket.lowest_layer(); }
+
+#if BOOST_VERSION >= 106600
+		typedef next_layer_type::executor_type executor_type;
+		executor_type get_executor() { return m_socket.get_executor(); }
+#else
+		boost::asio::io_service& get_io_service() { return m_socket.get_io_service(); }
+#endif
+
+		template <class MutableBuffers>
+		std::size_t read_some(const MutableBuffers& buffers, boost::system::error_code& ec)
+		{
+			return m_socket.read_some(buffers, ec);
+		}
+
+		template <class ConstBuffers>
+		std::size_t write_some(const ConstBuffers& buffers, boost::system::error_code& ec)
+		{
+			std::size_t size = boost::asio::buffer_size(buffers);
+			std::size_t written = 0;
+			// 已经有没写出的数据时不能插队, 直接排在后面.
+			if (m_pending.empty())
+			{
+				written = m_socket.write_some(buffers, ec);
+				if (ec && ec != boost::asio::error::would_block && ec != boost::asio::error::try_again)
+					return 0;
+			}
+			if (written < size)
+			{
+				std::size_t old_size = m_pending.size();
+				m_pending.resize(old_size + size);
+				boost::asio::buffer_copy(boost::asio::buffer(&m_pending[old_size], size), buffers);
+				m_pending.erase(m_pending.begin() + old_size, m_pending.begin() + old_size + written);
+			}
+			ec = boost::system::error_code();
+			return size;
+		}
+
+		template <class MutableBuffers, class Handler>
+		void async_read_some(const MutableBuffers& buffers, BOOST_ASIO_MOVE_ARG(Handler) handler)
+		{
+			m_socket.async_read_some(buffers, BOOST_ASIO_MOVE_CAST(Handler)(handler));
+		}
+
+		template <class ConstBuffers, class Handler>
+		void async_write_some(const ConstBuffers& buffers, BOOST_ASIO_MOVE_ARG(Handler) handler)
+		{
+			m_socket.async_write_some(buffers, BOOST_ASIO_MOVE_CAST(Handler)(handler));
+		}
+
+		/// Output of a synchronous handshake step that the socket did not
+		/// accept. Only touched by whichever thread runs the handshake; the
+		/// connection writes it out and clears it on its own thread.
+		std::vector<char>& pending_output() { return m_pending; }
+
+	private:
+		next_layer_type& m_socket;
+		std::vector<char> m_pending;
+	};
+
+	/// TLS over a connection's socket.
+	typedef boost::asio::ssl::stream<tls_socket> ssl_stream;
+
+}
@@ -0,0 +1,144 @@
+﻿//
+// Copyright (C) 2013 Jack.
+//
+// Author: jack
+// Email:  jack.wgm@gmail.com
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+
+#include <boost/utility/string_ref.hpp>
+
+#include "simd_scan.hpp"
+
+namespace http {
+namespace detail {
+
+	/// Value of a hex digit, or -1 if c is not one.
+	inline int hex_value(char c)
+	{
+		if (c >= '0' && c <= '9')
+			return c - '0';
+		c |= 0x20;
+		if (c >= 'a' && c <= 'f')
+			return c - 'a' + 10;
+		return -1;
+	}
+
+	/// The first '%', or '+' when plus_as_space is set, in [p, end).
+	inline const char* find_escape(const char* p, const char* end, bool plus_as_space)
+	{
+		return plus_as_space ? scan<false>(p, end, "%+") : scan<false>(p, end, "%");
+	}
+
+	/// Decode the %XX escape at p, which must have at least 3 bytes left.
+	/// Returns -1 if it is not a valid escape.
+	inline int decode_escape(const char* p)
+	{
+		int hi = hex_value(p[1]);
+		int lo = hex_value(p[2]);
+		if (hi < 0 || lo < 0)
+			return -1;
+		return (hi << 4) | lo;
+	}
+
+}
+
+	/// Percent-decode in and append the result to out, a string-like type
+	/// with append(const char*, size_t) and push_back. Runs without escapes
+	/// are found with SIMD and copied in one append.
+	///
+	/// A '%' that is not followed by two hex digits is kept as it is, like
+	/// browsers do, and the function returns false so that callers which
+	/// must reject such input (paths) can do so.
+	template <class OutString>
+	inline bool url_decode(boost::string_ref in, OutString& out, bool plus_as_space = true)
+	{
+		const char* p = in.data();
+		const char* end = p + in.size();
+		bool valid = true;
+		out.reserve(out.size() + in.size());
+		while (p != end)
+		{
+			const char* q = detail::find_escape(p, end, plus_as_space);
+			out.append(p, q - p);
+			if (q == end)
+				break;
+			if (*q == '+')
+			{
+				out.push_back(' ');
+				p = q + 1;
+				continue;
+			}
+			int value = (end - q >= 3) ? detail::decode_escape(q) : -1;
+			if (value < 0)
+			{
+				valid = false;
+				out.push_back('%');
+				p = q + 1;
+				continue;
+			}
+			out.push_back(static_cast<char>(value));
+			p = q + 3;
+		}
+		return valid;
+	}
+
+	/// Percent-decode data in place and return the decoded size, which is
+	/// never larger. Nothing is moved before the first escape. Invalid
+	/// escapes are kept as they are, see url_decode.
+	inline std::size_t url_decode_in_place(char* data, std::size_t size, bool plus_as_space = true)
+	{
+		const char* end = data + size;
+		const char* p = detail::find_escape(data, end, plus_as_space);
+		char* out = data + (p - data);
+		while (p != end)
+		{
+			int value = static_cast<unsigned char>(' ');
+			std::size_t used = 1;
+			if (*p == '%')
+			{
+				value = (end - p >= 3) ? detail::decode_escape(p) : -1;
+				if (value < 0)
+					value = static_cast<unsigned char>('%');
+				else
+					used = 3;
+			}
+			*out++ = static_cast<char>(value);
+			p += used;
+
+			// 两个转义之间的普通字符整段前移.
+			const char* q = detail::find_escape(p, end, plus_as_space);
+			std::memmove(out, p, q - p);
+			out += q - p;
+			p = q;
+		}
+		return out - data;
+	}
+
+	/// Split application/x-www-form-urlencoded data into its raw key and
+	/// value slices, calling handler(key, value) for each pair. Empty
+	/// pairs are skipped; a pair without '=' has an empty value. The
+	/// slices point into data and still have to be decoded.
+	template <class Handler>
+	inline void split_form(boost::string_ref data, Handler handler)
+	{
+		const char* p = data.data();
+		const char* end = p + data.size();
+		while (p != end)
+		{
+			const char* amp = detail::scan<false>(p, end, "&");
+			if (amp != p)
+			{
+				const char* eq = detail::scan<false>(p, amp, "=");
+				handler(boost::string_ref(p, eq - p),
+					eq == amp ? boost::string_ref() : boost::string_ref(eq + 1, amp - eq - 1));
+			}
+			p = (amp == end) ? end : amp + 1;
+		}
+	}
+
+}
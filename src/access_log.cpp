@@ -0,0 +1,192 @@
+﻿#include "include/access_log.hpp"
+
+#include <ctime>
+#include <fstream>
+#include <stdexcept>
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+
+#include "include/logging.hpp"
+
+namespace http {
+
+	access_log::access_log(const std::string& directory, std::size_t shards,
+		std::size_t entries_per_file, std::size_t max_files)
+		: m_directory(directory)
+		, m_entries_per_file(entries_per_file ? entries_per_file : 1)
+		, m_max_files(max_files ? max_files : 1)
+		, m_stopping(false)
+	{
+		boost::system::error_code ec;
+		boost::filesystem::create_directories(m_directory, ec);
+		if (!boost::filesystem::is_directory(m_directory))
+			throw std::runtime_error("can not create access log directory " + m_directory);
+
+		// 用启动时间区分每次运行写的文件.
+		char stamp[32];
+		std::time_t now = std::time(0);
+		std::strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", std::gmtime(&now));
+		m_prefix = std::string("access-") + stamp + "-";
+
+		for (std::size_t i = 0; i < shards; ++i)
+		{
+			boost::shared_ptr<writer> w = boost::make_shared<writer>();
+			w->shard = i;
+			w->sequence = 0;
+			w->header = 0;
+			w->begin = w->next = w->end = 0;
+			m_writers.push_back(w);
+
+			// 第一个文件在这里直接创建, 失败时由后台线程重试.
+			std::string path;
+			region_ptr region = create_file(*w, path);
+			if (region)
+				start_file(*w, *region);
+			m_pending.push_back(i);
+		}
+		m_thread = boost::thread(boost::bind(&access_log::run, this));
+	}
+
+	access_log::~access_log()
+	{
+		{
+			boost::mutex::scoped_lock l(m_mutex);
+			m_stopping = true;
+		}
+		m_wakeup.notify_all();
+		if (m_thread.joinable())
+			m_thread.join();
+
+		for (std::size_t i = 0; i < m_writers.size(); ++i)
+		{
+			writer& w = *m_writers[i];
+			// 映射解除时内核会把脏页写回, 这里只是尽早写出.
+			if (w.header)
+				w.region.flush(0, 0, true);
+			// 没有用上的空文件不留在目录里.
+			if (w.spare)
+			{
+				w.spare.reset();
+				boost::system::error_code ec;
+				boost::filesystem::remove(w.spare_path, ec);
+			}
+		}
+	}
+
+	bool access_log::open_next(writer& w)
+	{
+		region_ptr region;
+		{
+			boost::mutex::scoped_lock l(m_mutex);
+			// 后台线程还没有准备好下一个文件, 这条记录丢弃.
+			if (!w.spare)
+				return false;
+			region.swap(w.spare);
+			w.spare_path.clear();
+		}
+
+		// 交换之后 region 里是写满的文件, 解除映射也交给后台线程.
+		start_file(w, *region);
+		{
+			boost::mutex::scoped_lock l(m_mutex);
+			w.retired.swap(region);
+			m_pending.push_back(w.shard);
+		}
+		m_wakeup.notify_one();
+		return true;
+	}
+
+	void access_log::start_file(writer& w, boost::interprocess::mapped_region& region)
+	{
+		w.region.swap(region);
+		w.header = static_cast<access_log_header*>(w.region.get_address());
+		w.begin = w.next = reinterpret_cast<access_log_entry*>(w.header + 1);
+		w.end = w.begin + m_entries_per_file;
+	}
+
+	access_log::region_ptr access_log::create_file(writer& w, std::string& path)
+	{
+		path = (boost::filesystem::path(m_directory) /
+			(m_prefix + std::to_string(w.shard) + "-" + std::to_string(w.sequence++) + ".bin")).string();
+		std::size_t size = sizeof(access_log_header) + m_entries_per_file * sizeof(access_log_entry);
+
+		region_ptr region;
+		try
+		{
+			{
+				std::filebuf file;
+				if (!file.open(path.c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc))
+					throw std::runtime_error("can not create " + path);
+			}
+			boost::filesystem::resize_file(path, size);
+
+			boost::interprocess::file_mapping mapping(path.c_str(), boost::interprocess::read_write);
+			region = boost::make_shared<boost::interprocess::mapped_region>(
+				mapping, boost::interprocess::read_write, 0, size);
+		}
+		catch (std::exception& e)
+		{
+			LOG_ERR << "access_log::create_file, " << path << ": " << e.what();
+			return region_ptr();
+		}
+
+		// 头部先写好, 进程意外退出时没有用上的文件也是一个空的日志文件.
+		access_log_header* header = static_cast<access_log_header*>(region->get_address());
+		std::memset(header, 0, sizeof(access_log_header));
+		std::memcpy(header->magic, access_log_magic, sizeof(access_log_magic));
+		header->version = access_log_version;
+		header->entry_size = sizeof(access_log_entry);
+		header->capacity = m_entries_per_file;
+		header->shard = static_cast<boost::uint32_t>(w.shard);
+
+		// 保留 m_max_files 个写过的文件, 加上这个准备好的空文件.
+		w.files.push_back(path);
+		while (w.files.size() > m_max_files + 1)
+		{
+			boost::system::error_code ec;
+			boost::filesystem::remove(w.files.front(), ec);
+			w.files.pop_front();
+		}
+		return region;
+	}
+
+	void access_log::run()
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		for (;;)
+		{
+			while (!m_stopping && m_pending.empty())
+				m_wakeup.wait(l);
+			if (m_stopping)
+				break;
+
+			writer& w = *m_writers[m_pending.front()];
+			m_pending.pop_front();
+			region_ptr retired;
+			retired.swap(w.retired);
+			l.unlock();
+
+			// 先解除写满的文件的映射, 删除旧文件时它可能已经不再保留.
+			retired.reset();
+			std::string path;
+			region_ptr region = create_file(w, path);
+
+			l.lock();
+			if (region)
+			{
+				w.spare = region;
+				w.spare_path = path;
+			}
+			else
+			{
+				// 创建失败时过一会儿再试, 错误已经记过日志.
+				m_pending.push_back(w.shard);
+				m_wakeup.timed_wait(l, boost::posix_time::seconds(1));
+			}
+		}
+	}
+
+}
@@ -0,0 +1,162 @@
+﻿#include "include/coarse_clock.hpp"
+
+#include <cstring>
+
+#include <boost/chrono/system_clocks.hpp>
+
+#if defined(_MSC_VER)
+#	define HTTP_THREAD_LOCAL __declspec(thread)
+#else
+#	define HTTP_THREAD_LOCAL __thread
+#endif
+
+namespace http {
+
+	namespace {
+
+		// 每个线程一份, 只能是 POD.
+		struct clock_state
+		{
+			bool valid;
+			boost::uint64_t monotonic_ms;
+			std::time_t unix_time;
+			char http_date[coarse_clock::http_date_size + 1];
+			char log_time[coarse_clock::log_time_size + 1];
+			// format_log_time 缓存的秒和格式化好的 "YYYY-mm-dd HH:MM:SS".
+			bool log_valid;
+			std::time_t log_second;
+			char log_prefix[20];
+		};
+
+		HTTP_THREAD_LOCAL clock_state local_clock;
+
+		inline void put2(char* out, int value)
+		{
+			out[0] = static_cast<char>('0' + value / 10 % 10);
+			out[1] = static_cast<char>('0' + value % 10);
+		}
+
+		inline void put4(char* out, int value)
+		{
+			put2(out, value / 100);
+			put2(out + 2, value % 100);
+		}
+
+		clock_state& state()
+		{
+			if (!local_clock.valid)
+				coarse_clock::update();
+			return local_clock;
+		}
+	}
+
+	void coarse_clock::update()
+	{
+		clock_state& s = local_clock;
+		s.monotonic_ms = boost::chrono::duration_cast<boost::chrono::milliseconds>(
+			boost::chrono::steady_clock::now().time_since_epoch()).count();
+		boost::uint64_t now = precise_unix_microseconds();
+		std::time_t seconds = static_cast<std::time_t>(now / 1000000);
+		if (!s.valid || seconds != s.unix_time)
+			format_http_date(seconds, s.http_date);
+		s.unix_time = seconds;
+		format_log_time(now, s.log_time);
+		s.valid = true;
+	}
+
+	boost::uint64_t coarse_clock::monotonic_ms()
+	{
+		return state().monotonic_ms;
+	}
+
+	std::time_t coarse_clock::unix_time()
+	{
+		return state().unix_time;
+	}
+
+	const char* coarse_clock::http_date()
+	{
+		return state().http_date;
+	}
+
+	const char* coarse_clock::log_timestamp()
+	{
+		return state().log_time;
+	}
+
+	boost::uint64_t coarse_clock::precise_unix_microseconds()
+	{
+		return boost::chrono::duration_cast<boost::chrono::microseconds>(
+			boost::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	boost::uint64_t coarse_clock::precise_monotonic_microseconds()
+	{
+		return boost::chrono::duration_cast<boost::chrono::microseconds>(
+			boost::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	void coarse_clock::format_http_date(std::time_t t, char* out)
+	{
+		std::tm tm;
+#ifdef _WIN32
+		gmtime_s(&tm, &t);
+#else
+		gmtime_r(&t, &tm);
+#endif
+		// 不依赖 locale 的星期和月份名.
+		static const char days[] = "SunMonTueWedThuFriSat";
+		static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+		std::memcpy(out, days + tm.tm_wday * 3, 3);
+		out[3] = ',';
+		out[4] = ' ';
+		put2(out + 5, tm.tm_mday);
+		out[7] = ' ';
+		std::memcpy(out + 8, months + tm.tm_mon * 3, 3);
+		out[11] = ' ';
+		put4(out + 12, tm.tm_year + 1900);
+		out[16] = ' ';
+		put2(out + 17, tm.tm_hour);
+		out[19] = ':';
+		put2(out + 20, tm.tm_min);
+		out[22] = ':';
+		put2(out + 23, tm.tm_sec);
+		std::memcpy(out + 25, " GMT", 5);
+	}
+
+	void coarse_clock::format_log_time(boost::uint64_t unix_microseconds, char* out)
+	{
+		clock_state& s = local_clock;
+		std::time_t seconds = static_cast<std::time_t>(unix_microseconds / 1000000);
+		if (!s.log_valid || seconds != s.log_second)
+		{
+			std::tm tm;
+#ifdef _WIN32
+			localtime_s(&tm, &seconds);
+#else
+			localtime_r(&seconds, &tm);
+#endif
+			char* p = s.log_prefix;
+			put4(p, tm.tm_year + 1900);
+			p[4] = '-';
+			put2(p + 5, tm.tm_mon + 1);
+			p[7] = '-';
+			put2(p + 8, tm.tm_mday);
+			p[10] = ' ';
+			put2(p + 11, tm.tm_hour);
+			p[13] = ':';
+			put2(p + 14, tm.tm_min);
+			p[16] = ':';
+			put2(p + 17, tm.tm_sec);
+			s.log_second = seconds;
+			s.log_valid = true;
+		}
+		std::memcpy(out, s.log_prefix, 19);
+		int ms = static_cast<int>(unix_microseconds / 1000 % 1000);
+		out[19] = '.';
+		out[20] = static_cast<char>('0' + ms / 100);
+		put2(out + 21, ms % 100);
+		out[23] = 0;
+	}
+
+}
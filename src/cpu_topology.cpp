@@ -0,0 +1,259 @@
+﻿#include "include/cpu_topology.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+
+#include <boost/filesystem.hpp>
+#include <boost/thread/thread.hpp>
+
+#ifdef __linux__
+#	include <sched.h>
+#endif
+
+namespace http {
+
+	namespace {
+
+		// 能绑定的 CPU 编号上限, 和 io_service_pool::run_thread 一致.
+#ifdef __linux__
+		const long max_cpus = CPU_SETSIZE;
+#else
+		const long max_cpus = 64;
+#endif
+
+		// 一个十进制的 CPU 编号, 只能由数字组成.
+		bool parse_cpu_id(const std::string& text, int& id)
+		{
+			if (text.empty() || !std::isdigit(static_cast<unsigned char>(text[0])))
+				return false;
+			char* end = 0;
+			errno = 0;
+			long value = std::strtol(text.c_str(), &end, 10);
+			if (errno == ERANGE || *end != '\0' || value >= max_cpus)
+				return false;
+			id = static_cast<int>(value);
+			return true;
+		}
+
+		bool read_int(const std::string& path, int& value)
+		{
+			std::ifstream file(path.c_str());
+			return static_cast<bool>(file >> value);
+		}
+
+		bool read_line(const std::string& path, std::string& line)
+		{
+			std::ifstream file(path.c_str());
+			return static_cast<bool>(std::getline(file, line));
+		}
+
+		// 排序用的键: SMT 序号, 在节点内的序号, 节点.
+		struct layout_entry
+		{
+			int rank;
+			int position;
+			int node;
+			int id;
+
+			bool operator<(const layout_entry& other) const
+			{
+				if (rank != other.rank) return rank < other.rank;
+				if (position != other.position) return position < other.position;
+				if (node != other.node) return node < other.node;
+				return id < other.id;
+			}
+		};
+
+	}
+
+	cpu_topology cpu_topology::detect()
+	{
+		cpu_topology topology;
+
+#ifdef __linux__
+		const std::string root = "/sys/devices/system/cpu/";
+		std::string online;
+		std::vector<int> ids;
+		if (read_line(root + "online", online))
+			parse_cpu_list(online, ids);
+
+		// 只使用进程允许运行的 CPU, 例如被 taskset 或 cgroup 限制时.
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		bool has_allowed = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+		for (std::size_t i = 0; i < ids.size(); ++i)
+		{
+			if (has_allowed && ids[i] < CPU_SETSIZE && !CPU_ISSET(ids[i], &allowed))
+				continue;
+			cpu c;
+			c.id = ids[i];
+			std::string dir = root + "cpu" + std::to_string(c.id) + "/topology/";
+			if (!read_int(dir + "core_id", c.core))
+				c.core = c.id;
+			if (!read_int(dir + "physical_package_id", c.package))
+				c.package = 0;
+			c.node = 0;
+			topology.m_cpus.push_back(c);
+		}
+
+		boost::system::error_code ec;
+		boost::filesystem::directory_iterator end;
+		for (boost::filesystem::directory_iterator it("/sys/devices/system/node", ec); !ec && it != end; it.increment(ec))
+		{
+			std::string name = it->path().filename().string();
+			if (name.size() <= 4 || name.compare(0, 4, "node") != 0)
+				continue;
+			int node = std::atoi(name.c_str() + 4);
+			std::string list;
+			std::vector<int> node_cpus;
+			if (!read_line(it->path().string() + "/cpulist", list) || !parse_cpu_list(list, node_cpus))
+				continue;
+			for (std::size_t i = 0; i < topology.m_cpus.size(); ++i)
+			{
+				if (std::find(node_cpus.begin(), node_cpus.end(), topology.m_cpus[i].id) != node_cpus.end())
+					topology.m_cpus[i].node = node;
+			}
+		}
+#endif
+
+		if (topology.m_cpus.empty())
+		{
+			unsigned n = boost::thread::hardware_concurrency();
+			for (unsigned i = 0; i < (n ? n : 1); ++i)
+			{
+				cpu c;
+				c.id = i;
+				c.core = i;
+				c.package = 0;
+				c.node = 0;
+				topology.m_cpus.push_back(c);
+			}
+		}
+		return topology;
+	}
+
+	bool cpu_topology::parse_cpu_list(const std::string& text, std::vector<int>& cpus)
+	{
+		cpus.clear();
+		std::string s;
+		for (std::size_t i = 0; i < text.size(); ++i)
+			if (!std::isspace(static_cast<unsigned char>(text[i])))
+				s.push_back(text[i]);
+		if (s.empty())
+			return false;
+
+		if (s.size() > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+		{
+			// 十六进制掩码, 最低位是 CPU 0.
+			int bit = 0;
+			for (std::size_t i = s.size(); i > 2; --i, bit += 4)
+			{
+				char c = s[i - 1];
+				int v;
+				if (c >= '0' && c <= '9') v = c - '0';
+				else if (c >= 'a' && c <= 'f') v = c - 'a' + 10;
+				else if (c >= 'A' && c <= 'F') v = c - 'A' + 10;
+				else if (c == ',') { bit -= 4; continue; }	// Linux 的 cpumask 每 32 位用逗号分隔.
+				else return false;
+				for (int b = 0; b < 4; ++b)
+				{
+					if (!(v & (1 << b)))
+						continue;
+					if (bit + b >= max_cpus)
+						return false;
+					cpus.push_back(bit + b);
+				}
+			}
+			std::sort(cpus.begin(), cpus.end());
+			return !cpus.empty();
+		}
+
+		std::size_t pos = 0;
+		while (pos < s.size())
+		{
+			std::size_t comma = s.find(',', pos);
+			if (comma == std::string::npos)
+				comma = s.size();
+			std::string range = s.substr(pos, comma - pos);
+			pos = comma + 1;
+			if (range.empty())
+				continue;
+
+			std::size_t dash = range.find('-');
+			std::string first = range.substr(0, dash);
+			std::string last = dash == std::string::npos ? first : range.substr(dash + 1);
+			int lo, hi;
+			if (!parse_cpu_id(first, lo) || !parse_cpu_id(last, hi) || lo > hi)
+				return false;
+			for (int i = lo; i <= hi; ++i)
+				cpus.push_back(i);
+		}
+		std::sort(cpus.begin(), cpus.end());
+		cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+		return !cpus.empty();
+	}
+
+	std::vector<int> cpu_topology::layout(const std::vector<int>& allowed) const
+	{
+		std::vector<cpu> selected;
+		for (std::size_t i = 0; i < m_cpus.size(); ++i)
+		{
+			if (allowed.empty() || std::find(allowed.begin(), allowed.end(), m_cpus[i].id) != allowed.end())
+				selected.push_back(m_cpus[i]);
+		}
+		// 指定了拓扑里没有的 CPU 时照样使用, 当作单独的核心.
+		for (std::size_t i = 0; i < allowed.size(); ++i)
+		{
+			bool known = false;
+			for (std::size_t j = 0; j < selected.size() && !known; ++j)
+				known = selected[j].id == allowed[i];
+			if (!known)
+			{
+				cpu c;
+				c.id = allowed[i];
+				c.core = -1 - allowed[i];
+				c.package = -1;
+				c.node = 0;
+				selected.push_back(c);
+			}
+		}
+
+		// rank: 在同一物理核心中是第几个 SMT 线程; position: 同一节点同一 rank 中的序号.
+		std::vector<layout_entry> entries;
+		for (std::size_t i = 0; i < selected.size(); ++i)
+		{
+			layout_entry e;
+			e.id = selected[i].id;
+			e.node = selected[i].node;
+			e.rank = 0;
+			for (std::size_t j = 0; j < selected.size(); ++j)
+			{
+				if (selected[j].package == selected[i].package && selected[j].core == selected[i].core
+					&& selected[j].id < selected[i].id)
+					++e.rank;
+			}
+			entries.push_back(e);
+		}
+		for (std::size_t i = 0; i < entries.size(); ++i)
+		{
+			entries[i].position = 0;
+			for (std::size_t j = 0; j < entries.size(); ++j)
+			{
+				if (entries[j].node == entries[i].node && entries[j].rank == entries[i].rank
+					&& entries[j].id < entries[i].id)
+					++entries[i].position;
+			}
+		}
+		std::sort(entries.begin(), entries.end());
+
+		std::vector<int> result;
+		for (std::size_t i = 0; i < entries.size(); ++i)
+			result.push_back(entries[i].id);
+		return result;
+	}
+
+}
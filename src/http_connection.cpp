@@ -4,13 +4,42 @@
 #include "include/logging.hpp"
 #include "include/http_server.hpp"
 
+#if HTTP_USE_SENDFILE
+#	include <sys/sendfile.h>
+#	include <errno.h>
+#endif
+
 namespace http {
 
-	http_connection::http_connection(boost::asio::io_service& io, http_server& serv, http_connection_manager* connection_man)
+	http_connection::http_connection(boost::asio::io_service& io, std::size_t shard, http_server& serv, http_connection_manager* connection_man)
 		: m_io_service(io)
+		, m_shard(shard)
+		, m_load(connection_man->load(shard))
+		, m_registered(false)
+		, m_counted(false)
+		, m_read_timer(boost::bind(&http_connection::handle_read_timeout, this))
+		, m_write_timer(boost::bind(&http_connection::handle_timeout, this))
+		, m_read_timeout(timeout_none)
 		, m_server(serv)
 		, m_socket(io)
+		, m_handshaking(false)
+		, m_peer_known(false)
 		, m_connection_manager(connection_man)
+		, m_recv_begin(0)
+		, m_recv_end(0)
+		, m_responses_ready(0)
+		, m_responses_writing(0)
+		, m_chunk_writing(false)
+		, m_file_writing(false)
+		, m_writing(false)
+		, m_read_paused(false)
+		, m_awaiting_response(false)
+		, m_watching_peer(false)
+		, m_arena(m_arena_buffer.data(), m_arena_buffer.size())
+		, m_http_request(&m_arena)
+		, m_route(0)
+		, m_body_remaining(0)
+		, m_body_paused(false)
 		, m_abort(false)
 	{}
 
@@ -21,28 +50,220 @@ namespace http {
 
 	void http_connection::start()
 	{
-		m_request.consume(m_request.size());
+		m_recv_begin = m_recv_end = 0;
+		m_request_parser.reset();
+		clear_write_queue();
+		m_read_paused = false;
+		m_awaiting_response = false;
+		m_route = 0;
+		m_body_remaining = 0;
+		m_body_paused = false;
 		m_abort = false;
+		m_thread_id = boost::this_thread::get_id();
 
 		boost::system::error_code ignore_ec;
 		m_socket.set_option(tcp::no_delay(true), ignore_ec);
 		if (ignore_ec)
 			LOG_ERR << "http_connection::start, Set option to nodelay, error message :" << ignore_ec.message();
+#if HTTP_USE_SENDFILE
+		// sendfile 直接用 socket 的描述符, 写不进去时要返回 EAGAIN 而不是阻塞.
+		m_socket.native_non_blocking(true, ignore_ec);
+#endif
 
-		boost::asio::async_read_until(m_socket, m_request, "\r\n\r\n",
-			boost::bind(&http_connection::handle_read_headers,
+		// 对端地址每个连接只取一次, 之后每条访问日志直接复制.
+		if (m_server.m_access_log)
+		{
+			m_peer = m_socket.remote_endpoint(ignore_ec);
+			m_peer_known = !ignore_ec;
+		}
+
+		if (m_server.m_tls)
+		{
+			m_ssl.reset(new ssl_stream(m_socket, m_server.m_ssl_context));
+			start_handshake();
+			return;
+		}
+		read_headers();
+	}
+
+	void http_connection::start_handshake()
+	{
+		// 握手的时间算在读头部的超时里, 中途不重新计时.
+		arm_read_timer(timeout_header);
+		if (!m_server.m_handshake_executor)
+		{
+			m_ssl->async_handshake(boost::asio::ssl::stream_base::server,
+				boost::bind(&http_connection::handle_handshake,
+				shared_from_this(),
+				boost::asio::placeholders::error
+				)
+				);
+			return;
+		}
+
+		// 握手线程上的读写不能阻塞, 见 tls_socket.
+		boost::system::error_code ignore_ec;
+		m_socket.non_blocking(true, ignore_ec);
+		wait_handshake();
+	}
+
+	void http_connection::wait_handshake()
+	{
+		// 对端的数据到达之前不占用握手线程.
+		m_socket.async_read_some(boost::asio::null_buffers(),
+			boost::bind(&http_connection::handle_handshake_readable,
 			shared_from_this(),
-			boost::asio::placeholders::error,
-			boost::asio::placeholders::bytes_transferred
+			boost::asio::placeholders::error
 			)
 			);
 	}
 
+	void http_connection::handle_handshake_readable(const boost::system::error_code& error)
+	{
+		if (error || m_abort)
+		{
+			disconnect(http_metrics::disconnect_peer);
+			return;
+		}
+		m_handshaking = true;
+		m_server.m_handshake_executor->post(boost::bind(&http_connection::run_handshake, shared_from_this()));
+	}
+
+	void http_connection::run_handshake()
+	{
+		// 在握手线程上执行, 这期间连接的线程不碰 m_ssl, 也不关闭 socket (见 stop).
+		// 已经收到的数据都处理完后返回 would_block, 回到连接的线程等待更多的数据.
+		boost::system::error_code ec;
+		m_ssl->handshake(boost::asio::ssl::stream_base::server, ec);
+		m_io_service.post(boost::bind(&http_connection::handle_handshake, shared_from_this(), ec));
+	}
+
+	void http_connection::handle_handshake(const boost::system::error_code& error)
+	{
+		if (m_handshaking)
+		{
+			m_handshaking = false;
+			if (m_abort)
+			{
+				boost::system::error_code ignore_ec;
+				m_socket.close(ignore_ec);
+			}
+		}
+		if (m_abort)
+			return;
+		if (!error || error == boost::asio::error::would_block)
+		{
+			// 握手线程上 socket 没有接收的数据在这里写完, 再继续握手或者开始读请求.
+			std::vector<char>& pending = m_ssl->next_layer().pending_output();
+			if (!pending.empty())
+			{
+				boost::asio::async_write(m_socket, boost::asio::buffer(pending),
+					boost::bind(&http_connection::handle_handshake_flushed,
+					shared_from_this(),
+					error,
+					boost::asio::placeholders::error
+					)
+					);
+				return;
+			}
+		}
+		if (error == boost::asio::error::would_block)
+		{
+			wait_handshake();
+			return;
+		}
+		if (error)
+		{
+			LOG_DBG << "http_connection::handle_handshake, error: " << error.message();
+			disconnect(http_metrics::disconnect_handshake);
+			return;
+		}
+		read_headers();
+	}
+
+	void http_connection::handle_handshake_flushed(const boost::system::error_code& result, const boost::system::error_code& error)
+	{
+		m_ssl->next_layer().pending_output().clear();
+		if (error || m_abort)
+		{
+			disconnect(http_metrics::disconnect_peer);
+			return;
+		}
+		handle_handshake(result);
+	}
+
 	void http_connection::stop()
 	{
 		boost::system::error_code ignore_ec;
 		m_abort = true;
+		m_read_timer.cancel();
+		m_write_timer.cancel();
+		m_read_timeout = timeout_none;
+		// 握手线程还在使用 socket 时只能 shutdown, 由 handle_handshake 关闭.
+		if (m_handshaking)
+			m_socket.shutdown(tcp::socket::shutdown_both, ignore_ec);
+		else
+			m_socket.close(ignore_ec);
+		clear_chunked();
+	}
+
+	void http_connection::reset()
+	{
+		boost::system::error_code ignore_ec;
+		// 不发 close_notify 就断开, 先标记为已经关闭, 否则 OpenSSL 会把会话从缓存中删除.
+		// 握手失败或者收发过致命 alert 的会话不受影响, OpenSSL 已经删除了.
+		if (m_ssl)
+			SSL_set_shutdown(m_ssl->native_handle(), SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+		m_ssl.reset();
+		m_handshaking = false;
 		m_socket.close(ignore_ec);
+		m_read_timer.cancel();
+		m_write_timer.cancel();
+		m_read_timeout = timeout_none;
+		m_registered = false;
+		m_recv_begin = m_recv_end = 0;
+		m_request_parser.reset();
+		m_request_view.clear();
+		clear_write_queue();
+		m_write_buffers.clear();
+		m_coalesced_buffers.clear();
+		if (m_coalesce_buffer.capacity() > HTTP_RECEIVE_BUFFER_SIZE)
+			std::vector<char>().swap(m_coalesce_buffer);
+		m_read_paused = false;
+		m_awaiting_response = false;
+		m_watching_peer = false;
+		m_route = 0;
+		m_body_remaining = 0;
+		m_body_paused = false;
+		m_abort = false;
+		m_thread_id = boost::thread::id();
+		m_http_request.release();
+		m_arena.reset();
+
+		// 大的 body 不留在空闲连接里.
+		if (m_http_request.body.capacity() > HTTP_RECEIVE_BUFFER_SIZE)
+			std::string().swap(m_http_request.body);
+		else
+			m_http_request.body.clear();
+	}
+
+	void http_connection::clear_write_queue()
+	{
+		clear_chunked();
+		m_load.requests.fetch_sub(m_write_queue.size(), boost::memory_order_relaxed);
+		m_write_queue.clear();
+		m_responses_ready = m_responses_writing = 0;
+		m_chunk_writing = m_file_writing = m_writing = false;
+	}
+
+	void http_connection::clear_chunked()
+	{
+		// chunked 回复和连接互相引用, 连接断开时要断开这个环.
+		for (std::size_t i = 0; i < m_write_queue.size(); ++i)
+		{
+			if (m_write_queue[i].chunked)
+				m_write_queue[i].chunked->close();
+		}
 	}
 
 	tcp::socket& http_connection::socket()
@@ -50,162 +271,1201 @@ namespace http {
 		return m_socket;
 	}
 
+	boost::asio::io_service& http_connection::get_io_service()
+	{
+		return m_io_service;
+	}
+
+	bool http_connection::running_in_this_thread() const
+	{
+		return boost::this_thread::get_id() == m_thread_id;
+	}
+
+	std::size_t http_connection::shard() const
+	{
+		return m_shard;
+	}
+
+	void http_connection::read_headers()
+	{
+		// 先把接收缓冲区中已有的完整请求逐个解析并派发 (pipelining),
+		// 不够一个完整的头部时才去 socket 上读.
+		for (;;)
+		{
+			// 等待回复的请求太多, 暂停解析, 等写完一部分再继续.
+			if (m_write_queue.size() >= HTTP_MAX_PIPELINE_DEPTH)
+			{
+				m_read_paused = true;
+				return;
+			}
+
+			boost::tribool result;
+			const char* header_end;
+			boost::tie(result, header_end) = m_request_parser.parse(m_request_view,
+				m_recv_buffer.data() + m_recv_begin, m_recv_buffer.data() + m_recv_end);
+			if (!result)
+			{
+				// 断开.
+				if (m_server.m_metrics)
+					m_server.m_metrics->parse_error(m_shard);
+				disconnect(http_metrics::disconnect_bad_request);
+				return;
+			}
+			if (boost::indeterminate(result))
+				break;
+
+			// 上一个请求的处理已经结束, 它在 arena 里的内容可以整体丢弃.
+			m_http_request.release();
+			m_arena.reset();
+			m_request_view.materialize(m_http_request);
+			consume(header_end - (m_recv_buffer.data() + m_recv_begin));
+			arm_read_timer(timeout_none);
+			if (!handle_headers())
+				return;
+		}
+
+		// 缓冲区尾部已满, 把未解析的数据挪到头部腾出空间.
+		// 解析器记录的是相对 begin 的偏移, 挪动后依然有效.
+		if (m_recv_end == m_recv_buffer.size())
+		{
+			if (m_recv_begin == 0)
+			{
+				disconnect(http_metrics::disconnect_bad_request);
+				return;
+			}
+			std::memmove(m_recv_buffer.data(), m_recv_buffer.data() + m_recv_begin, m_recv_end - m_recv_begin);
+			m_recv_end -= m_recv_begin;
+			m_recv_begin = 0;
+		}
+
+		// 缓冲区里没有半个请求时是空闲等待, 否则是在读头部; 头部的超时从收到
+		// 第一个字节开始计算, 之后每次读到数据都不会重置, 防止 slowloris.
+		if (m_recv_begin == m_recv_end)
+			arm_read_timer(timeout_keep_alive);
+		else if (m_read_timeout != timeout_header)
+			arm_read_timer(timeout_header);
+
+		stream_read_some(boost::asio::buffer(m_recv_buffer.data() + m_recv_end, m_recv_buffer.size() - m_recv_end),
+			boost::bind(&http_connection::handle_read_headers,
+			shared_from_this(),
+			boost::asio::placeholders::error,
+			boost::asio::placeholders::bytes_transferred
+			)
+			);
+	}
+
 	void http_connection::handle_read_headers(const boost::system::error_code& error, std::size_t bytes_transferred)
 	{
 		// 出错处理.
 		if (error || m_abort)
 		{
-			m_connection_manager->stop(shared_from_this());
+			disconnect(http_metrics::disconnect_peer);
 			return;
 		}
 
-		// 复制http头缓冲区.
-		std::vector<char> buffer;
-		buffer.resize(bytes_transferred + 1);
-		buffer[bytes_transferred] = 0;
-		m_request.sgetn(&buffer[0], bytes_transferred);
+		if (m_server.m_metrics)
+			m_server.m_metrics->received(m_shard, bytes_transferred);
+
+		m_recv_end += bytes_transferred;
+		read_headers();
+	}
 
-		boost::tribool result;
-		boost::tie(result, boost::tuples::ignore) = m_request_parser.parse(m_http_request, buffer.begin(), buffer.end());
-		if (!result || result == boost::indeterminate)
+	bool http_connection::handle_headers()
+	{
+		if (!m_http_request.normalise())
 		{
-			// 断开.
-			m_connection_manager->stop(shared_from_this());
-			return;
+			disconnect(http_metrics::disconnect_bad_request);
+			return false;
 		}
+		m_http_request.body.clear();
 
-		m_http_request.normalise();
+		// 先找路由, body 怎么接收由路由决定. 没有路由时由 dispatch_request 断开.
+		m_route = m_server.find_route(m_http_request);
+		if (!m_route)
+			return dispatch_request();
 
-		if (m_http_request.method == "post")
+		auto content_length = m_http_request.content_length;
+		bool chunked = m_http_request.chunked;
+		if (m_http_request.method == "post" && content_length == 0 && !chunked)
 		{
-			// NOTE: 限制 body 的大小到 64KiB
-			auto content_length = m_http_request.content_length;
-			if (content_length == 0 || content_length >= 65536)
-			{
-				// 断开, POST 必须要有 content_length
-				// 暴力断开没事, 首先浏览器不会发这种垃圾请求
-				// 第二, 如果在 nginx 后面, 暴力断开 nginx 会返回 503 错误
-				m_connection_manager->stop(shared_from_this());
-				return;
-			}
+			// 断开, POST 必须要有 content_length
+			// 暴力断开没事, 首先浏览器不会发这种垃圾请求
+			// 第二, 如果在 nginx 后面, 暴力断开 nginx 会返回 503 错误
+			disconnect(http_metrics::disconnect_rejected);
+			return false;
+		}
+
+		// 客户端在等 100 Continue 时 body 还没有发出来, 缓冲区里不会有 body 的数据.
+		if ((content_length || chunked) && m_http_request.expect_continue && m_recv_begin == m_recv_end
+			&& (m_route->options.on_body || content_length <= m_route->options.max_body_size))
+			send_continue();
 
-			auto already_got = m_request.size();
-			if (already_got >= content_length)
+		// chunked 的 body 和流式的 body 都要经过接收缓冲区.
+		if (chunked || (content_length && m_route->options.on_body))
+		{
+			m_body_remaining = content_length;
+			m_body_paused = false;
+			m_chunked_decoder.reset();
+			return receive_body();
+		}
+
+		if (content_length)
+		{
+			// 整个 body 放在内存里, 大小受路由的限制.
+			if (content_length > m_route->options.max_body_size)
 			{
-				handle_read_body(error, content_length);
+				disconnect(http_metrics::disconnect_rejected);
+				return false;
 			}
-			else
+
+			// 已经在接收缓冲区中的部分直接拷贝到 body, 剩下的直接读进 body.
+			m_http_request.body.resize(content_length);
+			std::size_t already_got = (std::min<std::size_t>)(m_recv_end - m_recv_begin, content_length);
+			std::memcpy(&m_http_request.body[0], m_recv_buffer.data() + m_recv_begin, already_got);
+			consume(already_got);
+
+			if (already_got != content_length)
 			{
 				// 读取 body
-				boost::asio::async_read(m_socket, m_request, boost::asio::transfer_exactly(content_length - already_got),
+				arm_read_timer(timeout_body);
+				stream_read(boost::asio::buffer(&m_http_request.body[already_got], content_length - already_got),
 					boost::bind(&http_connection::handle_read_body,
 					shared_from_this(),
 					boost::asio::placeholders::error,
 					boost::asio::placeholders::bytes_transferred
 					)
 					);
+				return false;
 			}
 		}
-		else
+
+		return dispatch_request();
+	}
+
+	void http_connection::handle_read_body(const boost::system::error_code& error, std::size_t bytes_transferred)
+	{
+		// 出错处理.
+		if (error || m_abort)
+		{
+			disconnect(http_metrics::disconnect_peer);
+			return;
+		}
+
+		if (m_server.m_metrics)
+			m_server.m_metrics->received(m_shard, bytes_transferred);
+
+		arm_read_timer(timeout_none);
+
+		if (dispatch_request())
+			read_headers();
+	}
+
+	bool http_connection::receive_body()
+	{
+		for (;;)
 		{
-			if (!m_server.handle_request(m_http_request, shared_from_this()))
+			// on_body 要求暂停时不读, 也不派发请求, 由 resume_body 继续.
+			if (m_body_paused)
 			{
-				// 断开. 反正暴力就对了, 越暴力越不容易被人攻击
-				m_connection_manager->stop(shared_from_this());
-				return;
+				arm_read_timer(timeout_none);
+				return false;
 			}
 
-			if (m_http_request.keep_alive)
+			// body 直接从接收缓冲区交出, 不复制. 缓冲区中可能还有下一个请求, 只取属于 body 的部分.
+			const char* begin = m_recv_buffer.data() + m_recv_begin;
+			const char* data = begin;
+			std::size_t size;
+			bool complete;
+			if (m_http_request.chunked)
 			{
-				// 继续读取下一个请求.
-				boost::asio::async_read_until(m_socket, m_request, "\r\n\r\n",
-					boost::bind(&http_connection::handle_read_headers,
-					shared_from_this(),
-					boost::asio::placeholders::error,
-					boost::asio::placeholders::bytes_transferred
-					)
-					);
+				const char* p = begin;
+				boost::tribool result = m_chunked_decoder.decode(p, m_recv_buffer.data() + m_recv_end, data, size);
+				consume(p - begin);
+				if (!result)
+				{
+					disconnect(http_metrics::disconnect_bad_request);
+					return false;
+				}
+				complete = result ? true : false;
 			}
+			else
+			{
+				size = static_cast<std::size_t>((std::min<boost::uint64_t>)(m_recv_end - m_recv_begin, m_body_remaining));
+				m_body_remaining -= size;
+				consume(size);
+				complete = m_body_remaining == 0;
+			}
+
+			if (size)
+			{
+				if (m_route->options.on_body)
+				{
+					m_route->options.on_body(m_http_request, data, size, shared_from_this());
+					if (m_abort)
+						return false;
+				}
+				else
+				{
+					// 放在内存里的 chunked body, 大小受路由的限制.
+					if (m_http_request.body.size() + size > m_route->options.max_body_size)
+					{
+						disconnect(http_metrics::disconnect_rejected);
+						return false;
+					}
+					m_http_request.body.append(data, size);
+				}
+				continue;
+			}
+
+			if (complete)
+			{
+				arm_read_timer(timeout_none);
+				return dispatch_request();
+			}
+			break;
 		}
+
+		// 缓冲区里的数据都已经交出, 整个用来接收下一段.
+		arm_read_timer(timeout_body);
+		stream_read_some(boost::asio::buffer(m_recv_buffer.data() + m_recv_end, m_recv_buffer.size() - m_recv_end),
+			boost::bind(&http_connection::handle_receive_body,
+			shared_from_this(),
+			boost::asio::placeholders::error,
+			boost::asio::placeholders::bytes_transferred
+			)
+			);
+		return false;
 	}
 
-	void http_connection::handle_read_body(const boost::system::error_code& error, std::size_t bytes_transferred)
+	void http_connection::handle_receive_body(const boost::system::error_code& error, std::size_t bytes_transferred)
 	{
 		// 出错处理.
 		if (error || m_abort)
 		{
-			m_connection_manager->stop(shared_from_this());
+			disconnect(http_metrics::disconnect_peer);
 			return;
 		}
 
-		m_http_request.body.resize(m_http_request.content_length);
-		m_request.sgetn(&m_http_request.body[0], m_http_request.content_length);
+		if (m_server.m_metrics)
+			m_server.m_metrics->received(m_shard, bytes_transferred);
+
+		m_recv_end += bytes_transferred;
+		if (receive_body())
+			read_headers();
+	}
 
-		if (!m_server.handle_request(m_http_request, shared_from_this()))
+	void http_connection::pause_body()
+	{
+		m_body_paused = true;
+	}
+
+	void http_connection::resume_body()
+	{
+		// 总是投递, 在 on_body 中直接调用时也不会重入 receive_body.
+		m_io_service.post(boost::bind(&http_connection::handle_resume_body, shared_from_this()));
+	}
+
+	void http_connection::handle_resume_body()
+	{
+		if (!m_body_paused || m_abort)
+			return;
+		m_body_paused = false;
+		if (receive_body())
+			read_headers();
+	}
+
+	bool http_connection::dispatch_request()
+	{
+		reserve_response();
+		if (m_server.m_metrics)
+			m_server.m_metrics->request(m_shard);
+		if (!m_route)
 		{
+			// 没有回复也记一条, 便于查出被拒绝的请求.
+			if (m_server.m_access_log)
+				log_access(m_write_queue.back());
 			// 断开. 反正暴力就对了, 越暴力越不容易被人攻击
-			m_connection_manager->stop(shared_from_this());
-			return;
+			disconnect(http_metrics::disconnect_rejected);
+			return false;
 		}
 
-		if (m_http_request.keep_alive)
+		// 处理函数可能在返回前就写出回复, 路由编号要先放进回复的位置.
+		m_write_queue.back().route = static_cast<boost::uint16_t>(m_route->id);
+		m_server.handle_request(*m_route, m_http_request, shared_from_this());
+
+		if (m_abort)
+			return false;
+
+		// 处理函数返回时还没有回复 (交给了其它线程), 限定等待的时间, 对端断开时也不再等.
+		bool waiting = !m_write_queue.back().ready;
+		if (waiting)
 		{
-			// 继续读取下一个请求.
-			boost::asio::async_read_until(m_socket, m_request, "\r\n\r\n",
-				boost::bind(&http_connection::handle_read_headers,
-				shared_from_this(),
-				boost::asio::placeholders::error,
-				boost::asio::placeholders::bytes_transferred
-				)
-				);
+			arm_read_timer(timeout_response);
+			watch_peer();
 		}
+
+		// 非 keep-alive 的请求之后即使还有数据也不再处理, 回复写完后断开.
+		if (!m_http_request.keep_alive)
+			return false;
+
+		// 暂停解析后续请求, 直到回复到达, 这样稍后到达的回复一定属于这个请求.
+		if (waiting)
+		{
+			m_awaiting_response = true;
+			return false;
+		}
+		return true;
 	}
 
-	void http_connection::write_response(const std::string& body)
+	void http_connection::arm_read_timer(timeout_kind kind)
 	{
-		std::ostream out(&m_response);
+		std::size_t seconds = 0;
+		switch (kind)
+		{
+		case timeout_header: seconds = m_server.m_timeouts.header_read; break;
+		case timeout_body: seconds = m_server.m_timeouts.body_read; break;
+		case timeout_keep_alive: seconds = m_server.m_timeouts.keep_alive; break;
+		case timeout_response: seconds = m_server.m_timeouts.response; break;
+		default: break;
+		}
 
-		out << "HTTP/" << m_http_request.http_version_major << "." << m_http_request.http_version_minor << " 200 OK\r\n";
-		out << "Content-Type: application/json\r\n";
-		out << "Content-Length: " << body.length() << "\r\n";
-		out << "\r\n";
+		m_read_timeout = kind;
+		if (seconds)
+			m_connection_manager->wheel(m_shard).schedule(m_read_timer, seconds);
+		else
+			m_read_timer.cancel();
+	}
 
-		out << body;
+	void http_connection::handle_read_timeout()
+	{
+		// 还在写出回复 (很大的文件或者 chunked 回复) 时连接并不空闲, 写的快慢由写超时负责.
+		if (m_read_timeout == timeout_keep_alive && !m_write_queue.empty())
+		{
+			arm_read_timer(timeout_keep_alive);
+			return;
+		}
+		handle_timeout();
+	}
 
-		boost::asio::async_write(m_socket, m_response,
-			boost::bind(&http_connection::handle_write_http,
+	void http_connection::handle_timeout()
+	{
+		LOG_DBG << "http_connection::handle_timeout, close connection";
+		disconnect(http_metrics::disconnect_timeout);
+	}
+
+	void http_connection::watch_peer()
+	{
+		if (m_watching_peer)
+			return;
+		m_watching_peer = true;
+		m_socket.async_read_some(boost::asio::null_buffers(),
+			boost::bind(&http_connection::handle_peer_readable,
 			shared_from_this(),
-			boost::asio::placeholders::error,
-			boost::asio::placeholders::bytes_transferred
+			boost::asio::placeholders::error
 			)
 			);
+	}
+
+	void http_connection::handle_peer_readable(const boost::system::error_code& error)
+	{
+		m_watching_peer = false;
+		if (m_abort)
+			return;
+		if (!error)
+		{
+			// 回复已经到了, 之后的数据由 read_headers 读取.
+			if (m_read_timeout != timeout_response)
+				return;
+			// 可读但没有数据是对端断开; 有数据是后续的请求, 留在 socket 里, 由回复的超时兜底.
+			boost::system::error_code ec;
+			if (m_socket.available(ec) && !ec)
+				return;
+		}
+		disconnect(http_metrics::disconnect_peer);
+	}
+
+	void http_connection::disconnect(http_metrics::disconnect_reason reason)
+	{
+		// 已经被断开的连接上还会收到被取消的读写, 不再计数, 也不再碰 http_server 和
+		// 管理器, 它们可能已经析构.
+		if (m_abort)
+			return;
+		if (m_server.m_metrics)
+			m_server.m_metrics->disconnect(m_shard, reason);
+		m_connection_manager->stop(shared_from_this());
+	}
+
+	void http_connection::consume(std::size_t bytes)
+	{
+		m_recv_begin += bytes;
+		if (m_recv_begin == m_recv_end)
+			m_recv_begin = m_recv_end = 0;
+	}
+
+	namespace {
+
+		// 最常见的 200 回复预先生成好状态行和固定的头部, 之后是 Date 和 Content-Length.
+		const char status_200_http11[] =
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Type: application/json\r\n";
+		const char status_200_http10[] =
+			"HTTP/1.0 200 OK\r\n"
+			"Content-Type: application/json\r\n";
+
+		// chunked 回复默认的协议头, 不带 Content-Length.
+		const char chunked_200_http11[] =
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Type: application/json\r\n"
+			"\r\n";
+		const char chunked_200_http10[] =
+			"HTTP/1.0 200 OK\r\n"
+			"Content-Type: application/json\r\n"
+			"\r\n";
+		const char transfer_encoding_chunked[] = "Transfer-Encoding: chunked\r\n";
+		const char content_length_prefix[] = "Content-Length: ";
+		const char chunk_end[] = "\r\n";
+		const char last_chunk[] = "0\r\n\r\n";
 
+		// 写出 "Content-Length: " 和十进制的 value, 以 "\r\n\r\n" 结尾, 返回写入的长度.
+		std::size_t render_content_length(char* out, std::size_t value)
+		{
+			char digits[20];
+			std::size_t n = 0;
+			do
+			{
+				digits[n++] = static_cast<char>('0' + value % 10);
+				value /= 10;
+			} while (value);
+
+			std::size_t size = sizeof(content_length_prefix) - 1;
+			std::memcpy(out, content_length_prefix, size);
+			while (n)
+				out[size++] = digits[--n];
+			std::memcpy(out + size, "\r\n\r\n", 4);
+			return size + 4;
+		}
+
+		// 写出 "Date: ...\r\n", 时间取当前线程的 coarse_clock.
+		void render_date(char* out)
+		{
+			std::memcpy(out, "Date: ", 6);
+			std::memcpy(out + 6, coarse_clock::http_date(), coarse_clock::http_date_size);
+			std::memcpy(out + 6 + coarse_clock::http_date_size, "\r\n", 2);
+		}
+
+		// 在调用者的协议头中插入 Date 的位置, 即状态行之后. 不是以状态行开头,
+		// 或者已经带有 Date 时返回 0.
+		std::size_t date_position(const std::string& head)
+		{
+			if (head.size() < 12 || head.compare(0, 5, "HTTP/") != 0)
+				return 0;
+			std::size_t line = head.find('\n');
+			if (line == std::string::npos)
+				return 0;
+			for (std::size_t i = line; i != std::string::npos && i + 6 <= head.size(); i = head.find('\n', i + 1))
+			{
+				if (detail::iequals(boost::string_ref(head.data() + i + 1, 5), "date:"))
+					return 0;
+			}
+			return line + 1;
+		}
+
+		// 把 chunk 的长度写成十六进制并以 "\r\n" 结尾, 返回写入的长度.
+		std::size_t render_chunk_size(char* out, std::size_t value)
+		{
+			static const char hex[] = "0123456789abcdef";
+			char digits[16];
+			std::size_t n = 0;
+			do
+			{
+				digits[n++] = hex[value & 0xf];
+				value >>= 4;
+			} while (value);
+
+			std::size_t size = 0;
+			while (n)
+				out[size++] = digits[--n];
+			out[size++] = '\r';
+			out[size++] = '\n';
+			return size;
+		}
+	}
+
+	chunked_response::chunked_response(http_connection_ptr connection)
+		: m_connection(connection)
+		, m_queued(0)
+		, m_closed(false)
+		, m_sending(0)
+		, m_bytes(0)
+		, m_head_sent(false)
+		, m_finished(false)
+	{}
+
+	bool chunked_response::write(std::string data, written_handler handler)
+	{
+		http_connection_ptr connection = boost::atomic_load(&m_connection);
+		if (!connection)
+			return false;
+
+		// 空的 data 不能写成 chunk, 那是结束标记; 只用来在前面的分段写出后调用 handler.
+		piece_ptr p = boost::make_shared<piece>();
+		p->size_line_length = data.empty() ? 0 : render_chunk_size(p->size_line.data(), data.size());
+		p->data.swap(data);
+		p->handler = handler;
+		std::size_t queued = m_queued.fetch_add(p->data.size(), boost::memory_order_relaxed) + p->data.size();
+
+		if (connection->running_in_this_thread())
+			connection->append_chunk(shared_from_this(), p);
+		else
+			connection->get_io_service().post(
+				boost::bind(&http_connection::append_chunk, connection, shared_from_this(), p));
+		return queued <= HTTP_CHUNKED_HIGH_WATER;
+	}
+
+	void chunked_response::finish()
+	{
+		http_connection_ptr connection = boost::atomic_load(&m_connection);
+		if (!connection)
+			return;
+		if (connection->running_in_this_thread())
+			connection->finish_chunked(shared_from_this());
+		else
+			connection->get_io_service().post(
+				boost::bind(&http_connection::finish_chunked, connection, shared_from_this()));
+	}
+
+	bool chunked_response::closed() const
+	{
+		return m_closed.load(boost::memory_order_acquire);
+	}
+
+	std::size_t chunked_response::queued() const
+	{
+		return m_queued.load(boost::memory_order_relaxed);
+	}
+
+	void chunked_response::written()
+	{
+		for (; m_sending; --m_sending)
+		{
+			// handler 里可能接着 write, 先从队列里取出.
+			piece_ptr p = m_pieces.front();
+			m_pieces.pop_front();
+			m_queued.fetch_sub(p->data.size(), boost::memory_order_relaxed);
+			if (p->handler)
+				p->handler();
+		}
+	}
+
+	void chunked_response::close()
+	{
+		m_closed.store(true, boost::memory_order_release);
+		boost::atomic_store(&m_connection, http_connection_ptr());
+		m_pieces.clear();
+		m_sending = 0;
+	}
+
+	http_connection::pending_response::pending_response()
+		: ready(false)
+		, http10(false)
+		, close(false)
+		, status(false)
+		, interim(false)
+		, content_length_size(0)
+		, dated(false)
+		, date_offset(0)
+		, file_offset(0)
+		, file_length(0)
+		, file_sent(0)
+		, started(0)
+		, timestamp(0)
+		, route(0)
+		, method(access_log_other)
+	{}
+
+	void http_connection::pending_response::take_content(pending_response& other)
+	{
+		status = other.status;
+		content_length_size = other.content_length_size;
+		std::memcpy(content_length.data(), other.content_length.data(), content_length_size);
+		head.swap(other.head);
+		body.swap(other.body);
+		shared_body.swap(other.shared_body);
+		chunked.swap(other.chunked);
+		file.swap(other.file);
+		file_offset = other.file_offset;
+		file_length = other.file_length;
+	}
+
+	void http_connection::pending_response::append_buffers(std::vector<boost::asio::const_buffer>& buffers, bool map_file)
+	{
+		// Date 在写出时才填入, 排队等待的回复也带着写出时的时间.
+		date_offset = (status || interim) ? 0 : date_position(head);
+		dated = status || date_offset;
+		if (dated)
+			render_date(date.data());
+
+		if (status)
+		{
+			if (http10)
+				buffers.push_back(boost::asio::buffer(status_200_http10, sizeof(status_200_http10) - 1));
+			else
+				buffers.push_back(boost::asio::buffer(status_200_http11, sizeof(status_200_http11) - 1));
+			buffers.push_back(boost::asio::buffer(date));
+			buffers.push_back(boost::asio::buffer(content_length.data(), content_length_size));
+		}
+		if (date_offset)
+		{
+			buffers.push_back(boost::asio::buffer(head.data(), date_offset));
+			buffers.push_back(boost::asio::buffer(date));
+			buffers.push_back(boost::asio::buffer(head.data() + date_offset, head.size() - date_offset));
+		}
+		else if (!head.empty())
+			buffers.push_back(boost::asio::buffer(head));
+		if (shared_body)
+			buffers.push_back(boost::asio::buffer(*shared_body));
+		else if (!body.empty())
+			buffers.push_back(boost::asio::buffer(body));
+		// 文件的映射直接作为缓冲区, 由内核从页缓存复制到 socket.
+		if (file && map_file)
+			buffers.push_back(boost::asio::buffer(file->data() + file_offset, static_cast<std::size_t>(file_length)));
+	}
+
+	bool http_connection::pending_response::append_chunked_buffers(std::vector<boost::asio::const_buffer>& buffers)
+	{
+		chunked_response& c = *chunked;
+		if (!c.m_head_sent)
+		{
+			// HTTP/1.0 不认识 chunked, 直接写出数据, 以断开连接表示结束.
+			if (head.empty())
+				head = http10 ? chunked_200_http10 : chunked_200_http11;
+			if (!http10 && head.size() >= 2)
+				head.insert(head.size() - 2, transfer_encoding_chunked);
+			std::size_t position = date_position(head);
+			if (position)
+			{
+				render_date(date.data());
+				head.insert(position, date.data(), date.size());
+			}
+			if (http10)
+				close = true;
+			buffers.push_back(boost::asio::buffer(head));
+			c.m_bytes += head.size();
+			c.m_head_sent = true;
+		}
+
+		for (std::size_t i = c.m_sending; i < c.m_pieces.size(); ++i)
+		{
+			const chunked_response::piece& p = *c.m_pieces[i];
+			if (p.data.empty())
+				continue;
+			if (!http10)
+			{
+				buffers.push_back(boost::asio::buffer(p.size_line.data(), p.size_line_length));
+				c.m_bytes += p.size_line_length + sizeof(chunk_end) - 1;
+			}
+			buffers.push_back(boost::asio::buffer(p.data));
+			c.m_bytes += p.data.size();
+			if (!http10)
+				buffers.push_back(boost::asio::buffer(chunk_end, sizeof(chunk_end) - 1));
+		}
+		c.m_sending = c.m_pieces.size();
+
+		if (!c.m_finished)
+			return false;
+		if (!http10)
+		{
+			buffers.push_back(boost::asio::buffer(last_chunk, sizeof(last_chunk) - 1));
+			c.m_bytes += sizeof(last_chunk) - 1;
+		}
+		return true;
+	}
+
+	std::size_t http_connection::pending_response::size() const
+	{
+		if (chunked)
+			return chunked->m_bytes;
+		std::size_t bytes = head.size() + (shared_body ? shared_body->size() : body.size())
+			+ static_cast<std::size_t>(file_length);
+		if (status)
+			bytes += (http10 ? sizeof(status_200_http10) : sizeof(status_200_http11)) - 1 + content_length_size;
+		if (dated)
+			bytes += date.size();
+		return bytes;
+	}
+
+	boost::uint16_t http_connection::pending_response::status_code() const
+	{
+		if (status)
+			return 200;
+		// 调用者自己的协议头以 "HTTP/1.x NNN" 开头.
+		if (!ready || head.size() < 12 || head.compare(0, 5, "HTTP/") != 0)
+			return 0;
+		boost::uint16_t code = 0;
+		for (std::size_t i = 9; i < 12; ++i)
+		{
+			if (head[i] < '0' || head[i] > '9')
+				return 0;
+			code = code * 10 + (head[i] - '0');
+		}
+		return code;
+	}
+
+	void http_connection::write_response(std::string body)
+	{
+		pending_response response;
+		response.body.swap(body);
+		response.status = true;
+		response.content_length_size = render_content_length(response.content_length.data(), response.body.size());
+		deliver_response(response);
+	}
+
+	void http_connection::write_response(boost::shared_ptr<const std::string> body)
+	{
+		pending_response response;
+		response.shared_body.swap(body);
+		response.status = true;
+		response.content_length_size = render_content_length(response.content_length.data(),
+			response.shared_body ? response.shared_body->size() : 0);
+		deliver_response(response);
+	}
+
+	void http_connection::write_response(std::string head, std::string body)
+	{
+		pending_response response;
+		response.head.swap(head);
+		response.body.swap(body);
+		deliver_response(response);
+	}
+
+	void http_connection::write_file(std::string head, static_file_ptr file, boost::uint64_t offset, boost::uint64_t length)
+	{
+		pending_response response;
+		response.head.swap(head);
+		if (length)
+		{
+			response.file.swap(file);
+			response.file_offset = offset;
+			response.file_length = length;
+		}
+		deliver_response(response);
+	}
+
+	chunked_response_ptr http_connection::write_chunked(std::string head)
+	{
+		chunked_response_ptr chunked = boost::make_shared<chunked_response>(shared_from_this());
+		pending_response response;
+		response.head.swap(head);
+		response.chunked = chunked;
+		// 在其它线程上时回复和之后的分段都投递到同一个 io_service, 按顺序执行.
+		deliver_response(response);
+		return chunked;
+	}
+
+	void http_connection::append_chunk(chunked_response_ptr response, chunked_response::piece_ptr piece)
+	{
+		if (m_abort || response->closed() || response->m_finished)
+		{
+			response->m_queued.fetch_sub(piece->data.size(), boost::memory_order_relaxed);
+			return;
+		}
+		response->m_pieces.push_back(piece);
+		if (!m_writing)
+			write_pending();
+	}
+
+	void http_connection::finish_chunked(chunked_response_ptr response)
+	{
+		if (m_abort || response->closed() || response->m_finished)
+			return;
+		response->m_finished = true;
+		if (!m_writing)
+			write_pending();
+	}
+
+	void http_connection::release_empty_chunks(chunked_response_ptr response)
+	{
+		// 期间开始的写操作完成时会一起释放这些分段.
+		if (m_abort || m_writing || response->closed())
+			return;
+		// 和 handle_write_http 一样, handler 中的 write 只排队, 之后再一起写出.
+		m_writing = true;
+		response->written();
+		if (m_abort)
+			return;
+		m_writing = false;
+		if (m_responses_ready)
+			write_pending();
+	}
+
+	void http_connection::deliver_response(pending_response& response)
+	{
+		// 在连接所属的 io_service 线程上直接放进队列, 其它线程上
+		// 则投递到该 io_service, 保证写队列只在一个线程上被访问.
+		if (running_in_this_thread())
+		{
+			fill_response(response);
+			return;
+		}
+
+		boost::shared_ptr<pending_response> shared = boost::make_shared<pending_response>();
+		shared->take_content(response);
+		m_io_service.post(boost::bind(&http_connection::fill_shared_response, shared_from_this(), shared));
+	}
+
+	void http_connection::fill_shared_response(boost::shared_ptr<pending_response> response)
+	{
+		fill_response(*response);
 	}
 
-	void http_connection::write_response(const std::string& head, const std::string& body)
+	void http_connection::reserve_response()
 	{
-		std::ostream out(&m_response);
+		// 派发请求之前先按顺序占一个位置, 回复总是按请求的顺序写出.
+		m_write_queue.push_back(pending_response());
+		m_load.requests.fetch_add(1, boost::memory_order_relaxed);
+		pending_response& response = m_write_queue.back();
+		response.http10 = m_http_request.http_version_major == 1 && m_http_request.http_version_minor == 0;
+		response.close = !m_http_request.keep_alive;
+		// 耗时用单调时钟计算, 系统时间被调整时不受影响; 墙上时间只用作访问日志的时间戳.
+		if (m_server.m_access_log || m_server.m_metrics)
+			response.started = coarse_clock::precise_monotonic_microseconds();
+		if (m_server.m_access_log)
+		{
+			response.timestamp = coarse_clock::precise_unix_microseconds();
+			response.method = access_log_method_code(m_http_request.method);
+		}
+	}
+
+	void http_connection::send_continue()
+	{
+		// 解析到新请求时前面的回复都已经填好 (见 dispatch_request), 直接排在队尾.
+		m_write_queue.push_back(pending_response());
+		m_load.requests.fetch_add(1, boost::memory_order_relaxed);
+		pending_response& response = m_write_queue.back();
+		response.head = "HTTP/1.1 100 Continue\r\n\r\n";
+		response.ready = true;
+		response.interim = true;
+		++m_responses_ready;
+
+		if (!m_writing)
+			write_pending();
+	}
+
+	void http_connection::fill_response(pending_response& response)
+	{
+		if (m_abort)
+			return;
+
+		// 回复填入最早的空位, 前面的位置都已经填好 (见 dispatch_request);
+		// 同一个请求回复了多次时补一个位置.
+		if (m_responses_ready == m_write_queue.size())
+			reserve_response();
+		pending_response& slot = m_write_queue[m_responses_ready++];
+		slot.take_content(response);
+		slot.ready = true;
+		if (m_read_timeout == timeout_response)
+			arm_read_timer(timeout_none);
+
+		if (!m_writing)
+			write_pending();
+
+		if (m_awaiting_response)
+		{
+			m_awaiting_response = false;
+			read_headers();
+		}
+	}
+
+	void http_connection::write_pending()
+	{
+		// 把所有已经就绪的回复合并成一次 gather write. 没写完的 chunked 回复
+		// 只能写出已有的分段, 后面的回复要等它结束.
+		m_write_buffers.clear();
+		std::size_t count = (std::min<std::size_t>)(m_responses_ready, HTTP_MAX_WRITE_BATCH);
+		std::size_t complete = 0;
+		bool partial = false;
+		for (; complete < count; ++complete)
+		{
+			pending_response& response = m_write_queue[complete];
+			if (!response.chunked)
+			{
+				// 文件内容在这一批写出之后用 sendfile 发送, 后面的回复等下一批.
+				// TLS 要在用户态加密, 只能写出文件的映射.
+				bool use_sendfile = HTTP_USE_SENDFILE && response.file && !m_ssl;
+				if (response.file && !use_sendfile && !response.file->data())
+				{
+					disconnect(http_metrics::disconnect_peer);
+					return;
+				}
+				response.append_buffers(m_write_buffers, !use_sendfile);
+				if (use_sendfile)
+				{
+					++complete;
+					m_file_writing = true;
+					break;
+				}
+			}
+			else if (!response.append_chunked_buffers(m_write_buffers))
+			{
+				partial = true;
+				break;
+			}
+		}
+
+		// 只有一个还没有新分段的 chunked 回复. 新的分段都是空的时没有东西要写,
+		// 它们的 handler 另外投递调用, 否则要等下一次写出才会被调用.
+		if (m_write_buffers.empty())
+		{
+			if (partial && m_write_queue[complete].chunked->m_sending)
+				m_io_service.post(boost::bind(&http_connection::release_empty_chunks,
+					shared_from_this(), m_write_queue[complete].chunked));
+			return;
+		}
+		m_responses_writing = complete;
+		m_chunk_writing = partial;
+		m_writing = true;
 
-		out << head;
-		out << body;
+		// 每写出一批重新计时, 超时针对的是对端长时间不收数据.
+		std::size_t seconds = m_server.m_timeouts.write;
+		if (seconds)
+			m_connection_manager->wheel(m_shard).schedule(m_write_timer, seconds);
 
-		boost::asio::async_write(m_socket, m_response,
+		if (m_ssl && m_write_buffers.size() > 1)
+			coalesce_buffers();
+		stream_write(m_write_buffers,
 			boost::bind(&http_connection::handle_write_http,
 			shared_from_this(),
 			boost::asio::placeholders::error,
 			boost::asio::placeholders::bytes_transferred
 			)
 			);
+	}
 
+	void http_connection::coalesce_buffers()
+	{
+		// 每个缓冲区单独加密会变成一个 TLS 记录和一次系统调用, pipelining 的小回复
+		// 先复制到一起; 大的 body 和文件的映射保持原样, 由 ssl::stream 分段加密.
+		std::size_t small = 0;
+		for (std::size_t i = 0; i < m_write_buffers.size(); ++i)
+		{
+			std::size_t size = boost::asio::buffer_size(m_write_buffers[i]);
+			if (size < HTTP_TLS_COALESCE_SIZE)
+				small += size;
+		}
+		m_coalesce_buffer.resize(small);
+		m_coalesced_buffers.clear();
+
+		char* begin = m_coalesce_buffer.empty() ? 0 : &m_coalesce_buffer[0];
+		char* end = begin;
+		for (std::size_t i = 0; i < m_write_buffers.size(); ++i)
+		{
+			const boost::asio::const_buffer& buffer = m_write_buffers[i];
+			std::size_t size = boost::asio::buffer_size(buffer);
+			if (size < HTTP_TLS_COALESCE_SIZE)
+			{
+				std::memcpy(end, boost::asio::buffer_cast<const char*>(buffer), size);
+				end += size;
+				continue;
+			}
+			if (end != begin)
+				m_coalesced_buffers.push_back(boost::asio::buffer(begin, end - begin));
+			begin = end;
+			m_coalesced_buffers.push_back(buffer);
+		}
+		if (end != begin)
+			m_coalesced_buffers.push_back(boost::asio::buffer(begin, end - begin));
+		m_write_buffers.swap(m_coalesced_buffers);
 	}
 
 	void http_connection::handle_write_http(const boost::system::error_code& error, std::size_t bytes_transferred)
 	{
 		// 出错处理.
-		if (error || m_abort || !m_http_request.keep_alive)
+		if (error || m_abort)
+		{
+			disconnect(http_metrics::disconnect_peer);
+			return;
+		}
+
+		http_metrics* metrics = m_server.m_metrics.get();
+		if (metrics)
+			metrics->sent(m_shard, bytes_transferred);
+
+#if HTTP_USE_SENDFILE
+		if (m_file_writing)
 		{
-			m_connection_manager->stop(shared_from_this());
+			send_file();
 			return;
 		}
+#endif
+
+		boost::uint64_t now = 0;
+		if (metrics)
+			now = coarse_clock::precise_monotonic_microseconds();
+
+		for (std::size_t i = 0; i < m_responses_writing; ++i)
+		{
+			if (metrics && !m_write_queue.front().interim)
+			{
+				const pending_response& response = m_write_queue.front();
+				boost::uint64_t elapsed = now - response.started;
+				metrics->latency(m_shard, response.route,
+					static_cast<boost::uint32_t>((std::min<boost::uint64_t>)(elapsed, 0xffffffff)));
+			}
+			if (m_server.m_access_log && !m_write_queue.front().interim)
+				log_access(m_write_queue.front());
+			if (m_write_queue.front().close)
+			{
+				disconnect(http_metrics::disconnect_done);
+				return;
+			}
+			chunked_response_ptr chunked;
+			chunked.swap(m_write_queue.front().chunked);
+			m_write_queue.pop_front();
+			m_load.requests.fetch_sub(1, boost::memory_order_relaxed);
+			if (chunked)
+			{
+				chunked->written();
+				chunked->close();
+				if (m_abort)
+					return;
+			}
+		}
+		m_responses_ready -= m_responses_writing;
+		m_responses_writing = 0;
+		// 写出了一部分的 chunked 回复留在队列头部, 释放已经写出的分段.
+		// handler 中的 write 只会排队, 这时 m_writing 还没有复位.
+		if (m_chunk_writing)
+		{
+			m_chunk_writing = false;
+			m_write_queue.front().chunked->written();
+			if (m_abort)
+				return;
+		}
+		m_writing = false;
+		m_write_timer.cancel();
+
+		if (m_responses_ready)
+			write_pending();
+
+		if (m_read_paused && !m_awaiting_response && m_write_queue.size() < HTTP_MAX_PIPELINE_DEPTH)
+		{
+			m_read_paused = false;
+			read_headers();
+		}
+	}
+
+	void http_connection::send_file()
+	{
+#if HTTP_USE_SENDFILE
+		pending_response& response = m_write_queue[m_responses_writing - 1];
+		if (response.file_sent < response.file_length)
+		{
+			boost::uint64_t remaining = response.file_length - response.file_sent;
+			off_t offset = static_cast<off_t>(response.file_offset + response.file_sent);
+			ssize_t n = ::sendfile(m_socket.native_handle(), response.file->handle(), &offset,
+				static_cast<std::size_t>((std::min<boost::uint64_t>)(remaining, HTTP_SENDFILE_CHUNK)));
+			if (n > 0)
+			{
+				response.file_sent += n;
+				if (m_server.m_metrics)
+					m_server.m_metrics->sent(m_shard, n);
+			}
+			else if (n == 0)
+			{
+				// 文件在打开后被截短, 已经承诺的 Content-Length 无法满足.
+				LOG_ERR << "http_connection::send_file, " << response.file->path() << " was truncated";
+				disconnect(http_metrics::disconnect_peer);
+				return;
+			}
+			else if (errno == EINVAL || errno == ENOSYS)
+			{
+				// 文件所在的文件系统不支持 sendfile, 改为写出文件的映射.
+				const char* data = response.file->data();
+				if (!data)
+				{
+					disconnect(http_metrics::disconnect_peer);
+					return;
+				}
+				m_file_writing = false;
+				response.file_sent = response.file_length;
+				boost::asio::async_write(m_socket,
+					boost::asio::buffer(data + static_cast<std::size_t>(offset), static_cast<std::size_t>(remaining)),
+					boost::bind(&http_connection::handle_write_http,
+					shared_from_this(),
+					boost::asio::placeholders::error,
+					boost::asio::placeholders::bytes_transferred
+					)
+					);
+				return;
+			}
+			else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			{
+				disconnect(http_metrics::disconnect_peer);
+				return;
+			}
+
+			if (response.file_sent < response.file_length)
+			{
+				// 每写出一段重新计时. 等 socket 可写再继续; 可写时也经过 io_service,
+				// 大文件不会让同一线程上的其它连接一直等着.
+				std::size_t seconds = m_server.m_timeouts.write;
+				if (seconds)
+					m_connection_manager->wheel(m_shard).schedule(m_write_timer, seconds);
+				m_socket.async_write_some(boost::asio::null_buffers(),
+					boost::bind(&http_connection::handle_send_file,
+					shared_from_this(),
+					boost::asio::placeholders::error
+					)
+					);
+				return;
+			}
+		}
+
+		m_file_writing = false;
+		handle_write_http(boost::system::error_code(), 0);
+#endif
+	}
+
+	void http_connection::handle_send_file(const boost::system::error_code& error)
+	{
+		if (error || m_abort)
+		{
+			disconnect(http_metrics::disconnect_peer);
+			return;
+		}
+		send_file();
+	}
+
+	void http_connection::log_access(const pending_response& response)
+	{
+		access_log_entry entry;
+		entry.timestamp = response.timestamp;
+		boost::uint64_t elapsed = coarse_clock::precise_monotonic_microseconds() - response.started;
+		entry.latency = static_cast<boost::uint32_t>((std::min<boost::uint64_t>)(elapsed, 0xffffffff));
+		entry.bytes = static_cast<boost::uint32_t>((std::min<std::size_t>)(response.size(), 0xffffffff));
+		entry.status = response.status_code();
+		entry.route = response.route;
+		entry.method = response.method;
+		entry.port = m_peer_known ? m_peer.port() : 0;
+		std::memset(entry.address, 0, sizeof(entry.address));
+		std::memset(entry.reserved, 0, sizeof(entry.reserved));
+		if (!m_peer_known)
+		{
+			// 取不到对端地址时记为未知, 而不是 0.0.0.0.
+			entry.family = 0;
+		}
+		else if (m_peer.address().is_v4())
+		{
+			entry.family = 4;
+			boost::asio::ip::address_v4::bytes_type bytes = m_peer.address().to_v4().to_bytes();
+			std::memcpy(entry.address, bytes.data(), bytes.size());
+		}
+		else
+		{
+			entry.family = 6;
+			boost::asio::ip::address_v6::bytes_type bytes = m_peer.address().to_v6().to_bytes();
+			std::memcpy(entry.address, bytes.data(), bytes.size());
+		}
+		m_server.m_access_log->record(m_shard, entry);
 	}
 }
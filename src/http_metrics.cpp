@@ -0,0 +1,247 @@
+﻿#include "include/http_metrics.hpp"
+
+#include <algorithm>
+#include <cstdio>
+
+#include <boost/make_shared.hpp>
+
+namespace http {
+
+	namespace {
+
+		const char* const disconnect_names[] =
+		{ "peer", "timeout", "bad_request", "rejected", "done", "handshake" };
+
+		// Prometheus 直方图的上界, 微秒, 都是 2 的幂, 与 latency_histogram 的桶边界对齐.
+		const unsigned export_first_power = 4;		// 16us
+		const unsigned export_last_power = 25;		// 约 33.5s
+
+		const double export_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+		void append_number(std::string& out, boost::uint64_t value)
+		{
+			char buf[32];
+			std::sprintf(buf, "%llu", static_cast<unsigned long long>(value));
+			out += buf;
+		}
+
+		void append_seconds(std::string& out, double microseconds)
+		{
+			char buf[32];
+			std::sprintf(buf, "%.6f", microseconds / 1000000.0);
+			out += buf;
+		}
+
+		// 标签值里的 \, " 和换行需要转义.
+		void append_label(std::string& out, const char* name, const std::string& value)
+		{
+			out += name;
+			out += "=\"";
+			for (std::size_t i = 0; i < value.size(); ++i)
+			{
+				if (value[i] == '\\' || value[i] == '"')
+					out += '\\';
+				if (value[i] == '\n')
+					out += "\\n";
+				else
+					out += value[i];
+			}
+			out += '"';
+		}
+
+		void append_counter(std::string& out, const char* name, const char* help, boost::uint64_t value)
+		{
+			out += "# HELP ";
+			out += name;
+			out += ' ';
+			out += help;
+			out += "\n# TYPE ";
+			out += name;
+			out += " counter\n";
+			out += name;
+			out += ' ';
+			append_number(out, value);
+			out += '\n';
+		}
+	}
+
+	latency_histogram::latency_histogram()
+		: m_sum(0)
+	{
+		for (std::size_t i = 0; i < bucket_count; ++i)
+			m_buckets[i].store(0, boost::memory_order_relaxed);
+	}
+
+	boost::uint64_t latency_histogram::merge_into(std::vector<boost::uint64_t>& counts) const
+	{
+		for (std::size_t i = 0; i < bucket_count; ++i)
+			counts[i] += m_buckets[i].load(boost::memory_order_relaxed);
+		return m_sum.load(boost::memory_order_relaxed);
+	}
+
+	http_metrics::shard::shard()
+		: requests(0)
+		, bytes_in(0)
+		, bytes_out(0)
+		, parse_errors(0)
+	{
+		for (std::size_t i = 0; i < disconnect_reason_count; ++i)
+			disconnects[i].store(0, boost::memory_order_relaxed);
+		for (std::size_t i = 0; i <= HTTP_METRICS_MAX_ROUTES; ++i)
+			routes[i].store(0, boost::memory_order_relaxed);
+	}
+
+	http_metrics::shard::~shard()
+	{
+		for (std::size_t i = 0; i <= HTTP_METRICS_MAX_ROUTES; ++i)
+			delete routes[i].load(boost::memory_order_relaxed);
+	}
+
+	http_metrics::http_metrics(std::size_t shards)
+	{
+		for (std::size_t i = 0; i < shards; ++i)
+			m_shards.push_back(boost::make_shared<shard>());
+	}
+
+	http_metrics::~http_metrics()
+	{}
+
+	void http_metrics::latency(std::size_t shard, std::size_t route, boost::uint32_t microseconds)
+	{
+		if (route > HTTP_METRICS_MAX_ROUTES)
+			route = 0;
+		boost::atomic<latency_histogram*>& slot = m_shards[shard]->routes[route];
+		latency_histogram* h = slot.load(boost::memory_order_relaxed);
+		if (!h)
+		{
+			// 在 io_service 线程上分配, 内存落在它的 NUMA 节点上.
+			h = new latency_histogram;
+			slot.store(h, boost::memory_order_release);
+		}
+		h->record(microseconds);
+	}
+
+	void http_metrics::render(std::string& out, const std::vector<std::pair<std::string, std::string> >& routes,
+		std::size_t connections) const
+	{
+		boost::uint64_t requests = 0, bytes_in = 0, bytes_out = 0, parse_errors = 0;
+		boost::uint64_t disconnects[disconnect_reason_count] = { 0 };
+		for (std::size_t i = 0; i < m_shards.size(); ++i)
+		{
+			const shard& s = *m_shards[i];
+			requests += s.requests.load(boost::memory_order_relaxed);
+			bytes_in += s.bytes_in.load(boost::memory_order_relaxed);
+			bytes_out += s.bytes_out.load(boost::memory_order_relaxed);
+			parse_errors += s.parse_errors.load(boost::memory_order_relaxed);
+			for (std::size_t r = 0; r < disconnect_reason_count; ++r)
+				disconnects[r] += s.disconnects[r].load(boost::memory_order_relaxed);
+		}
+
+		append_counter(out, "http_requests_total", "Requests dispatched to a handler or rejected.", requests);
+		append_counter(out, "http_received_bytes_total", "Bytes read from clients.", bytes_in);
+		append_counter(out, "http_sent_bytes_total", "Bytes written to clients.", bytes_out);
+		append_counter(out, "http_parse_errors_total", "Requests that could not be parsed.", parse_errors);
+
+		out += "# HELP http_disconnects_total Connections closed, by reason.\n";
+		out += "# TYPE http_disconnects_total counter\n";
+		for (std::size_t r = 0; r < disconnect_reason_count; ++r)
+		{
+			out += "http_disconnects_total{reason=\"";
+			out += disconnect_names[r];
+			out += "\"} ";
+			append_number(out, disconnects[r]);
+			out += '\n';
+		}
+
+		out += "# HELP http_connections Open connections.\n";
+		out += "# TYPE http_connections gauge\n";
+		out += "http_connections ";
+		append_number(out, connections);
+		out += '\n';
+
+		// 每个路由合并所有 io_service 的直方图.
+		std::string histograms = "# HELP http_request_duration_seconds Time from dispatching a request to writing its response.\n"
+			"# TYPE http_request_duration_seconds histogram\n";
+		std::string quantiles = "# HELP http_request_duration_quantile_seconds Latency quantiles, upper bound of the bucket.\n"
+			"# TYPE http_request_duration_quantile_seconds gauge\n";
+		std::vector<boost::uint64_t> counts(latency_histogram::bucket_count);
+		for (std::size_t route = 0; route <= HTTP_METRICS_MAX_ROUTES; ++route)
+		{
+			std::fill(counts.begin(), counts.end(), 0);
+			boost::uint64_t sum = 0;
+			bool seen = false;
+			for (std::size_t i = 0; i < m_shards.size(); ++i)
+			{
+				const latency_histogram* h = m_shards[i]->routes[route].load(boost::memory_order_acquire);
+				if (h)
+				{
+					sum += h->merge_into(counts);
+					seen = true;
+				}
+			}
+			if (!seen)
+				continue;
+
+			std::string labels;
+			if (route == 0 || route > routes.size())
+			{
+				labels = "route=\"other\"";
+			}
+			else
+			{
+				append_label(labels, "method", routes[route - 1].first.empty() ? "ANY" : routes[route - 1].first);
+				labels += ',';
+				append_label(labels, "route", routes[route - 1].second);
+			}
+
+			boost::uint64_t total = 0;
+			for (std::size_t b = 0; b < counts.size(); ++b)
+				total += counts[b];
+
+			boost::uint64_t cumulative = 0;
+			std::size_t b = 0;
+			for (unsigned power = export_first_power; power <= export_last_power; ++power)
+			{
+				boost::uint64_t bound = 1ull << power;
+				for (; b < counts.size() && latency_histogram::bucket_high(b) <= bound; ++b)
+					cumulative += counts[b];
+				histograms += "http_request_duration_seconds_bucket{" + labels + ",le=\"";
+				append_seconds(histograms, static_cast<double>(bound));
+				histograms += "\"} ";
+				append_number(histograms, cumulative);
+				histograms += '\n';
+			}
+			histograms += "http_request_duration_seconds_bucket{" + labels + ",le=\"+Inf\"} ";
+			append_number(histograms, total);
+			histograms += "\nhttp_request_duration_seconds_sum{" + labels + "} ";
+			append_seconds(histograms, static_cast<double>(sum));
+			histograms += "\nhttp_request_duration_seconds_count{" + labels + "} ";
+			append_number(histograms, total);
+			histograms += '\n';
+
+			for (std::size_t q = 0; q < sizeof(export_quantiles) / sizeof(export_quantiles[0]); ++q)
+			{
+				// 第一个累计数达到 total * q 的桶.
+				boost::uint64_t rank = static_cast<boost::uint64_t>(export_quantiles[q] * total + 0.5);
+				if (rank == 0)
+					rank = 1;
+				boost::uint64_t seen_count = 0;
+				std::size_t bucket = 0;
+				for (; bucket < counts.size(); ++bucket)
+				{
+					seen_count += counts[bucket];
+					if (seen_count >= rank)
+						break;
+				}
+				char quantile[16];
+				std::sprintf(quantile, "%g", export_quantiles[q]);
+				quantiles += "http_request_duration_quantile_seconds{" + labels + ",quantile=\"" + quantile + "\"} ";
+				append_seconds(quantiles, static_cast<double>(latency_histogram::bucket_high(bucket)));
+				quantiles += '\n';
+			}
+		}
+		out += histograms;
+		out += quantiles;
+	}
+
+}
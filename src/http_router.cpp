@@ -0,0 +1,235 @@
+﻿#include "include/http_router.hpp"
+
+#include <boost/algorithm/string.hpp>
+#include <boost/make_shared.hpp>
+
+namespace http {
+
+	namespace {
+
+		// ':' 和 '*' 只在路径段的开头才是参数和通配符, 段中间的是普通字符.
+		// 模式总是以 '/' 开头, p[-1] 一定在模式里.
+		bool is_marker(const char* p)
+		{
+			return (*p == ':' || *p == '*') && p[-1] == '/';
+		}
+
+	}
+
+	struct http_router::node
+	{
+		std::string prefix;			// 静态前缀, 参数和通配节点为空.
+		std::string indices;		// children 的首字符, 与 children 一一对应.
+		std::vector<node_ptr> children;
+		node_ptr param_child;		// ":name"
+		std::string param_name;
+		node_ptr wildcard_child;	// "*name"
+		std::string wildcard_name;
+		std::vector<route_ptr> handlers;	// 路由在节点复制时共享, 查找返回的指针一直有效.
+	};
+
+	http_router::http_router()
+		: m_current(boost::make_shared<node>())
+	{
+		m_root.store(m_current.get(), boost::memory_order_release);
+	}
+
+	http_router::~http_router()
+	{}
+
+	bool http_router::add(const std::string& method, const std::string& pattern, const http_request_callback& cb,
+		const http_route_options& options)
+	{
+		if (pattern.empty() || pattern[0] != '/')
+			return false;
+
+		boost::mutex::scoped_lock l(m_mutex);
+		boost::shared_ptr<http_route> route = boost::make_shared<http_route>();
+		route->method = boost::to_lower_copy(method);
+		route->pattern = pattern;
+		route->callback = cb;
+		route->options = options;
+		route->id = m_routes.size() + 1;
+
+		node_ptr root = m_current;
+		if (!insert(root, pattern.data(), pattern.data() + pattern.size(), route))
+			return false;
+		m_routes.push_back(route);
+
+		// 旧树可能还有查找正在进行, 保留到 router 析构.
+		m_retired.push_back(m_current);
+		m_current = root;
+		m_root.store(m_current.get(), boost::memory_order_release);
+		return true;
+	}
+
+	const http_route* http_router::find(boost::string_ref method, boost::string_ref path, params_type& params) const
+	{
+		params.clear();
+		const node* root = m_root.load(boost::memory_order_acquire);
+		return match(root, path.data(), path.data() + path.size(), method, params);
+	}
+
+	std::vector<std::pair<std::string, std::string> > http_router::routes() const
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		std::vector<std::pair<std::string, std::string> > result;
+		for (std::size_t i = 0; i < m_routes.size(); ++i)
+			result.push_back(std::make_pair(boost::to_upper_copy(m_routes[i]->method), m_routes[i]->pattern));
+		return result;
+	}
+
+	http_router::node* http_router::clone(node_ptr& slot)
+	{
+		slot = boost::make_shared<node>(*slot);
+		return slot.get();
+	}
+
+	bool http_router::insert(node_ptr& slot, const char* pattern, const char* end, const route_ptr& route)
+	{
+		// 修改前先复制, 旧树保持不变.
+		node* n = clone(slot);
+
+		if (pattern == end)
+		{
+			for (std::size_t i = 0; i < n->handlers.size(); ++i)
+				if (n->handlers[i]->method == route->method)
+					return false;
+			n->handlers.push_back(route);
+			return true;
+		}
+
+		if (*pattern == ':' && is_marker(pattern))
+		{
+			const char* name_end = std::find(pattern, end, '/');
+			std::string name(pattern + 1, name_end);
+			if (name.empty())
+				return false;
+			if (!n->param_child)
+			{
+				n->param_child = boost::make_shared<node>();
+				n->param_name = name;
+			}
+			else if (n->param_name != name)
+			{
+				// 同一位置的参数名字必须一致.
+				return false;
+			}
+			return insert(n->param_child, name_end, end, route);
+		}
+
+		if (*pattern == '*' && is_marker(pattern))
+		{
+			std::string name(pattern + 1, end);
+			if (name.empty() || name.find('/') != std::string::npos)
+				return false;
+			if (!n->wildcard_child)
+			{
+				n->wildcard_child = boost::make_shared<node>();
+				n->wildcard_name = name;
+			}
+			else if (n->wildcard_name != name)
+			{
+				return false;
+			}
+			return insert(n->wildcard_child, end, end, route);
+		}
+
+		// 静态部分直到下一个参数或通配符.
+		const char* static_end = pattern;
+		while (static_end != end && !is_marker(static_end))
+			++static_end;
+
+		std::size_t index = n->indices.find(*pattern);
+		if (index == std::string::npos)
+		{
+			node_ptr child = boost::make_shared<node>();
+			child->prefix.assign(pattern, static_end);
+			n->indices.push_back(*pattern);
+			n->children.push_back(child);
+			return insert(n->children.back(), static_end, end, route);
+		}
+
+		node_ptr& child = n->children[index];
+		std::size_t common = 0;
+		std::size_t limit = (std::min)(child->prefix.size(), static_cast<std::size_t>(static_end - pattern));
+		while (common < limit && child->prefix[common] == pattern[common])
+			++common;
+
+		if (common < child->prefix.size())
+		{
+			// 拆分: 公共前缀成为新节点, 原节点剩余部分挂在它下面.
+			node_ptr split = boost::make_shared<node>();
+			split->prefix = child->prefix.substr(0, common);
+			node* rest = clone(child);
+			rest->prefix.erase(0, common);
+			split->indices.push_back(rest->prefix[0]);
+			split->children.push_back(child);
+			child = split;
+		}
+		return insert(child, pattern + common, end, route);
+	}
+
+	const http_route* http_router::find_handler(const node* n, boost::string_ref method)
+	{
+		const http_route* any = 0;
+		for (std::size_t i = 0; i < n->handlers.size(); ++i)
+		{
+			if (method == n->handlers[i]->method)
+				return n->handlers[i].get();
+			if (n->handlers[i]->method.empty())
+				any = n->handlers[i].get();
+		}
+		return any;
+	}
+
+	const http_route* http_router::match(const node* n, const char* p, const char* end,
+		boost::string_ref method, params_type& params)
+	{
+		if (p == end)
+		{
+			const http_route* r = find_handler(n, method);
+			if (r)
+				return r;
+		}
+
+		// 静态子节点优先.
+		std::size_t index = p == end ? std::string::npos : n->indices.find(*p);
+		if (index != std::string::npos)
+		{
+			const node* child = n->children[index].get();
+			std::size_t size = child->prefix.size();
+			if (static_cast<std::size_t>(end - p) >= size && std::memcmp(p, child->prefix.data(), size) == 0)
+			{
+				const http_route* r = match(child, p + size, end, method, params);
+				if (r)
+					return r;
+			}
+		}
+
+		if (n->param_child && p != end && *p != '/')
+		{
+			const char* segment_end = std::find(p, end, '/');
+			params.emplace_back(arena_string(n->param_name.data(), n->param_name.size(), params.get_allocator()),
+				arena_string(p, segment_end, params.get_allocator()));
+			const http_route* r = match(n->param_child.get(), segment_end, end, method, params);
+			if (r)
+				return r;
+			params.pop_back();
+		}
+
+		if (n->wildcard_child)
+		{
+			const http_route* r = find_handler(n->wildcard_child.get(), method);
+			if (r)
+			{
+				params.emplace_back(arena_string(n->wildcard_name.data(), n->wildcard_name.size(), params.get_allocator()),
+					arena_string(p, end, params.get_allocator()));
+				return r;
+			}
+		}
+
+		return 0;
+	}
+
+}
@@ -6,20 +6,28 @@ using namespace boost::posix_time;
 
 namespace http {
 
-	http_server::http_server(io_service_pool& ios, unsigned short port, std::string address /*= "0.0.0.0"*/)
+	http_server::http_server(io_service_pool& ios, unsigned short port, std::string address /*= "0.0.0.0"*/, bool reuse_port /*= false*/)
 		: m_io_service_pool(ios)
-		, m_io_service(ios.get_io_service())
-		, m_ssl_context(ios.get_io_service(), boost::asio::ssl::context::sslv23)
-		, m_acceptor(m_io_service)
+		, m_io_service(ios.get_io_service(0))
+		, m_connection_manager(ios)
+		, m_reuse_port(reuse_port)
 		, m_listening(false)
 		, m_timer(m_io_service)
+		, m_access_log(0)
+		, m_ssl_context(boost::asio::ssl::context::sslv23)
+		, m_tls(false)
 	{
-		m_ssl_context.set_options(boost::asio::ssl::context::default_workarounds| boost::asio::ssl::context::no_sslv2 | boost::asio::ssl::context::single_dh_use);
-		//m_ssl_context.set_password_callback(boost::bind(&server::get_password, this));
-		//m_ssl_context.use_certificate_chain_file("server.pem");
-		//m_ssl_context.use_private_key_file("server.pem", boost::asio::ssl::context::pem);
-		//m_ssl_context.use_tmp_dh_file("dh512.pem");
+		m_ssl_context.set_options(boost::asio::ssl::context::default_workarounds | boost::asio::ssl::context::no_sslv2
+			| boost::asio::ssl::context::no_sslv3 | boost::asio::ssl::context::no_compression
+			| boost::asio::ssl::context::single_dh_use);
 
+#ifndef SO_REUSEPORT
+		if (m_reuse_port)
+		{
+			LOG_WARN << "HTTP Server SO_REUSEPORT is not supported, use a single acceptor";
+			m_reuse_port = false;
+		}
+#endif
 
 		boost::asio::ip::tcp::resolver resolver(m_io_service);
 		std::ostringstream port_string;
@@ -34,66 +42,161 @@ namespace http {
 			return;
 		}
 		boost::asio::ip::tcp::endpoint endpoint = *endpoint_iterator;
-		m_acceptor.open(endpoint.protocol(), ignore_ec);
+
+		// 每个 io_service 一个 acceptor, 或者只在第一个 io_service 上 accept.
+		std::size_t count = m_reuse_port ? m_io_service_pool.size() : 1;
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			listener_ptr l = boost::make_shared<listener>(boost::ref(m_io_service_pool.get_io_service(i)), i);
+			if (!open_listener(*l, endpoint, m_reuse_port))
+			{
+				m_listeners.clear();
+				return;
+			}
+			m_listeners.push_back(l);
+		}
+
+		m_connection_manager.preallocate(HTTP_CONNECTION_PREALLOCATE, *this);
+
+		m_listening = true;
+		m_timer.expires_from_now(seconds(1));
+		m_timer.async_wait(boost::bind(&http_server::on_tick, this, boost::asio::placeholders::error));
+	}
+
+	http_server::~http_server()
+	{}
+
+	bool http_server::open_listener(listener& l, const boost::asio::ip::tcp::endpoint& endpoint, bool reuse_port)
+	{
+		boost::system::error_code ignore_ec;
+		l.acceptor.open(endpoint.protocol(), ignore_ec);
 		if (ignore_ec)
 		{
 			LOG_ERR << "HTTP Server open protocol failed: " << ignore_ec.message();
-			return;
+			return false;
 		}
-		m_acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true), ignore_ec);
+		l.acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true), ignore_ec);
 		if (ignore_ec)
 		{
 			LOG_ERR << "HTTP Server set option failed: " << ignore_ec.message();
-			return;
+			return false;
 		}
-		m_acceptor.bind(endpoint, ignore_ec);
+#ifdef SO_REUSEPORT
+		if (reuse_port)
+		{
+			typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port_option;
+			l.acceptor.set_option(reuse_port_option(true), ignore_ec);
+			if (ignore_ec)
+			{
+				LOG_ERR << "HTTP Server set SO_REUSEPORT failed: " << ignore_ec.message();
+				return false;
+			}
+		}
+#endif
+		l.acceptor.bind(endpoint, ignore_ec);
 		if (ignore_ec)
 		{
-			LOG_ERR << "HTTP Server bind failed: " << ignore_ec.message() << ", address: " << address;
-			return;
+			LOG_ERR << "HTTP Server bind failed: " << ignore_ec.message() << ", address: " << endpoint.address().to_string();
+			return false;
 		}
-		m_acceptor.listen(boost::asio::socket_base::max_connections, ignore_ec);
+		l.acceptor.listen(boost::asio::socket_base::max_connections, ignore_ec);
 		if (ignore_ec)
 		{
 			LOG_ERR << "HTTP Server listen failed: " << ignore_ec.message();
-			return;
+			return false;
 		}
-		m_listening = true;
-		m_timer.expires_from_now(seconds(1));
-		m_timer.async_wait(boost::bind(&http_server::on_tick, this, boost::asio::placeholders::error));
+		// handle_accept 里同步 accept 排队的连接时不能阻塞.
+		l.acceptor.non_blocking(true, ignore_ec);
+		if (ignore_ec)
+		{
+			LOG_ERR << "HTTP Server set non blocking failed: " << ignore_ec.message();
+			return false;
+		}
+		return true;
 	}
 
-	http_server::~http_server()
-	{}
-
 	void http_server::start()
 	{
 		if (!m_listening) return;
-		m_connection = boost::make_shared<http_connection>(boost::ref(m_io_service_pool.get_io_service()), boost::ref(*this), &m_connection_manager);
-		m_acceptor.async_accept(m_connection->socket(), boost::bind(&http_server::handle_accept, this, boost::asio::placeholders::error));
+		// acceptor 只在自己的 io_service 线程上使用.
+		for (std::size_t i = 0; i < m_listeners.size(); ++i)
+			m_io_service_pool.get_io_service(m_listeners[i]->io_service_index).post(
+				boost::bind(&http_server::start_accept, this, m_listeners[i]));
 	}
 
 	void http_server::stop()
 	{
-		m_acceptor.close();
+		for (std::size_t i = 0; i < m_listeners.size(); ++i)
+			m_io_service_pool.get_io_service(m_listeners[i]->io_service_index).post(
+				boost::bind(&http_server::close_listener, this, m_listeners[i]));
 		m_connection_manager.stop_all();
 		boost::system::error_code ignore_ec;
 		m_timer.cancel(ignore_ec);
 	}
 
-	void http_server::handle_accept(const boost::system::error_code& error)
+	void http_server::start_accept(listener_ptr l)
+	{
+		if (!l->connection)
+			l->connection = new_connection(*l);
+		l->acceptor.async_accept(l->connection->socket(),
+			boost::bind(&http_server::handle_accept, this, l, boost::asio::placeholders::error));
+	}
+
+	void http_server::close_listener(listener_ptr l)
+	{
+		boost::system::error_code ignore_ec;
+		l->acceptor.close(ignore_ec);
+	}
+
+	http_connection_ptr http_server::new_connection(const listener& l)
+	{
+		// SO_REUSEPORT 时连接留在 accept 它的线程上, 否则轮流分给各个 io_service.
+		std::size_t index = m_reuse_port ? l.io_service_index : m_io_service_pool.pick_io_service();
+		return m_connection_manager.create(index, *this);
+	}
+
+	void http_server::start_connection(http_connection_ptr conn)
+	{
+		// 在连接所属的 io_service 线程上启动连接.
+		if (m_reuse_port)
+			m_connection_manager.start(conn);
+		else
+			m_connection_manager.post_start(conn);
+	}
+
+	void http_server::handle_accept(listener_ptr l, const boost::system::error_code& error)
 	{
-		if (!m_acceptor.is_open() || error)
+		if (!l->acceptor.is_open() || error)
 		{
 			if (error)
 				LOG_ERR << "http_server::handle_accept, error: " << error.message();
+			l->connection.reset();
 			return;
 		}
 
-		m_connection_manager.start(m_connection);
+		http_connection_ptr conn;
+		conn.swap(l->connection);
+		start_connection(conn);
 
-		m_connection = boost::make_shared<http_connection>(boost::ref(m_io_service_pool.get_io_service()), boost::ref(*this), &m_connection_manager);
-		m_acceptor.async_accept(m_connection->socket(), boost::bind(&http_server::handle_accept, this, boost::asio::placeholders::error));
+		// 一次唤醒取走所有已经排队的连接, 直到没有连接或达到上限.
+		for (std::size_t i = 1; i < HTTP_ACCEPT_BATCH; ++i)
+		{
+			l->connection = new_connection(*l);
+			boost::system::error_code ec;
+			l->acceptor.accept(l->connection->socket(), ec);
+			if (ec)
+			{
+				if (ec != boost::asio::error::would_block && ec != boost::asio::error::try_again)
+					LOG_ERR << "http_server::handle_accept, accept error: " << ec.message();
+				break;
+			}
+			conn.reset();
+			conn.swap(l->connection);
+			start_connection(conn);
+		}
+
+		// 没用上的连接留给下一次 async_accept.
+		start_accept(l);
 	}
 
 	void http_server::on_tick(const boost::system::error_code& error)
@@ -106,28 +209,166 @@ namespace http {
 		m_timer.async_wait(boost::bind(&http_server::on_tick, this, boost::asio::placeholders::error));
 	}
 
-	bool http_server::handle_request(const request& req, http_connection_ptr conn)
+	const http_route* http_server::find_route(request& req) const
 	{
-		// 根据 URI 调用不同的处理.
-		const std::string& uri = req.uri;
-		boost::shared_lock<boost::shared_mutex> l(m_request_callback_mtx);
-		auto iter = m_http_request_callbacks.find(uri);
-		if (iter == m_http_request_callbacks.end())
+		// 根据 method 和 URI 找到对应的处理.
+		return m_router.find(req.method, req.uri, req.path_params);
+	}
+
+	void http_server::handle_request(const http_route& route, request& req, http_connection_ptr conn)
+	{
+		route.callback(req, conn, boost::ref(m_connection_manager));
+	}
+
+	void http_server::set_timeouts(const http_timeouts& timeouts)
+	{
+		m_timeouts = timeouts;
+	}
+
+	void http_server::set_access_log(access_log* log)
+	{
+		m_access_log = log;
+	}
+
+	bool http_server::add_metrics_handler(const std::string& uri)
+	{
+		if (!add_uri_handler("get", uri, boost::bind(&http_server::handle_metrics, this, _1, _2)))
 			return false;
-		iter->second(req, conn, boost::ref(m_connection_manager));
+		if (!m_metrics)
+			m_metrics.reset(new http_metrics(m_io_service_pool.size()));
+		return true;
+	}
+
+	void http_server::handle_metrics(const request&, http_connection_ptr conn)
+	{
+		std::string body;
+		body.reserve(16384);
+		m_metrics->render(body, m_router.routes(), m_connection_manager.size());
+
+		std::string head = "HTTP/1.1 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+		conn->write_response(head, body);
+	}
+
+	bool http_server::add_static_handler(const std::string& uri, const std::string& root,
+		const static_file_options& options)
+	{
+		// 文件的缓存按 io_service 分开, 处理函数必须在连接的线程上执行.
+		boost::shared_ptr<static_file_handler> handler =
+			boost::make_shared<static_file_handler>(root, m_io_service_pool.size(), options);
+		std::string pattern = uri;
+		if (pattern.empty() || pattern[pattern.size() - 1] != '/')
+			pattern += '/';
+		pattern += "*path";
+
+		http_request_callback cb = boost::bind(&static_file_handler::handle, handler, _1, _2);
+		return add_uri_handler("get", pattern, cb) && add_uri_handler("head", pattern, cb);
+	}
+
+	bool http_server::enable_tls(const http_tls_options& options)
+	{
+		boost::system::error_code ec;
+		m_ssl_context.use_certificate_chain_file(options.certificate_chain, ec);
+		if (ec)
+		{
+			LOG_ERR << "HTTP Server load certificate chain failed: " << ec.message() << ", file: " << options.certificate_chain;
+			return false;
+		}
+		m_ssl_context.use_private_key_file(options.private_key, boost::asio::ssl::context::pem, ec);
+		if (ec)
+		{
+			LOG_ERR << "HTTP Server load private key failed: " << ec.message() << ", file: " << options.private_key;
+			return false;
+		}
+		if (!options.dh_params.empty())
+		{
+			m_ssl_context.use_tmp_dh_file(options.dh_params, ec);
+			if (ec)
+			{
+				LOG_ERR << "HTTP Server load DH parameters failed: " << ec.message() << ", file: " << options.dh_params;
+				return false;
+			}
+		}
+
+		SSL_CTX* ctx = m_ssl_context.native_handle();
+		if (!SSL_CTX_check_private_key(ctx))
+		{
+			LOG_ERR << "HTTP Server private key does not match the certificate: " << options.private_key;
+			return false;
+		}
+		if (!options.ciphers.empty() && !SSL_CTX_set_cipher_list(ctx, options.ciphers.c_str()))
+		{
+			LOG_ERR << "HTTP Server invalid cipher list: " << options.ciphers;
+			return false;
+		}
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+		// OpenSSL 1.1 之前要指定曲线才会使用 ECDHE.
+		EC_KEY* ecdh = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+		if (ecdh)
+		{
+			SSL_CTX_set_tmp_ecdh(ctx, ecdh);
+			EC_KEY_free(ecdh);
+		}
+#endif
+
+		// 会话缓存在 SSL_CTX 中, 所有线程上的连接共用, 满了以后 OpenSSL 自动清除过期的会话.
+		// ticket 的密钥由 OpenSSL 为这个 SSL_CTX 随机生成, 进程重启后旧的 ticket 失效.
+		static const unsigned char session_id_context[] = "httpS";
+		SSL_CTX_set_session_id_context(ctx, session_id_context, sizeof(session_id_context) - 1);
+		if (options.session_cache_size)
+		{
+			SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+			SSL_CTX_sess_set_cache_size(ctx, static_cast<long>(options.session_cache_size));
+		}
+		else
+			SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+		SSL_CTX_set_timeout(ctx, static_cast<long>(options.session_timeout));
+		if (!options.session_tickets)
+			SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+
+		// 完整握手的非对称运算要几毫秒, 放到单独的线程上, 不耽误同一 io_service 上的请求.
+		if (options.handshake_threads)
+			m_handshake_executor.reset(new task_executor(options.handshake_threads));
+		m_tls = true;
 		return true;
 	}
 
 	bool http_server::add_uri_handler(const std::string& uri, http_request_callback cb)
 	{
-		boost::unique_lock<boost::shared_mutex> l(m_request_callback_mtx);
-		if (m_http_request_callbacks.find(uri) != m_http_request_callbacks.end())
+		return add_uri_handler("", uri, cb);
+	}
+
+	bool http_server::add_uri_handler(const std::string& method, const std::string& uri,
+		http_request_callback cb, const http_route_options& options)
+	{
+		if (options.executor)
+			cb = boost::bind(&http_server::post_request, options.executor, cb, _1, _2, _3);
+		if (!m_router.add(method, uri, cb, options))
 		{
 			BOOST_ASSERT("module already exist!" && false);
 			return false;
 		}
-		m_http_request_callbacks[uri] = cb;
 		return true;
 	}
 
+	void http_server::post_request(task_executor* executor, const http_request_callback& cb,
+		const request& req, http_connection_ptr conn, http_connection_manager& manager)
+	{
+		// 原请求在 arena 里, 处理函数返回后就会被下一个请求覆盖, 复制的请求分配在堆上.
+		boost::shared_ptr<const request> copy = boost::make_shared<request>(req);
+		executor->post(boost::bind(&http_server::run_request, cb, copy, conn, boost::ref(manager)));
+	}
+
+	void http_server::run_request(const http_request_callback& cb, boost::shared_ptr<const request> req,
+		http_connection_ptr conn, http_connection_manager& manager)
+	{
+		cb(*req, conn, manager);
+	}
+
+	bool http_server::add_uri_handler(const std::string& method, const std::string& uri, http_request_callback cb)
+	{
+		return add_uri_handler(method, uri, cb, http_route_options());
+	}
+
 }
@@ -1,15 +1,18 @@
 ﻿#include "include/io_service_pool.hpp"
+#include "include/cpu_topology.hpp"
 
 #include <stdexcept>
 #include <boost/thread/thread.hpp>
 #include <boost/bind.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
 
 
 namespace http {
 
-	io_service_pool::io_service_pool(std::size_t pool_size)
-		: next_io_service_(0)
+	io_service_pool::io_service_pool(std::size_t pool_size, placement_strategy strategy)
+		: placement_(strategy)
+		, next_io_service_(0)
 	{
 		if (pool_size == 0)
 			throw std::runtime_error("io_service_pool size is 0");
@@ -22,31 +25,50 @@ namespace http {
 			work_ptr work(new boost::asio::io_service::work(*io_service));
 			io_services_.push_back(io_service);
 			work_.push_back(work);
+			loads_.push_back(boost::make_shared<load_counters>());
 		}
 	}
 
+	bool io_service_pool::parse_placement(const std::string& name, placement_strategy& strategy)
+	{
+		if (name == "round-robin")
+			strategy = round_robin;
+		else if (name == "least-connections")
+			strategy = least_connections;
+		else if (name == "p2c")
+			strategy = power_of_two_choices;
+		else
+			return false;
+		return true;
+	}
+
+	void io_service_pool::set_cpus(const std::vector<int>& cpus)
+	{
+		cpus_ = cpus;
+	}
+
 	void io_service_pool::run()
 	{
+		if (cpus_.empty())
+			cpus_ = cpu_topology::detect().layout();
+
+		// 只有一个 io_service 时在调用者的线程上运行, 不绑定 CPU, 否则之后
+		// 这个线程创建的线程都会继承它的亲和性.
 		if (io_services_.size() ==  1)
 		{
 			io_services_[0]->run();
 			return;
 		}
-		// Create a pool of threads to run all of the io_services.
+		// Create a pool of threads to run all of the io_services. Each thread
+		// pins itself before running, so that everything it allocates and
+		// touches first is placed on its own NUMA node. Threads beyond the CPU
+		// list are left unpinned rather than stacked onto CPUs already taken.
 		std::vector<boost::shared_ptr<boost::thread> > threads;
 		for (std::size_t i = 0; i < io_services_.size(); ++i)
 		{
+			int cpu = i < cpus_.size() ? cpus_[i] : -1;
 			boost::shared_ptr<boost::thread> thread(new boost::thread(
-				boost::bind(&boost::asio::io_service::run, io_services_[i])));
-#ifdef _GNU_SOURCE
-			cpu_set_t mask;
-			CPU_ZERO(&mask);
-			CPU_SET(i, &mask);
-			pthread_setaffinity_np(thread->native_handle(), sizeof(mask), &mask);
-#endif
-#ifdef BOOST_THREAD_PLATFORM_WIN32
-			SetThreadAffinityMask(thread->native_handle(), 1UL<<i);
-#endif
+				boost::bind(&io_service_pool::run_thread, this, i, cpu)));
 			threads.push_back(thread);
 		}
 
@@ -55,6 +77,24 @@ namespace http {
 			threads[i]->join();
 	}
 
+	void io_service_pool::run_thread(std::size_t index, int cpu)
+	{
+#ifdef _GNU_SOURCE
+		if (cpu >= 0 && cpu < CPU_SETSIZE)
+		{
+			cpu_set_t mask;
+			CPU_ZERO(&mask);
+			CPU_SET(cpu, &mask);
+			pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+		}
+#endif
+#ifdef BOOST_THREAD_PLATFORM_WIN32
+		if (cpu >= 0 && cpu < 64)
+			SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu);
+#endif
+		io_services_[index]->run();
+	}
+
 	void io_service_pool::stop()
 	{
 		// Explicitly stop all io_services.
@@ -64,10 +104,79 @@ namespace http {
 
 	boost::asio::io_service& io_service_pool::get_io_service()
 	{
-		// Use a round-robin scheme to choose the next io_service to use.
-		boost::asio::io_service& io_service = *io_services_[next_io_service_];
-		next_io_service_ = (next_io_service_ + 1) % io_services_.size();
-		return io_service;
+		return *io_services_[pick_io_service()];
+	}
+
+	std::size_t io_service_pool::pick_io_service()
+	{
+		const std::size_t size = io_services_.size();
+		std::size_t n = next_io_service_.fetch_add(1, boost::memory_order_relaxed);
+		if (size == 1)
+			return 0;
+
+		switch (placement_)
+		{
+		case least_connections:
+			{
+				// 连接数相同时从轮转的位置开始找, 不总是偏向第一个.
+				std::size_t best = n % size;
+				std::size_t best_count = loads_[best]->connections.load(boost::memory_order_relaxed);
+				for (std::size_t i = 1; i < size && best_count != 0; ++i)
+				{
+					std::size_t index = (n + i) % size;
+					std::size_t count = loads_[index]->connections.load(boost::memory_order_relaxed);
+					if (count < best_count)
+					{
+						best = index;
+						best_count = count;
+					}
+				}
+				return best;
+			}
+		case power_of_two_choices:
+			{
+				// 用 splitmix64 把计数器打散成两个不同的随机位置, 不需要加锁的随机数发生器.
+				boost::uint64_t x = static_cast<boost::uint64_t>(n) * 0x9E3779B97F4A7C15ULL;
+				x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+				x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+				x ^= x >> 31;
+				std::size_t a = static_cast<std::size_t>(x % size);
+				std::size_t b = static_cast<std::size_t>((a + 1 + (x >> 32) % (size - 1)) % size);
+				const load_counters& la = *loads_[a];
+				const load_counters& lb = *loads_[b];
+				std::size_t load_a = la.connections.load(boost::memory_order_relaxed) + la.requests.load(boost::memory_order_relaxed);
+				std::size_t load_b = lb.connections.load(boost::memory_order_relaxed) + lb.requests.load(boost::memory_order_relaxed);
+				return load_b < load_a ? b : a;
+			}
+		default:
+			// Use a round-robin scheme to choose the next io_service to use.
+			return n % size;
+		}
+	}
+
+	boost::asio::io_service& io_service_pool::get_io_service(std::size_t index)
+	{
+		return *io_services_[index];
+	}
+
+	std::size_t io_service_pool::size() const
+	{
+		return io_services_.size();
+	}
+
+	io_service_pool::placement_strategy io_service_pool::placement() const
+	{
+		return placement_;
+	}
+
+	io_service_pool::load_counters& io_service_pool::load(std::size_t index)
+	{
+		return *loads_[index];
+	}
+
+	const io_service_pool::load_counters& io_service_pool::load(std::size_t index) const
+	{
+		return *loads_[index];
 	}
 
 }
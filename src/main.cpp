@@ -4,6 +4,7 @@
 namespace po = boost::program_options;
 
 #include "include/io_service_pool.hpp"
+#include "include/cpu_topology.hpp"
 #include "include/http_server.hpp"
 
 using namespace http;
@@ -17,6 +18,17 @@ int main(int argc, char** argv)
 		int num_threads = 0;
 		int pool_size = 0;
 
+		http_timeouts timeouts;
+		bool reuse_port = false;
+		std::string placement;
+		std::string cpus;
+		std::string access_log_dir;
+		std::string metrics_uri;
+		std::string static_root;
+		std::string static_uri;
+		static_file_options static_options;
+		http_tls_options tls_options;
+
 		int db_port = 0;
 		std::string db_host;
 		std::string db_user_name;
@@ -30,6 +42,25 @@ int main(int argc, char** argv)
 			("httpport", po::value<unsigned short>(&http_port)->default_value(80), "http RPC listen port")
 			("thread", po::value<int>(&num_threads)->default_value(boost::thread::hardware_concurrency()), "threads")
 			("pool", po::value<int>(&pool_size)->default_value(8), "connection pool size")
+			("cpus", po::value<std::string>(&cpus), "CPUs to run the threads on, a list like 0-3,8 or a mask like 0xff")
+			("reuseport", po::bool_switch(&reuse_port), "one SO_REUSEPORT acceptor per thread")
+			("placement", po::value<std::string>(&placement)->default_value("round-robin"), "connection placement: round-robin, least-connections or p2c")
+
+			("header_timeout", po::value<std::size_t>(&timeouts.header_read)->default_value(timeouts.header_read), "seconds to receive request headers, 0 to disable")
+			("body_timeout", po::value<std::size_t>(&timeouts.body_read)->default_value(timeouts.body_read), "seconds to receive a request body, 0 to disable")
+			("keepalive_timeout", po::value<std::size_t>(&timeouts.keep_alive)->default_value(timeouts.keep_alive), "seconds a keep-alive connection may stay idle, 0 to disable")
+			("write_timeout", po::value<std::size_t>(&timeouts.write)->default_value(timeouts.write), "seconds to write a batch of responses, 0 to disable")
+			("response_timeout", po::value<std::size_t>(&timeouts.response)->default_value(timeouts.response), "seconds a handler may take to reply after it returns, 0 to disable")
+			("metrics", po::value<std::string>(&metrics_uri), "URI to serve metrics on in the Prometheus text format, e.g. /metrics")
+			("access_log", po::value<std::string>(&access_log_dir), "directory for the binary access log, see tools/access_log_decode")
+			("static_root", po::value<std::string>(&static_root), "directory to serve static files from")
+			("static_uri", po::value<std::string>(&static_uri)->default_value("/static"), "URI prefix of the static files")
+			("static_max_age", po::value<std::size_t>(&static_options.max_age)->default_value(0), "Cache-Control max-age of static files in seconds, 0 to omit")
+			("static_follow_symlinks", po::value<bool>(&static_options.follow_symlinks)->default_value(false), "serve symbolic links that point outside the static root")
+			("tls_cert", po::value<std::string>(&tls_options.certificate_chain), "PEM certificate chain, serve HTTPS instead of HTTP")
+			("tls_key", po::value<std::string>(&tls_options.private_key), "PEM private key of the certificate")
+			("tls_handshake_threads", po::value<std::size_t>(&tls_options.handshake_threads)->default_value(tls_options.handshake_threads), "threads to run TLS handshakes on, 0 to run them on the io threads")
+			("tls_session_tickets", po::value<bool>(&tls_options.session_tickets)->default_value(tls_options.session_tickets), "issue TLS session tickets")
 
 			("db_host", po::value<std::string>(&db_host)->default_value("tcp://192.168.1.254:3306/zhushou_test"), "connection data base host")
 			("db_user_name", po::value<std::string>(&db_user_name)->default_value("root"), "connection data base user name")
@@ -48,13 +79,56 @@ int main(int argc, char** argv)
 
 
 
+		io_service_pool::placement_strategy strategy;
+		if (!io_service_pool::parse_placement(placement, strategy))
+		{
+			std::cerr << "unknown placement: " << placement << "\n";
+			return -1;
+		}
+
 		// 指定线程并发数.
-		io_service_pool io_pool(num_threads);
+		io_service_pool io_pool(num_threads, strategy);
+		if (!cpus.empty())
+		{
+			std::vector<int> cpu_list;
+			if (!cpu_topology::parse_cpu_list(cpus, cpu_list))
+			{
+				std::cerr << "invalid cpu list: " << cpus << "\n";
+				return -1;
+			}
+			io_pool.set_cpus(cpu_topology::detect().layout(cpu_list));
+		}
+		// 访问日志每个 io_service 一组文件, 要比 http 服务器活得久.
+		boost::scoped_ptr<access_log> access(access_log_dir.empty() ? 0 : new access_log(access_log_dir, io_pool.size()));
+
 		// 创建 http 服务器.
-		http_server http_serv(io_pool, http_port);
+		http_server http_serv(io_pool, http_port, "127.0.0.1", reuse_port);
+		http_serv.set_timeouts(timeouts);
+		http_serv.set_access_log(access.get());
+		if (!metrics_uri.empty() && !http_serv.add_metrics_handler(metrics_uri))
+		{
+			std::cerr << "invalid metrics uri: " << metrics_uri << "\n";
+			return -1;
+		}
+		if (!static_root.empty() && !http_serv.add_static_handler(static_uri, static_root, static_options))
+		{
+			std::cerr << "invalid static uri: " << static_uri << "\n";
+			return -1;
+		}
+		if (!tls_options.certificate_chain.empty())
+		{
+			if (tls_options.private_key.empty())
+				tls_options.private_key = tls_options.certificate_chain;
+			if (!http_serv.enable_tls(tls_options))
+			{
+				std::cerr << "can not enable TLS with " << tls_options.certificate_chain << "\n";
+				return -1;
+			}
+		}
 
-		http_serv.add_uri_handler("/test", [](const request&, http_connection_ptr, http_connection_manager&){
+		http_serv.add_uri_handler("/test", [](const request&, http_connection_ptr conn, http_connection_manager&){
 			printf("接收到一个请求(%d)\n", GetCurrentThreadId());
+			conn->write_response("{\"ok\":1}");
 		});
 
 		// 启动 HTTPD.
@@ -0,0 +1,472 @@
+﻿#include "include/static_file.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <boost/filesystem.hpp>
+#include <boost/make_shared.hpp>
+
+#ifndef _WIN32
+#	include <sys/stat.h>
+#endif
+
+#include "include/coarse_clock.hpp"
+#include "include/escape_string.hpp"
+#include "include/http_connection.hpp"
+#include "include/logging.hpp"
+
+namespace http {
+
+	namespace {
+
+		struct mime_entry
+		{
+			const char* extension;
+			const char* type;
+		};
+
+		// 按扩展名排序, 用二分查找. 扩展名都是小写, 不超过 mime_extension_max 个字符.
+		const mime_entry mime_types[] =
+		{
+			{ "avif", "image/avif" },
+			{ "bmp", "image/bmp" },
+			{ "css", "text/css; charset=utf-8" },
+			{ "csv", "text/csv; charset=utf-8" },
+			{ "gif", "image/gif" },
+			{ "gz", "application/gzip" },
+			{ "htm", "text/html; charset=utf-8" },
+			{ "html", "text/html; charset=utf-8" },
+			{ "ico", "image/x-icon" },
+			{ "jpeg", "image/jpeg" },
+			{ "jpg", "image/jpeg" },
+			{ "js", "application/javascript; charset=utf-8" },
+			{ "json", "application/json" },
+			{ "map", "application/json" },
+			{ "mjs", "application/javascript; charset=utf-8" },
+			{ "mp3", "audio/mpeg" },
+			{ "mp4", "video/mp4" },
+			{ "ogg", "audio/ogg" },
+			{ "otf", "font/otf" },
+			{ "pdf", "application/pdf" },
+			{ "png", "image/png" },
+			{ "svg", "image/svg+xml" },
+			{ "tar", "application/x-tar" },
+			{ "ttf", "font/ttf" },
+			{ "txt", "text/plain; charset=utf-8" },
+			{ "wasm", "application/wasm" },
+			{ "webm", "video/webm" },
+			{ "webp", "image/webp" },
+			{ "woff", "font/woff" },
+			{ "woff2", "font/woff2" },
+			{ "xml", "application/xml" },
+			{ "zip", "application/zip" }
+		};
+		const std::size_t mime_extension_max = 8;
+		const char* const mime_default = "application/octet-stream";
+
+		bool mime_less(const mime_entry& entry, const char* extension)
+		{
+			return std::strcmp(entry.extension, extension) < 0;
+		}
+
+		bool stat_file(const std::string& path, static_file_info& info)
+		{
+#ifndef _WIN32
+			struct stat st;
+			if (::stat(path.c_str(), &st) != 0)
+				return false;
+			info.size = static_cast<boost::uint64_t>(st.st_size);
+			info.mtime = st.st_mtime;
+			info.id = static_cast<boost::uint64_t>(st.st_ino);
+			info.regular = S_ISREG(st.st_mode);
+			info.directory = S_ISDIR(st.st_mode);
+#else
+			boost::system::error_code ec;
+			boost::filesystem::file_status status = boost::filesystem::status(path, ec);
+			if (ec)
+				return false;
+			info.regular = boost::filesystem::is_regular_file(status);
+			info.directory = boost::filesystem::is_directory(status);
+			info.size = info.regular ? boost::filesystem::file_size(path, ec) : 0;
+			info.mtime = boost::filesystem::last_write_time(path, ec);
+			info.id = 0;
+			if (ec)
+				return false;
+#endif
+			return true;
+		}
+
+		enum range_result
+		{
+			range_ignore,			// 没有 Range, 或者不支持的格式, 回复整个文件.
+			range_ok,
+			range_unsatisfiable
+		};
+
+		bool parse_number(boost::string_ref text, boost::uint64_t& value)
+		{
+			if (text.empty() || text.size() > 18)
+				return false;
+			value = 0;
+			for (std::size_t i = 0; i < text.size(); ++i)
+			{
+				if (text[i] < '0' || text[i] > '9')
+					return false;
+				value = value * 10 + (text[i] - '0');
+			}
+			return true;
+		}
+
+		// 只支持一个区间: "bytes=first-last", "bytes=first-" 和 "bytes=-suffix".
+		range_result parse_range(boost::string_ref value, boost::uint64_t size,
+			boost::uint64_t& first, boost::uint64_t& last)
+		{
+			if (value.size() < 6 || value.substr(0, 6) != "bytes=")
+				return range_ignore;
+			value.remove_prefix(6);
+			if (value.find(',') != boost::string_ref::npos)
+				return range_ignore;
+			std::size_t dash = value.find('-');
+			if (dash == boost::string_ref::npos)
+				return range_ignore;
+
+			boost::string_ref from = value.substr(0, dash);
+			boost::string_ref to = value.substr(dash + 1);
+			boost::uint64_t n;
+			if (from.empty())
+			{
+				if (!parse_number(to, n))
+					return range_ignore;
+				if (n == 0 || size == 0)
+					return range_unsatisfiable;
+				first = n < size ? size - n : 0;
+				last = size - 1;
+				return range_ok;
+			}
+
+			if (!parse_number(from, first))
+				return range_ignore;
+			last = size - 1;
+			if (!to.empty())
+			{
+				if (!parse_number(to, n) || n < first)
+					return range_ignore;
+				last = (std::min)(n, last);
+			}
+			if (first >= size)
+				return range_unsatisfiable;
+			return range_ok;
+		}
+
+		void write_status(http_connection_ptr& conn, const char* head)
+		{
+			conn->write_response(head, std::string());
+		}
+	}
+
+	static_file::static_file(const std::string& path, const static_file_info& info)
+		: m_path(path)
+		, m_info(info)
+		, m_mime_type(static_file_handler::mime_type(path))
+		, m_mapping(path.c_str(), boost::interprocess::read_only)
+		, m_mapped(false)
+	{
+		// 与 nginx 相同的 ETag: 修改时间和大小.
+		char etag[48];
+		std::sprintf(etag, "\"%llx-%llx\"", static_cast<unsigned long long>(info.mtime),
+			static_cast<unsigned long long>(info.size));
+		m_etag = etag;
+		char date[coarse_clock::http_date_size + 1];
+		coarse_clock::format_http_date(info.mtime, date);
+		m_last_modified = date;
+	}
+
+	const char* static_file::data() const
+	{
+		if (!m_mapped && m_info.size)
+		{
+			m_mapped = true;
+			try
+			{
+				boost::interprocess::mapped_region region(m_mapping, boost::interprocess::read_only,
+					0, static_cast<std::size_t>(m_info.size));
+				m_region.swap(region);
+			}
+			catch (boost::interprocess::interprocess_exception& e)
+			{
+				LOG_ERR << "static_file::data, " << m_path << ": " << e.what();
+			}
+		}
+		return static_cast<const char*>(m_region.get_address());
+	}
+
+	static_file_handler::static_file_handler(const std::string& root, std::size_t shards,
+		const static_file_options& options)
+		: m_options(options)
+	{
+		boost::system::error_code ec;
+		boost::filesystem::path path = boost::filesystem::canonical(root, ec);
+		if (ec || !boost::filesystem::is_directory(path))
+			throw std::runtime_error("static file root is not a directory: " + root);
+		m_root = path.string();
+
+		if (m_options.cache_entries == 0)
+			m_options.cache_entries = 1;
+		for (std::size_t i = 0; i < shards; ++i)
+			m_caches.push_back(boost::make_shared<cache>());
+	}
+
+	bool static_file_handler::resolve_path(boost::string_ref encoded, std::string& relative, bool hidden)
+	{
+		// 路径中的 '+' 不是空格.
+		std::string decoded;
+		if (!detail::unescape_path(encoded, decoded, false))
+			return false;
+
+		// 逐段检查解码后的路径: 去掉空段和 ".", 拒绝 "..", 默认也拒绝隐藏文件.
+		relative.clear();
+		std::size_t begin = 0;
+		while (begin <= decoded.size())
+		{
+			std::size_t end = decoded.find('/', begin);
+			if (end == std::string::npos)
+				end = decoded.size();
+			boost::string_ref segment(decoded.data() + begin, end - begin);
+			begin = end + 1;
+
+			if (segment.empty() || segment == ".")
+				continue;
+			if (segment == "..")
+				return false;
+			if (segment[0] == '.' && !hidden)
+				return false;
+			if (!relative.empty())
+				relative += '/';
+			relative.append(segment.data(), segment.size());
+		}
+
+		// %00 会截断系统调用看到的路径, '\\' 在 Windows 上是分隔符, ':' 是盘符和数据流.
+		for (std::size_t i = 0; i < relative.size(); ++i)
+		{
+			char c = relative[i];
+			if (c == '\0' || c == '\\')
+				return false;
+#ifdef _WIN32
+			if (c == ':')
+				return false;
+#endif
+		}
+		return true;
+	}
+
+	const char* static_file_handler::mime_type(boost::string_ref path)
+	{
+		std::size_t dot = path.rfind('.');
+		std::size_t slash = path.rfind('/');
+		if (dot == boost::string_ref::npos || (slash != boost::string_ref::npos && dot < slash))
+			return mime_default;
+		boost::string_ref extension = path.substr(dot + 1);
+		if (extension.empty() || extension.size() > mime_extension_max)
+			return mime_default;
+
+		char lower[mime_extension_max + 1];
+		for (std::size_t i = 0; i < extension.size(); ++i)
+			lower[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(extension[i])));
+		lower[extension.size()] = 0;
+
+		const mime_entry* end = mime_types + sizeof(mime_types) / sizeof(mime_types[0]);
+		const mime_entry* i = std::lower_bound(mime_types, end, lower, mime_less);
+		if (i != end && std::strcmp(i->extension, lower) == 0)
+			return i->type;
+		return mime_default;
+	}
+
+	bool static_file_handler::stat_path(const std::string& relative, std::string& path, static_file_info& info) const
+	{
+		path = m_root;
+		if (!relative.empty())
+		{
+			path += '/';
+			path += relative;
+		}
+		if (!stat_file(path, info))
+			return false;
+		if (info.directory && !m_options.index.empty())
+		{
+			path += '/';
+			path += m_options.index;
+			if (!stat_file(path, info))
+				return false;
+		}
+		if (!info.regular)
+			return false;
+		return m_options.follow_symlinks || resolve_inside_root(path);
+	}
+
+	bool static_file_handler::resolve_inside_root(std::string& path) const
+	{
+		// 解析掉所有符号链接后必须还在根目录下, 之后打开解析后的路径.
+		boost::system::error_code ec;
+		boost::filesystem::path real = boost::filesystem::canonical(path, ec);
+		if (ec)
+			return false;
+		boost::filesystem::path root(m_root);
+		boost::filesystem::path::const_iterator r = root.begin();
+		boost::filesystem::path::const_iterator p = real.begin();
+		for (; r != root.end(); ++r, ++p)
+		{
+			if (p == real.end() || *p != *r)
+			{
+				LOG_WARN << "static_file_handler, " << path << " resolves outside the root: " << real.string();
+				return false;
+			}
+		}
+		path = real.string();
+		return true;
+	}
+
+	static_file_ptr static_file_handler::open(std::size_t shard, const std::string& relative)
+	{
+		cache& c = *m_caches[shard];
+		std::time_t now = coarse_clock::unix_time();
+
+		boost::unordered_map<std::string, lru_list::iterator>::iterator i = c.index.find(relative);
+		if (i != c.index.end())
+		{
+			lru_list::iterator e = i->second;
+			c.lru.splice(c.lru.begin(), c.lru, e);
+			if (now - e->checked < static_cast<std::time_t>(m_options.revalidate))
+				return e->file;
+
+			// 过期了, 文件没有变化时继续使用已经打开的.
+			static_file_info info;
+			if (stat_file(e->file->path(), info) && info == e->file->info())
+			{
+				e->checked = now;
+				return e->file;
+			}
+			c.index.erase(i);
+			c.lru.erase(e);
+		}
+
+		std::string path;
+		static_file_info info;
+		if (!stat_path(relative, path, info))
+			return static_file_ptr();
+
+		static_file_ptr file;
+		try
+		{
+			file = boost::make_shared<static_file>(path, info);
+		}
+		catch (boost::interprocess::interprocess_exception& e)
+		{
+			LOG_ERR << "static_file_handler::open, " << path << ": " << e.what();
+			return static_file_ptr();
+		}
+
+		entry item;
+		item.relative = relative;
+		item.file = file;
+		item.checked = now;
+		c.lru.push_front(item);
+		c.index[relative] = c.lru.begin();
+		if (c.lru.size() > m_options.cache_entries)
+		{
+			c.index.erase(c.lru.back().relative);
+			c.lru.pop_back();
+		}
+		return file;
+	}
+
+	void static_file_handler::handle(const request& req, http_connection_ptr conn)
+	{
+		std::string relative;
+		if (req.path_params.empty() || !resolve_path(boost::string_ref(req.path_params.back().second.data(),
+			req.path_params.back().second.size()), relative, m_options.hidden))
+		{
+			write_status(conn, "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n");
+			return;
+		}
+
+		static_file_ptr file = open(conn->shard(), relative);
+#if !HTTP_USE_SENDFILE
+		// 没有 sendfile 时从映射中写出, 映射失败就不能回复这个文件.
+		if (file && file->size() && !file->data())
+			file.reset();
+#endif
+		if (!file)
+		{
+			write_status(conn, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+			return;
+		}
+
+		// 先看 If-None-Match, 没有时才看 If-Modified-Since, 后者要求与 Last-Modified 完全相同.
+		boost::string_ref condition = req[header_if_none_match];
+		bool not_modified = false;
+		if (!condition.empty())
+			not_modified = condition == "*" || condition.find(file->etag()) != boost::string_ref::npos;
+		else
+			not_modified = req[header_if_modified_since] == file->last_modified();
+
+		boost::uint64_t size = file->size();
+		boost::uint64_t first = 0, last = size ? size - 1 : 0;
+		range_result range = range_ignore;
+		boost::string_ref range_value = req[header_range];
+		if (!not_modified && !range_value.empty())
+		{
+			// If-Range 不匹配时文件已经变了, 回复整个文件.
+			boost::string_ref if_range = req[header_if_range];
+			if (if_range.empty() || if_range == file->etag() || if_range == file->last_modified())
+				range = parse_range(range_value, size, first, last);
+		}
+
+		std::string head;
+		head.reserve(256);
+		if (not_modified)
+			head = "HTTP/1.1 304 Not Modified\r\n";
+		else if (range == range_ok)
+			head = "HTTP/1.1 206 Partial Content\r\n";
+		else if (range == range_unsatisfiable)
+			head = "HTTP/1.1 416 Range Not Satisfiable\r\n";
+		else
+			head = "HTTP/1.1 200 OK\r\n";
+
+		boost::uint64_t length = 0;
+		if (range == range_ok)
+			length = last - first + 1;
+		else if (!not_modified && range != range_unsatisfiable)
+			length = size;
+
+		head += "ETag: ";
+		head += file->etag();
+		head += "\r\nLast-Modified: ";
+		head += file->last_modified();
+		head += "\r\n";
+		if (m_options.max_age)
+			head += "Cache-Control: max-age=" + std::to_string(m_options.max_age) + "\r\n";
+		if (!not_modified)
+		{
+			head += "Content-Type: ";
+			head += range == range_unsatisfiable ? "text/plain" : file->mime_type();
+			head += "\r\nAccept-Ranges: bytes\r\nContent-Length: ";
+			head += std::to_string(length);
+			head += "\r\n";
+		}
+		if (range == range_ok)
+			head += "Content-Range: bytes " + std::to_string(first) + "-" + std::to_string(last) + "/" + std::to_string(size) + "\r\n";
+		else if (range == range_unsatisfiable)
+			head += "Content-Range: bytes */" + std::to_string(size) + "\r\n";
+		head += "\r\n";
+
+		// HEAD 只回复协议头.
+		if (req.method == "head" || length == 0)
+			conn->write_response(head, std::string());
+		else
+			conn->write_file(head, file, first, length);
+	}
+
+}
@@ -0,0 +1,112 @@
+﻿#include "include/task_executor.hpp"
+
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+
+namespace http {
+
+	task_executor::task_executor(std::size_t threads)
+		: m_next(0)
+		, m_pending(0)
+		, m_sleeping(0)
+		, m_stopped(false)
+	{
+		if (threads == 0)
+			threads = 1;
+		for (std::size_t i = 0; i < threads; ++i)
+			m_workers.push_back(boost::make_shared<worker>());
+		for (std::size_t i = 0; i < threads; ++i)
+			m_threads.create_thread(boost::bind(&task_executor::run, this, i));
+	}
+
+	task_executor::~task_executor()
+	{
+		stop();
+	}
+
+	void task_executor::post(const task& t)
+	{
+		if (m_stopped.load(boost::memory_order_relaxed))
+			return;
+
+		// 先计数再入队, 取走任务时的减一不会先于这里的加一.
+		m_pending.fetch_add(1);
+		std::size_t index = m_next.fetch_add(1, boost::memory_order_relaxed) % m_workers.size();
+		{
+			boost::mutex::scoped_lock l(m_workers[index]->mutex);
+			m_workers[index]->tasks.push_back(t);
+		}
+
+		// 只有在有 worker 睡眠时才需要唤醒, 避免每次 post 都去争 m_idle_mutex.
+		if (m_sleeping.load() != 0)
+		{
+			boost::mutex::scoped_lock l(m_idle_mutex);
+			m_idle.notify_one();
+		}
+	}
+
+	void task_executor::stop()
+	{
+		{
+			boost::mutex::scoped_lock l(m_idle_mutex);
+			if (m_stopped.exchange(true))
+				return;
+			m_idle.notify_all();
+		}
+		m_threads.join_all();
+	}
+
+	std::size_t task_executor::size() const
+	{
+		return m_workers.size();
+	}
+
+	bool task_executor::pop(std::size_t index, task& t)
+	{
+		// 先取自己队列的头部, 再从其它队列的尾部偷.
+		for (std::size_t i = 0; i < m_workers.size(); ++i)
+		{
+			worker& w = *m_workers[(index + i) % m_workers.size()];
+			boost::mutex::scoped_lock l(w.mutex);
+			if (w.tasks.empty())
+				continue;
+			if (i == 0)
+			{
+				t.swap(w.tasks.front());
+				w.tasks.pop_front();
+			}
+			else
+			{
+				t.swap(w.tasks.back());
+				w.tasks.pop_back();
+			}
+			m_pending.fetch_sub(1);
+			return true;
+		}
+		return false;
+	}
+
+	void task_executor::run(std::size_t index)
+	{
+		task t;
+		for (;;)
+		{
+			if (pop(index, t))
+			{
+				t();
+				t.clear();
+				continue;
+			}
+
+			boost::mutex::scoped_lock l(m_idle_mutex);
+			m_sleeping.fetch_add(1);
+			// 登记睡眠之后再检查一次, post 要么看到 m_sleeping, 要么它的任务在这里被看到.
+			while (m_pending.load() == 0 && !m_stopped.load())
+				m_idle.wait(l);
+			m_sleeping.fetch_sub(1);
+			if (m_pending.load() == 0 && m_stopped.load())
+				return;
+		}
+	}
+
+}
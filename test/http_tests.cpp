@@ -0,0 +1,851 @@
+﻿//
+// Copyright (C) 2013 Jack.
+//
+// Author: jack
+// Email:  jack.wgm@gmail.com
+//
+
+// 单元测试, 用 Boost.Test 的单头文件版本, 不需要另外链接测试库.
+// 需要服务器的用例在本机回环地址上启动一个 http_server.
+
+#define BOOST_TEST_MODULE http_tests
+#include <boost/test/included/unit_test.hpp>
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+#include "include/chunked_decoder.hpp"
+#include "include/cpu_topology.hpp"
+#include "include/header_index.hpp"
+#include "include/http_router.hpp"
+#include "include/http_server.hpp"
+#include "include/multipart.hpp"
+#include "include/url_decode.hpp"
+
+using namespace http;
+
+namespace {
+
+	const unsigned short test_port = 18181;
+
+	// 在后台线程上运行的 http_server, 析构时停止.
+	struct test_server
+	{
+		test_server()
+			: pool(1)
+			, server(pool, test_port, "127.0.0.1")
+		{}
+
+		void start()
+		{
+			server.start();
+			thread = boost::thread(boost::bind(&io_service_pool::run, &pool));
+		}
+
+		~test_server()
+		{
+			server.stop();
+			pool.stop();
+			if (thread.joinable())
+				thread.join();
+		}
+
+		io_service_pool pool;
+		http_server server;
+		boost::thread thread;
+	};
+
+	// 收到 terminator 或者超时为止.
+	struct client
+	{
+		client()
+			: socket(io)
+			, timer(io)
+			, timed_out(false)
+		{}
+
+		std::string fetch(const std::string& request, const std::string& terminator, int seconds = 3)
+		{
+			socket.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), test_port));
+			boost::asio::write(socket, boost::asio::buffer(request));
+			timer.expires_from_now(boost::posix_time::seconds(seconds));
+			timer.async_wait(boost::bind(&client::handle_timeout, this, boost::asio::placeholders::error));
+			boost::asio::async_read_until(socket, response, terminator,
+				boost::bind(&client::handle_read, this, boost::asio::placeholders::error));
+			io.run();
+			std::string data(boost::asio::buffers_begin(response.data()), boost::asio::buffers_end(response.data()));
+			return timed_out ? std::string() : data;
+		}
+
+		void handle_timeout(const boost::system::error_code& ec)
+		{
+			if (ec)
+				return;
+			timed_out = true;
+			boost::system::error_code ignore_ec;
+			socket.close(ignore_ec);
+		}
+
+		void handle_read(const boost::system::error_code&)
+		{
+			timer.cancel();
+		}
+
+		boost::asio::io_service io;
+		boost::asio::ip::tcp::socket socket;
+		boost::asio::deadline_timer timer;
+		boost::asio::streambuf response;
+		bool timed_out;
+	};
+
+	// tribool 的比较结果还是 tribool, 检查时先转成 bool.
+	bool is_true(boost::tribool t) { return t ? true : false; }
+	bool is_false(boost::tribool t) { return !t ? true : false; }
+
+	const char get_stream[] = "GET /stream HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+	const char last_chunk[] = "0\r\n\r\n";
+
+}
+
+BOOST_AUTO_TEST_SUITE(chunked)
+
+// 连接空闲时只写一个空的分段, 它的 handler 也要被调用.
+BOOST_AUTO_TEST_CASE(empty_piece_on_idle_connection)
+{
+	test_server s;
+	s.server.add_uri_handler("/stream", [](const request&, http_connection_ptr conn, http_connection_manager&)
+	{
+		chunked_response_ptr c = conn->write_chunked();
+		c->write(std::string(), [c]()
+		{
+			c->write("done");
+			c->finish();
+		});
+	});
+	s.start();
+
+	client cl;
+	std::string response = cl.fetch(get_stream, last_chunk);
+	BOOST_REQUIRE(!response.empty());
+	BOOST_CHECK(response.find("Transfer-Encoding: chunked") != std::string::npos);
+	BOOST_CHECK(response.find("\r\n\r\n4\r\ndone\r\n0\r\n\r\n") != std::string::npos);
+}
+
+// 空的分段排在数据之后, 数据写出后调用 handler.
+BOOST_AUTO_TEST_CASE(empty_piece_after_data)
+{
+	test_server s;
+	s.server.add_uri_handler("/stream", [](const request&, http_connection_ptr conn, http_connection_manager&)
+	{
+		chunked_response_ptr c = conn->write_chunked();
+		c->write("abc");
+		c->write(std::string(), [c]()
+		{
+			c->write(std::string(), [c]()
+			{
+				c->write("de");
+				c->finish();
+			});
+		});
+	});
+	s.start();
+
+	client cl;
+	std::string response = cl.fetch(get_stream, last_chunk);
+	BOOST_REQUIRE(!response.empty());
+	BOOST_CHECK(response.find("\r\n\r\n3\r\nabc\r\n2\r\nde\r\n0\r\n\r\n") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(static_files)
+
+// 指向根目录以外的符号链接默认不提供, 根目录内的可以.
+BOOST_AUTO_TEST_CASE(symlinks_stay_inside_root)
+{
+	namespace fs = boost::filesystem;
+	fs::path base = fs::temp_directory_path() / fs::unique_path("http_tests-%%%%-%%%%");
+	fs::create_directories(base / "root");
+	{
+		std::ofstream((base / "root" / "a.txt").string().c_str()) << "inside";
+		std::ofstream((base / "secret.txt").string().c_str()) << "outside";
+	}
+	boost::system::error_code ec;
+	fs::create_symlink(base / "root" / "a.txt", base / "root" / "in.txt", ec);
+	if (!ec)
+		fs::create_symlink(base / "secret.txt", base / "root" / "out.txt", ec);
+	if (!ec)
+		fs::create_directory_symlink(base, base / "root" / "up", ec);
+	if (ec)
+	{
+		BOOST_TEST_MESSAGE("can not create symbolic links: " << ec.message());
+		fs::remove_all(base, ec);
+		return;
+	}
+
+	{
+		static_file_handler handler((base / "root").string(), 1);
+		BOOST_CHECK(handler.open(0, "a.txt"));
+		BOOST_CHECK(handler.open(0, "in.txt"));
+		BOOST_CHECK(!handler.open(0, "out.txt"));
+		BOOST_CHECK(!handler.open(0, "up/secret.txt"));
+		BOOST_CHECK(handler.open(0, "up/root/a.txt"));
+	}
+	{
+		static_file_options options;
+		options.follow_symlinks = true;
+		static_file_handler handler((base / "root").string(), 1, options);
+		BOOST_CHECK(handler.open(0, "out.txt"));
+		BOOST_CHECK(handler.open(0, "up/secret.txt"));
+	}
+	fs::remove_all(base, ec);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(multipart)
+
+namespace {
+
+	struct collected_part
+	{
+		std::string name;
+		std::string filename;
+		std::string data;
+		bool ended;
+	};
+
+	// 把 multipart_parser 的回调收集起来, 和 split_multipart 的结果比较.
+	struct part_collector
+	{
+		void on_part(const multipart_part& p)
+		{
+			collected_part c;
+			c.name.assign(p.name.data(), p.name.size());
+			c.filename.assign(p.filename.data(), p.filename.size());
+			c.ended = false;
+			result.push_back(c);
+		}
+
+		void on_data(const char* data, std::size_t size)
+		{
+			BOOST_REQUIRE(!result.empty());
+			result.back().data.append(data, size);
+		}
+
+		void on_end()
+		{
+			BOOST_REQUIRE(!result.empty());
+			BOOST_CHECK(!result.back().ended);
+			result.back().ended = true;
+		}
+
+		std::vector<collected_part> result;
+	};
+
+	const char boundary[] = "----WebKitFormBoundary7MA4YWxkTrZu0gW";
+
+	std::string multipart_body()
+	{
+		std::string d = std::string("\r\n--") + boundary;
+		// 内容里有分隔符的各种前缀, 只有完整的分隔符才算.
+		return "preamble, ignored" + d + "\r\n"
+			"Content-Disposition: form-data; name=\"a\"\r\n\r\n"
+			"value of a" + d.substr(0, d.size() - 1) + "X and more\r\n--" + boundary + "\r\n"
+			"Content-Disposition: form-data; name=\"f\"; filename=\"x.bin\"\r\n"
+			"Content-Type: application/octet-stream\r\n\r\n"
+			"\r\n\r\n-\r\n--\r\n---" + std::string(boundary, 10) + "\r" + d + "\r\n"
+			"Content-Disposition: form-data; name=\"empty\"\r\n\r\n" + d + "--\r\nepilogue";
+	}
+
+	void parse_split(const std::string& body, const std::vector<std::size_t>& cuts, part_collector& c)
+	{
+		multipart_parser parser(boundary,
+			boost::bind(&part_collector::on_part, &c, _1),
+			boost::bind(&part_collector::on_data, &c, _1, _2),
+			boost::bind(&part_collector::on_end, &c));
+		boost::tribool result = boost::indeterminate;
+		std::size_t begin = 0;
+		for (std::size_t i = 0; i <= cuts.size(); ++i)
+		{
+			std::size_t end = i < cuts.size() ? cuts[i] : body.size();
+			result = parser.parse(body.data() + begin, end - begin);
+			begin = end;
+		}
+		BOOST_CHECK(is_true(result));
+	}
+
+	void check_same(const std::vector<multipart_part>& expected, const part_collector& c)
+	{
+		BOOST_REQUIRE_EQUAL(c.result.size(), expected.size());
+		for (std::size_t i = 0; i < expected.size(); ++i)
+		{
+			BOOST_CHECK_EQUAL(c.result[i].name, std::string(expected[i].name.data(), expected[i].name.size()));
+			BOOST_CHECK_EQUAL(c.result[i].filename, std::string(expected[i].filename.data(), expected[i].filename.size()));
+			BOOST_CHECK(c.result[i].data == std::string(expected[i].data.data(), expected[i].data.size()));
+			BOOST_CHECK(c.result[i].ended);
+		}
+	}
+
+}
+
+// 在每个位置切成两段, 分隔符跨在两段之间时也只找到一次.
+BOOST_AUTO_TEST_CASE(split_at_every_offset)
+{
+	std::string body = multipart_body();
+	std::vector<multipart_part> expected;
+	BOOST_REQUIRE(split_multipart(body, boundary, expected));
+	BOOST_REQUIRE_EQUAL(expected.size(), 3u);
+
+	for (std::size_t cut = 0; cut <= body.size(); ++cut)
+	{
+		BOOST_TEST_CONTEXT("cut at " << cut)
+		{
+			part_collector c;
+			parse_split(body, std::vector<std::size_t>(1, cut), c);
+			check_same(expected, c);
+		}
+	}
+}
+
+// 每次只给一个字节, 尾巴要跨过很多次输入.
+BOOST_AUTO_TEST_CASE(one_byte_at_a_time)
+{
+	std::string body = multipart_body();
+	std::vector<multipart_part> expected;
+	BOOST_REQUIRE(split_multipart(body, boundary, expected));
+
+	std::vector<std::size_t> cuts;
+	for (std::size_t i = 1; i < body.size(); ++i)
+		cuts.push_back(i);
+	part_collector c;
+	parse_split(body, cuts, c);
+	check_same(expected, c);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(chunked_decoding)
+
+namespace {
+
+	// 按 cuts 切开输入逐段解码, 返回是否完整以及解出的 body.
+	boost::tribool decode_split(const std::string& input, const std::vector<std::size_t>& cuts,
+		std::string& body, std::size_t& consumed)
+	{
+		chunked_decoder decoder;
+		std::size_t begin = 0;
+		for (std::size_t i = 0; i <= cuts.size(); ++i)
+		{
+			std::size_t end_offset = i < cuts.size() ? cuts[i] : input.size();
+			const char* p = input.data() + begin;
+			const char* end = input.data() + end_offset;
+			for (;;)
+			{
+				const char* data = 0;
+				std::size_t size = 0;
+				boost::tribool result = decoder.decode(p, end, data, size);
+				if (!boost::indeterminate(result))
+				{
+					consumed = p - input.data();
+					return result;
+				}
+				if (size == 0)
+					break;
+				body.append(data, size);
+			}
+			BOOST_CHECK(p == end);
+			begin = end_offset;
+		}
+		consumed = input.size();
+		return boost::indeterminate;
+	}
+
+}
+
+BOOST_AUTO_TEST_CASE(split_at_every_offset)
+{
+	const std::string input =
+		"5\r\nhello\r\n"
+		"1A;name=value\r\nabcdefghijklmnopqrstuvwxyz\r\n"
+		"0\r\n"
+		"X-Trailer: 1\r\n"
+		"\r\n"
+		"GET /next HTTP/1.1\r\n";
+	const std::size_t end_of_body = input.find("GET");
+
+	for (std::size_t cut = 0; cut <= input.size(); ++cut)
+	{
+		BOOST_TEST_CONTEXT("cut at " << cut)
+		{
+			std::string body;
+			std::size_t consumed = 0;
+			boost::tribool result = decode_split(input, std::vector<std::size_t>(1, cut), body, consumed);
+			BOOST_CHECK(is_true(result));
+			BOOST_CHECK_EQUAL(body, "helloabcdefghijklmnopqrstuvwxyz");
+			// 后面的 pipelining 请求不能被吃掉.
+			BOOST_CHECK_EQUAL(consumed, end_of_body);
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(incomplete_and_malformed)
+{
+	std::string body;
+	std::size_t consumed = 0;
+	std::vector<std::size_t> none;
+	BOOST_CHECK(boost::indeterminate(decode_split("5\r\nhel", none, body, consumed)));
+	BOOST_CHECK(boost::indeterminate(decode_split("0\r\n", none, body, consumed)));
+
+	const char* const bad[] =
+	{
+		"\r\n",							// 没有长度.
+		"z\r\n",
+		"5\rx",						// 长度行不是 CRLF 结尾.
+		"3\r\nabcX\r\n",				// 数据后面不是 CRLF.
+		"11111111111111111\r\n",		// 超过 16 位十六进制.
+		"0\r\n\rx",
+	};
+	for (std::size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i)
+	{
+		BOOST_TEST_CONTEXT("input " << i)
+		{
+			body.clear();
+			BOOST_CHECK(is_false(decode_split(bad[i], none, body, consumed)));
+		}
+	}
+
+	// 长度的十六进制不区分大小写.
+	body.clear();
+	BOOST_CHECK(is_true(decode_split("a\r\n0123456789\r\nA\r\n0123456789\r\n0\r\n\r\n", none, body, consumed)));
+	BOOST_CHECK_EQUAL(body.size(), 20u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(url_decoding)
+
+namespace {
+
+	int hex_digit(char c)
+	{
+		if (c >= '0' && c <= '9') return c - '0';
+		if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+		if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+		return -1;
+	}
+
+	// 逐字节的参考实现.
+	std::string reference_decode(const std::string& in, bool plus_as_space)
+	{
+		std::string out;
+		for (std::size_t i = 0; i < in.size(); ++i)
+		{
+			if (in[i] == '+' && plus_as_space)
+				out += ' ';
+			else if (in[i] == '%' && i + 2 < in.size() && hex_digit(in[i + 1]) >= 0 && hex_digit(in[i + 2]) >= 0)
+			{
+				out += static_cast<char>(hex_digit(in[i + 1]) * 16 + hex_digit(in[i + 2]));
+				i += 2;
+			}
+			else
+				out += in[i];
+		}
+		return out;
+	}
+
+	void check_decode(const std::string& in)
+	{
+		for (int plus = 0; plus < 2; ++plus)
+		{
+			BOOST_TEST_CONTEXT("input \"" << in << "\" plus_as_space " << plus)
+			{
+				std::string expected = reference_decode(in, plus != 0);
+				std::string buffer = in;
+				std::size_t size = url_decode_in_place(buffer.empty() ? 0 : &buffer[0], buffer.size(), plus != 0);
+				BOOST_CHECK(buffer.substr(0, size) == expected);
+
+				std::string copied;
+				url_decode(in, copied, plus != 0);
+				BOOST_CHECK(copied == expected);
+			}
+		}
+	}
+
+}
+
+BOOST_AUTO_TEST_CASE(in_place_matches_reference)
+{
+	const char* const inputs[] =
+	{
+		"", "plain", "a+b", "%20", "%2", "%", "%%41", "%zz%41", "100%", "%4a%4A",
+		"%E4%B8%AD%E6%96%87", "a%00b", "+%2B+", "%41%42%43%44%45%46%47%48%49%4A%4B%4C%4D%4E%4F%50%51",
+	};
+	for (std::size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); ++i)
+		check_decode(inputs[i]);
+
+	// 转义落在 SIMD 分块的每个位置, 包括跨块和结尾不完整的.
+	const std::string plain(48, 'x');
+	const char* const escapes[] = { "%41", "+", "%4", "%", "%g1" };
+	for (std::size_t e = 0; e < sizeof(escapes) / sizeof(escapes[0]); ++e)
+	{
+		for (std::size_t position = 0; position <= plain.size(); ++position)
+		{
+			std::string in = plain;
+			in.insert(position, escapes[e]);
+			check_decode(in);
+			check_decode(in.substr(0, position + 2));
+		}
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(header_lookup)
+
+namespace {
+
+	struct test_header
+	{
+		explicit test_header(const std::string& n) : name(n) {}
+		std::string name;
+	};
+
+	std::string upper(std::string s)
+	{
+		for (std::size_t i = 0; i < s.size(); ++i)
+			if (s[i] >= 'a' && s[i] <= 'z')
+				s[i] -= 'a' - 'A';
+		return s;
+	}
+
+}
+
+BOOST_AUTO_TEST_CASE(find_header_id_known_and_other)
+{
+	for (int i = 0; i < header_known_count; ++i)
+	{
+		header_id id = static_cast<header_id>(i);
+		std::string name(header_name(id).data(), header_name(id).size());
+		BOOST_TEST_CONTEXT(name)
+		{
+			BOOST_CHECK_EQUAL(find_header_id(name), id);
+			BOOST_CHECK_EQUAL(find_header_id(upper(name)), id);
+			// 同样长度, 只差最后一个字符.
+			std::string other = name;
+			other[other.size() - 1] = other[other.size() - 1] == 'x' ? 'y' : 'x';
+			BOOST_CHECK_EQUAL(find_header_id(other), header_other);
+		}
+	}
+	BOOST_CHECK_EQUAL(find_header_id(""), header_other);
+	BOOST_CHECK_EQUAL(find_header_id("te"), header_other);
+	BOOST_CHECK_EQUAL(find_header_id("x-request-id"), header_other);
+	BOOST_CHECK_EQUAL(find_header_id("Content-Length "), header_other);
+}
+
+BOOST_AUTO_TEST_CASE(index_finds_every_header)
+{
+	// 非常用头部比哈希表的槽多, 放不下的要靠线性查找.
+	std::vector<test_header> headers;
+	headers.push_back(test_header("Host"));
+	for (int i = 0; i < HTTP_HEADER_HASH_SLOTS * 2; ++i)
+		headers.push_back(test_header("X-Custom-" + std::to_string(i)));
+	headers.push_back(test_header("host"));
+	headers.push_back(test_header("x-custom-0"));
+	headers.push_back(test_header("Content-Type"));
+
+	header_index index;
+	for (std::size_t i = 0; i < headers.size(); ++i)
+		index.add(find_header_id(headers[i].name), headers);
+	BOOST_CHECK_EQUAL(index.size(), headers.size());
+
+	// 重复的头部找到第一个.
+	BOOST_CHECK_EQUAL(index.find(header_host), 0u);
+	BOOST_CHECK_EQUAL(index.find("HOST", headers), 0u);
+	BOOST_CHECK_EQUAL(index.find("x-CUSTOM-0", headers), 1u);
+	BOOST_CHECK_EQUAL(index.find(header_content_type), headers.size() - 1);
+	for (int i = 0; i < HTTP_HEADER_HASH_SLOTS * 2; ++i)
+		BOOST_CHECK_EQUAL(index.find(upper("x-custom-" + std::to_string(i)), headers), static_cast<std::size_t>(i + 1));
+	BOOST_CHECK_EQUAL(index.find("x-missing", headers), static_cast<std::size_t>(header_index::npos));
+	BOOST_CHECK_EQUAL(index.find(header_cookie), static_cast<std::size_t>(header_index::npos));
+
+	index.clear();
+	BOOST_CHECK_EQUAL(index.size(), 0u);
+	BOOST_CHECK_EQUAL(index.find(header_host), static_cast<std::size_t>(header_index::npos));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(content_length)
+
+namespace {
+
+	// 只带 Content-Length 头部的请求, normalise 的结果.
+	bool normalise(const std::vector<std::string>& values, boost::uint64_t& length)
+	{
+		request req;
+		req.method = "POST";
+		req.http_version_major = 1;
+		req.http_version_minor = 1;
+		req.add_header("Host", "127.0.0.1", header_host);
+		for (std::size_t i = 0; i < values.size(); ++i)
+			req.add_header(i % 2 ? "content-length" : "Content-Length", values[i], header_content_length);
+		bool ok = req.normalise();
+		length = req.content_length;
+		return ok;
+	}
+
+	bool normalise(const std::string& value, boost::uint64_t& length)
+	{
+		return normalise(std::vector<std::string>(1, value), length);
+	}
+
+}
+
+BOOST_AUTO_TEST_CASE(digits_only)
+{
+	boost::uint64_t length = 1;
+	BOOST_CHECK(normalise(std::vector<std::string>(), length));
+	BOOST_CHECK_EQUAL(length, 0u);
+	BOOST_CHECK(normalise("0", length));
+	BOOST_CHECK_EQUAL(length, 0u);
+	BOOST_CHECK(normalise("5", length));
+	BOOST_CHECK_EQUAL(length, 5u);
+	BOOST_CHECK(normalise(" \t42\t ", length));
+	BOOST_CHECK_EQUAL(length, 42u);
+	BOOST_CHECK(normalise("18446744073709551615", length));
+	BOOST_CHECK_EQUAL(length, 18446744073709551615ull);
+
+	const char* bad[] = { "", " ", "5abc", "abc", "-1", "+5", "5 5", "5,5", "0x10", "1.0",
+		"18446744073709551616", "18446744073709551617", "99999999999999999999" };
+	for (std::size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i)
+	{
+		BOOST_TEST_CONTEXT("Content-Length: '" << bad[i] << "'")
+		{
+			BOOST_CHECK(!normalise(bad[i], length));
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(duplicates_must_agree)
+{
+	boost::uint64_t length = 0;
+	std::vector<std::string> values;
+	values.push_back("7");
+	values.push_back(" 7");
+	BOOST_CHECK(normalise(values, length));
+	BOOST_CHECK_EQUAL(length, 7u);
+
+	values.push_back("8");
+	BOOST_CHECK(!normalise(values, length));
+
+	values.clear();
+	values.push_back("7");
+	values.push_back("7x");
+	BOOST_CHECK(!normalise(values, length));
+
+	values.clear();
+	values.push_back("");
+	values.push_back("7");
+	BOOST_CHECK(!normalise(values, length));
+}
+
+// 不合法的 Content-Length 直接断开, 藏在 body 里的请求不会被执行.
+BOOST_AUTO_TEST_CASE(malformed_closes_connection)
+{
+	test_server s;
+	int hits = 0;
+	s.server.add_uri_handler("/hit", [&hits](const request&, http_connection_ptr conn, http_connection_manager&)
+	{
+		++hits;
+		conn->write_response("hit");
+	});
+	s.start();
+
+	const char* requests[] = {
+		"POST /hit HTTP/1.1\r\nHost: 127.0.0.1\r\nContent-Length: 18446744073709551617\r\n\r\n"
+			"xGET /hit HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n",
+		"POST /hit HTTP/1.1\r\nHost: 127.0.0.1\r\nContent-Length: 1abc\r\n\r\n"
+			"xGET /hit HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n",
+		"POST /hit HTTP/1.1\r\nHost: 127.0.0.1\r\nContent-Length: 1\r\nContent-Length: 0\r\n\r\n"
+			"xGET /hit HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n",
+	};
+	for (std::size_t i = 0; i < sizeof(requests) / sizeof(requests[0]); ++i)
+	{
+		client cl;
+		// 服务器断开时 fetch 返回已经收到的内容, 这里应该什么也没有.
+		BOOST_CHECK_EQUAL(cl.fetch(requests[i], "hit"), "");
+	}
+	BOOST_CHECK_EQUAL(hits, 0);
+
+	client cl;
+	BOOST_CHECK(cl.fetch("POST /hit HTTP/1.1\r\nHost: 127.0.0.1\r\nContent-Length: 1\r\n\r\nx", "hit").find("hit") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(placement)
+
+namespace {
+
+	// 计数由其它线程更新, 等到它变成 expected 或者超时.
+	std::size_t wait_for_connections(io_service_pool& pool, std::size_t expected)
+	{
+		for (int i = 0; i < 300; ++i)
+		{
+			std::size_t count = pool.load(0).connections.load();
+			if (count == expected)
+				return count;
+			boost::this_thread::sleep_for(boost::chrono::milliseconds(10));
+		}
+		return pool.load(0).connections.load();
+	}
+
+}
+
+// 监听器预先创建的连接还没有 socket, 不算在负载里.
+BOOST_AUTO_TEST_CASE(idle_listener_counts_nothing)
+{
+	test_server s;
+	s.server.add_uri_handler("/hit", [](const request&, http_connection_ptr conn, http_connection_manager&)
+	{
+		conn->write_response("hit");
+	});
+	s.start();
+
+	{
+		client cl;
+		BOOST_REQUIRE(cl.fetch("GET /hit HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n", "hit").find("hit") != std::string::npos);
+		BOOST_CHECK_EQUAL(s.pool.load(0).connections.load(), 1u);
+	}
+
+	// 客户端断开后, 只剩下等待下一次 accept 的连接.
+	BOOST_CHECK_EQUAL(wait_for_connections(s.pool, 0), 0u);
+	BOOST_CHECK_EQUAL(s.pool.load(0).requests.load(), 0u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(cpu_list)
+
+BOOST_AUTO_TEST_CASE(lists_and_masks)
+{
+	std::vector<int> cpus;
+	BOOST_REQUIRE(cpu_topology::parse_cpu_list("0-3, 8,10-11,2", cpus));
+	const int list[] = { 0, 1, 2, 3, 8, 10, 11 };
+	BOOST_CHECK_EQUAL_COLLECTIONS(cpus.begin(), cpus.end(), list, list + sizeof(list) / sizeof(list[0]));
+
+	BOOST_REQUIRE(cpu_topology::parse_cpu_list("0x1,0000000a", cpus));
+	const int mask[] = { 1, 3, 32 };
+	BOOST_CHECK_EQUAL_COLLECTIONS(cpus.begin(), cpus.end(), mask, mask + sizeof(mask) / sizeof(mask[0]));
+}
+
+// 超出范围的编号不能展开成巨大的列表.
+BOOST_AUTO_TEST_CASE(rejects_malformed_and_out_of_range)
+{
+	const char* bad[] = { "", ",", "-", "-3", "3-", "a", "1a", "1-2-3", "3-1", "+1", "0x", "0xg",
+		"63-64000", "0-2147483647", "2147483648", "99999999999999999999", "0-99999999999999999999",
+		"0x10000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+		"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+		"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000" };
+	for (std::size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i)
+	{
+		BOOST_TEST_CONTEXT("cpus '" << bad[i] << "'")
+		{
+			std::vector<int> cpus;
+			BOOST_CHECK(!cpu_topology::parse_cpu_list(bad[i], cpus));
+			BOOST_CHECK_LE(cpus.size(), 64u);
+		}
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(routing)
+
+namespace {
+
+	void no_op(const request&, http_connection_ptr, http_connection_manager&) {}
+
+	// 匹配到的路由的模式, 没有匹配时为空; 参数按 "name=value;" 拼起来.
+	std::string route_of(const http_router& router, const std::string& path, std::string& params)
+	{
+		http_router::params_type matched;
+		const http_route* route = router.find("get", path, matched);
+		params.clear();
+		for (std::size_t i = 0; i < matched.size(); ++i)
+			params += std::string(matched[i].first.data(), matched[i].first.size()) + "="
+				+ std::string(matched[i].second.data(), matched[i].second.size()) + ";";
+		return route ? route->pattern : std::string();
+	}
+
+}
+
+// 路径段中间的 ':' 和 '*' 是普通字符, 只能原样匹配.
+BOOST_AUTO_TEST_CASE(markers_inside_a_segment_are_literal)
+{
+	http_router router;
+	BOOST_REQUIRE(router.add("get", "/files/a:b", no_op));
+	BOOST_REQUIRE(router.add("get", "/v1/x*y", no_op));
+	BOOST_REQUIRE(router.add("get", "/users/:id/x:y", no_op));
+
+	std::string params;
+	BOOST_CHECK_EQUAL(route_of(router, "/files/a:b", params), "/files/a:b");
+	BOOST_CHECK_EQUAL(params, "");
+	BOOST_CHECK_EQUAL(route_of(router, "/files/axyz", params), "");
+	BOOST_CHECK_EQUAL(route_of(router, "/files/a", params), "");
+	BOOST_CHECK_EQUAL(route_of(router, "/v1/x*y", params), "/v1/x*y");
+	BOOST_CHECK_EQUAL(params, "");
+	BOOST_CHECK_EQUAL(route_of(router, "/v1/x", params), "");
+	BOOST_CHECK_EQUAL(route_of(router, "/v1/xzzy", params), "");
+	BOOST_CHECK_EQUAL(route_of(router, "/v1/x/y", params), "");
+	BOOST_CHECK_EQUAL(route_of(router, "/users/7/x:y", params), "/users/:id/x:y");
+	BOOST_CHECK_EQUAL(params, "id=7;");
+	BOOST_CHECK_EQUAL(route_of(router, "/users/7/xzy", params), "");
+}
+
+BOOST_AUTO_TEST_CASE(literal_and_parameter_side_by_side)
+{
+	http_router router;
+	BOOST_REQUIRE(router.add("get", "/files/a:b", no_op));
+	BOOST_REQUIRE(router.add("get", "/files/:name", no_op));
+	BOOST_REQUIRE(router.add("get", "/v1/x*y", no_op));
+	BOOST_REQUIRE(router.add("get", "/v1/*rest", no_op));
+	// 名字不同的参数不能放在同一位置, 段中间的 ':' 不算参数.
+	BOOST_CHECK(router.add("get", "/files/b:c", no_op));
+	BOOST_CHECK(!router.add("get", "/files/:other", no_op));
+
+	std::string params;
+	BOOST_CHECK_EQUAL(route_of(router, "/files/a:b", params), "/files/a:b");
+	BOOST_CHECK_EQUAL(params, "");
+	BOOST_CHECK_EQUAL(route_of(router, "/files/a:c", params), "/files/:name");
+	BOOST_CHECK_EQUAL(params, "name=a:c;");
+	BOOST_CHECK_EQUAL(route_of(router, "/files/readme", params), "/files/:name");
+	BOOST_CHECK_EQUAL(params, "name=readme;");
+	BOOST_CHECK_EQUAL(route_of(router, "/v1/x*y", params), "/v1/x*y");
+	BOOST_CHECK_EQUAL(params, "");
+	BOOST_CHECK_EQUAL(route_of(router, "/v1/x*y/z", params), "/v1/*rest");
+	BOOST_CHECK_EQUAL(params, "rest=x*y/z;");
+}
+
+BOOST_AUTO_TEST_CASE(malformed_patterns)
+{
+	http_router router;
+	BOOST_CHECK(!router.add("get", "", no_op));
+	BOOST_CHECK(!router.add("get", "files", no_op));
+	BOOST_CHECK(!router.add("get", "/a/:", no_op));
+	BOOST_CHECK(!router.add("get", "/a/:/b", no_op));
+	BOOST_CHECK(!router.add("get", "/a/*", no_op));
+	BOOST_CHECK(!router.add("get", "/a/*rest/b", no_op));
+	BOOST_CHECK(router.add("get", "/a/b:", no_op));
+	BOOST_CHECK(router.add("get", "/a/b*", no_op));
+	BOOST_CHECK(!router.add("get", "/a/b:", no_op));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
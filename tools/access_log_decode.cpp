@@ -0,0 +1,143 @@
+﻿//
+// Copyright (C) 2013 Jack.
+//
+// Author: jack
+// Email:  jack.wgm@gmail.com
+//
+
+// 把 http_server 写的二进制访问日志转成文本或者 JSON, 每条记录一行.
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/asio/ip/address.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/program_options.hpp>
+namespace po = boost::program_options;
+
+#include "include/access_log.hpp"
+
+using namespace http;
+
+namespace {
+
+	std::string format_time(boost::uint64_t microseconds)
+	{
+		boost::posix_time::ptime t = boost::posix_time::ptime(boost::gregorian::date(1970, 1, 1))
+			+ boost::posix_time::seconds(static_cast<long>(microseconds / 1000000))
+			+ boost::posix_time::microseconds(static_cast<long>(microseconds % 1000000));
+		return boost::posix_time::to_iso_extended_string(t) + "Z";
+	}
+
+	std::string format_address(const access_log_entry& e)
+	{
+		if (e.family == 4)
+		{
+			boost::asio::ip::address_v4::bytes_type bytes;
+			std::memcpy(bytes.data(), e.address, bytes.size());
+			return boost::asio::ip::address_v4(bytes).to_string();
+		}
+		if (e.family == 6)
+		{
+			boost::asio::ip::address_v6::bytes_type bytes;
+			std::memcpy(bytes.data(), e.address, bytes.size());
+			return boost::asio::ip::address_v6(bytes).to_string();
+		}
+		return "-";
+	}
+
+	void print_text(const access_log_entry& e)
+	{
+		std::string status = e.status ? std::to_string(e.status) : "-";
+		std::printf("%s %s:%u %s route=%u %s %u %uus\n",
+			format_time(e.timestamp).c_str(), format_address(e).c_str(), e.port,
+			access_log_method_name(e.method), e.route, status.c_str(), e.bytes, e.latency);
+	}
+
+	void print_json(const access_log_entry& e)
+	{
+		// 字段都是数字或者不需要转义的字符串.
+		std::printf("{\"time\":\"%s\",\"address\":\"%s\",\"port\":%u,\"method\":\"%s\",\"route\":%u,"
+			"\"status\":%u,\"bytes\":%u,\"latency_us\":%u}\n",
+			format_time(e.timestamp).c_str(), format_address(e).c_str(), e.port,
+			access_log_method_name(e.method), e.route, e.status, e.bytes, e.latency);
+	}
+
+	bool decode(const std::string& path, bool json)
+	{
+		std::ifstream file(path.c_str(), std::ios_base::in | std::ios_base::binary);
+		access_log_header header;
+		if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)))
+		{
+			std::cerr << path << ": can not read header\n";
+			return false;
+		}
+		if (std::memcmp(header.magic, access_log_magic, sizeof(access_log_magic)) != 0
+			|| header.version != access_log_version || header.entry_size != sizeof(access_log_entry))
+		{
+			std::cerr << path << ": not an access log of version " << access_log_version << "\n";
+			return false;
+		}
+
+		// 服务器异常退出时 count 也是准确的, 记录先写, count 后更新.
+		access_log_entry entry;
+		for (boost::uint64_t i = 0; i < header.count && i < header.capacity; ++i)
+		{
+			if (!file.read(reinterpret_cast<char*>(&entry), sizeof(entry)))
+			{
+				std::cerr << path << ": truncated after " << i << " entries\n";
+				return false;
+			}
+			if (json)
+				print_json(entry);
+			else
+				print_text(entry);
+		}
+		return true;
+	}
+
+}
+
+int main(int argc, char** argv)
+{
+	bool json = false;
+	std::vector<std::string> files;
+
+	po::options_description desc("usage: access_log_decode [options] file...");
+	desc.add_options()
+		("help,h", "help message")
+		("json", po::bool_switch(&json), "print one JSON object per entry")
+		("file", po::value<std::vector<std::string> >(&files), "access log files")
+		;
+	po::positional_options_description positional;
+	positional.add("file", -1);
+
+	try
+	{
+		po::variables_map vm;
+		po::store(po::command_line_parser(argc, argv).options(desc).positional(positional).run(), vm);
+		po::notify(vm);
+
+		if (vm.count("help") || files.empty())
+		{
+			std::cout << desc << "\n";
+			return files.empty() ? 1 : 0;
+		}
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << e.what() << "\n";
+		return 1;
+	}
+
+	int result = 0;
+	for (std::size_t i = 0; i < files.size(); ++i)
+	{
+		if (!decode(files[i], json))
+			result = 1;
+	}
+	return result;
+}